@@ -92,6 +92,9 @@ const MachineRegisterSize = constexpr (sizeof(CPURegister))
 const SlotSize = constexpr (sizeof(Register))
 const SeenMultipleCalleeObjects = 1
 
+# The caller's frame pointer is saved at offset 0 of a call frame, as in LowLevelInterpreter.asm.
+const CallerFrame = 0
+
 const StackAlignment = constexpr (stackAlignmentBytes())
 const StackAlignmentSlots = constexpr (stackAlignmentRegisters())
 const StackAlignmentMask = StackAlignment - 1
@@ -216,6 +219,11 @@ end
 macro doTest()
     addp 0x1337, wa0
     move 0x21, wa1
+    # An assertion. With asm.rb --profile, its break moves out of line and the
+    # bpeq becomes a bpneq to it.
+    bpeq wa1, 0x21, .argumentsChecked
+    break
+.argumentsChecked:
     call _call_test
     bpeq r0, (0x42211337 + 5), .success
     break
@@ -240,3 +248,17 @@ end)
 global _ipint_trampoline
 _ipint_trampoline:
     jmp _ipint_entry
+
+# ipint_entry without doTest(): what entering and leaving the interpreter costs on
+# its own. Cpp/EntryBenchmark.cc times it against ipint_trampoline.
+global _ipint_prologue_trampoline
+_ipint_prologue_trampoline:
+if (ARM64 or ARM64E or X86_64 or ARMv7)
+    preserveCallerPCAndCFR()
+    saveIPIntRegisters()
+    restoreIPIntRegisters()
+    restoreCallerPCAndCFR()
+    ret
+else
+    break
+end
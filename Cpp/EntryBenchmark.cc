@@ -0,0 +1,217 @@
+// clang++ -O2 -std=c++20 Cpp/EntryBenchmark.cc Cpp/LowLevelInterpreter.cpp -o build/EntryBenchmark -lbenchmark
+// % build/EntryBenchmark [--perf-counters] --benchmark_repetitions=10
+//
+// Times calls into the interpreter: BM_Entry is all of ipint_entry (through
+// ipint_trampoline), BM_Prologue only its preserveCallerPCAndCFR() and
+// saveIPIntRegisters() and their epilogue (ipint_prologue_trampoline), and
+// BM_NativeCall an empty C++ call for reference. BM_Entry minus BM_Prologue is
+// the cost of the body. Besides ns per call each reports cycles/call, which on
+// ARM64 counts ticks of cntvct_el0 (see the counter frequency in the context)
+// and on X86_64 of rdtsc. --perf-counters adds branch and L1 i-cache misses per
+// call where perf_event_open lets us count them.
+
+#include "test.h"
+
+#include "LLIntSymbolMap.h"
+
+#include <benchmark/benchmark.h>
+#include <cstring>
+
+#if CPU(X86_64)
+#include <x86intrin.h>
+#endif
+
+#if OS(LINUX)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace JSC { namespace Wasm {
+
+// The same result as test.cc's, which doTest() checks, without the printing.
+extern "C" uint32_t __attribute__((__used__)) call_test(uint32_t arg1, uint32_t arg2) {
+    return (arg1 << 0) | (arg2 << 16) | (0x42 << 24);
+}
+
+} }
+
+static inline uint64_t cycleCounter()
+{
+#if CPU(ARM64)
+    uint64_t value;
+    __asm__ volatile("isb\n\tmrs %0, cntvct_el0" : "=r"(value) : : "memory");
+    return value;
+#elif CPU(X86_64)
+    _mm_lfence();
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+static inline uint64_t cycleCounterFrequency()
+{
+#if CPU(ARM64)
+    uint64_t value;
+    __asm__ volatile("mrs %0, cntfrq_el0" : "=r"(value));
+    return value;
+#else
+    return 0;
+#endif
+}
+
+static bool s_usePerfCounters = false;
+
+// Counts branch misses and L1 i-cache read misses of this thread, as one group so
+// both cover exactly the same instructions.
+class PerfCounters {
+public:
+    static constexpr unsigned numberOfCounters = 2;
+    static constexpr const char* names[numberOfCounters] = { "branch-misses/call", "icache-misses/call" };
+
+    PerfCounters()
+    {
+#if OS(LINUX)
+        if (!s_usePerfCounters)
+            return;
+        perf_event_attr attributes[numberOfCounters];
+        memset(attributes, 0, sizeof(attributes));
+        attributes[0].type = PERF_TYPE_HARDWARE;
+        attributes[0].config = PERF_COUNT_HW_BRANCH_MISSES;
+        attributes[1].type = PERF_TYPE_HW_CACHE;
+        attributes[1].config = PERF_COUNT_HW_CACHE_L1I | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        for (unsigned i = 0; i < numberOfCounters; ++i) {
+            attributes[i].size = sizeof(perf_event_attr);
+            attributes[i].disabled = !i;
+            attributes[i].exclude_kernel = 1;
+            attributes[i].exclude_hv = 1;
+            attributes[i].read_format = PERF_FORMAT_GROUP;
+            m_fds[i] = syscall(SYS_perf_event_open, &attributes[i], 0, -1, i ? m_fds[0] : -1, 0);
+            if (m_fds[i] < 0) {
+                close();
+                return;
+            }
+        }
+#endif
+    }
+
+    ~PerfCounters() { close(); }
+
+    bool available() const { return m_fds[0] >= 0; }
+
+    void start()
+    {
+#if OS(LINUX)
+        if (!available())
+            return;
+        ioctl(m_fds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+        ioctl(m_fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+#endif
+    }
+
+    // Stops counting and returns false if the counts could not be read.
+    bool stop(uint64_t (&counts)[numberOfCounters])
+    {
+#if OS(LINUX)
+        if (!available())
+            return false;
+        ioctl(m_fds[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+        // With PERF_FORMAT_GROUP this reads the number of counters, then each count.
+        uint64_t values[1 + numberOfCounters];
+        if (read(m_fds[0], values, sizeof(values)) != sizeof(values) || values[0] != numberOfCounters)
+            return false;
+        std::copy_n(values + 1, numberOfCounters, counts);
+        return true;
+#else
+        return false;
+#endif
+    }
+
+private:
+    void close()
+    {
+#if OS(LINUX)
+        for (int& fd : m_fds) {
+            if (fd >= 0)
+                ::close(fd);
+            fd = -1;
+        }
+#endif
+    }
+
+    int m_fds[numberOfCounters] { -1, -1 };
+};
+
+template<typename Function>
+static void measureCalls(benchmark::State& state, Function function)
+{
+    PerfCounters perfCounters;
+    if (s_usePerfCounters && !perfCounters.available())
+        state.SetLabel("perf counters unavailable");
+
+    uint32_t argument = 5;
+    perfCounters.start();
+    uint64_t start = cycleCounter();
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(argument);
+        benchmark::DoNotOptimize(function(argument));
+    }
+    uint64_t cycles = cycleCounter() - start;
+
+    uint64_t counts[PerfCounters::numberOfCounters];
+    bool counted = perfCounters.stop(counts);
+    double calls = state.iterations();
+    state.counters["cycles/call"] = cycles / calls;
+    for (unsigned i = 0; counted && i < PerfCounters::numberOfCounters; ++i)
+        state.counters[PerfCounters::names[i]] = counts[i] / calls;
+}
+
+__attribute__((noinline)) static uint32_t nativeCall(uint32_t argument)
+{
+    __asm__ volatile("");
+    return argument;
+}
+
+static void BM_NativeCall(benchmark::State& state)
+{
+    measureCalls(state, nativeCall);
+}
+BENCHMARK(BM_NativeCall);
+
+static void BM_Prologue(benchmark::State& state)
+{
+    measureCalls(state, ipint_prologue_trampoline);
+}
+BENCHMARK(BM_Prologue);
+
+static void BM_Entry(benchmark::State& state)
+{
+    measureCalls(state, ipint_trampoline);
+}
+BENCHMARK(BM_Entry);
+
+int main(int argc, char** argv)
+{
+    int remaining = 1;
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--perf-counters"))
+            s_usePerfCounters = true;
+        else
+            argv[remaining++] = argv[i];
+    }
+    argc = remaining;
+
+#if ENABLE(LLINT_SYMBOL_MAP)
+    JSC::LLInt::SymbolMap::writePerfMap();
+#endif
+    if (uint64_t frequency = cycleCounterFrequency())
+        benchmark::AddCustomContext("cycle counter frequency (MHz)", std::to_string(frequency / 1000000.0));
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv))
+        return 1;
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
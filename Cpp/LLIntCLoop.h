@@ -0,0 +1,83 @@
+#pragma once
+
+#if ENABLE(C_LOOP)
+
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+namespace JSC { namespace CLoop {
+
+// What the C loop jumps to when a handler dispatches: with labels as values a
+// label's address, which DISPATCH_OPCODE() jumps to directly; otherwise the label's
+// case in the loop's switch (see LowLevelInterpreter.cpp).
+#if ENABLE(COMPUTED_GOTO_OPCODES)
+using Opcode = const void*;
+#else
+using Opcode = uintptr_t;
+#endif
+
+// One of the C loop's registers, which cloop.rb reads as whatever type the
+// instruction at hand wants and assigns any integer, pointer or double to.
+class CLoopRegister {
+public:
+    CLoopRegister() = default;
+
+    template<typename T>
+    CLoopRegister& operator=(T value)
+    {
+        if constexpr (std::is_pointer_v<T>)
+            m_value = reinterpret_cast<uintptr_t>(value);
+        else if constexpr (std::is_floating_point_v<T>) {
+            double bits = value;
+            memcpy(&m_value, &bits, sizeof(m_value));
+        } else if constexpr (std::is_signed_v<T>)
+            m_value = static_cast<int64_t>(value);
+        else
+            m_value = static_cast<uint64_t>(value);
+        return *this;
+    }
+
+    intptr_t i() const { return static_cast<intptr_t>(m_value); }
+    uintptr_t u() const { return static_cast<uintptr_t>(m_value); }
+    int32_t i32() const { return static_cast<int32_t>(m_value); }
+    uint32_t u32() const { return static_cast<uint32_t>(m_value); }
+    int64_t i64() const { return static_cast<int64_t>(m_value); }
+    uint64_t u64() const { return m_value; }
+    int8_t i8() const { return static_cast<int8_t>(m_value); }
+    uint8_t u8() const { return static_cast<uint8_t>(m_value); }
+    int8_t* i8p() const { return reinterpret_cast<int8_t*>(u()); }
+    void* vp() const { return reinterpret_cast<void*>(u()); }
+    double d() const
+    {
+        double value;
+        memcpy(&value, &m_value, sizeof(value));
+        return value;
+    }
+    double bitsAsDouble() const { return d(); }
+    int64_t bitsAsInt64() const { return i64(); }
+    Opcode opcode() const
+    {
+#if ENABLE(COMPUTED_GOTO_OPCODES)
+        return vp();
+#else
+        return u();
+#endif
+    }
+
+private:
+    uint64_t m_value { 0 };
+};
+
+// Runs the interpreter from entry, an opcode that opcode() returned, with a0 and
+// a1 as its first two arguments and a return address that leaves the loop, and
+// returns r0.
+UCPURegister execute(Opcode entry, UCPURegister a0, UCPURegister a1);
+
+// The opcode that enters the C loop at the global or glue label called name, or
+// nullptr if the generated code has no such label.
+const Opcode* opcode(const char* name);
+
+} } // namespace JSC::CLoop
+
+#endif // ENABLE(C_LOOP)
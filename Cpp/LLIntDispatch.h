@@ -0,0 +1,81 @@
+#pragma once
+
+#include <cstdint>
+
+// The handler tables offlineasm emits (see OFFLINE_ASM_DISPATCH_TABLE in
+// LowLevelInterpreter.cpp). Opcode n is the n-th handler defined with commonOp;
+// each table holds that width's handler as an offset from jsc_llint_begin.
+extern "C" {
+void jsc_llint_begin();
+extern const int32_t jsc_llint_dispatch_table_narrow[];
+extern const int32_t jsc_llint_dispatch_table_wide16[];
+extern const int32_t jsc_llint_dispatch_table_wide32[];
+extern const uint32_t jsc_llint_dispatch_table_size;
+// With asm.rb --feature-variants, the CPUFeatures each feature variant's handlers
+// need. Variant i's table of a width follows that width's baseline table, at
+// jsc_llint_dispatch_table_<width> + (i + 1) * jsc_llint_dispatch_table_size.
+extern const uint32_t jsc_llint_dispatch_table_variants[];
+extern const uint32_t jsc_llint_dispatch_table_variant_count;
+}
+
+namespace JSC { namespace LLInt {
+
+enum class OpcodeWidth : uint8_t {
+    Narrow,
+    Wide16,
+    Wide32,
+};
+
+// The optional CPU features handlers can be lowered for. These match CPU_FEATURES
+// in OfflineASMRB/backends.rb.
+using CPUFeatures = uint32_t;
+constexpr CPUFeatures CPUFeatureBMI = 1 << 0; // X86_64: tzcnt and lzcnt.
+
+// The features of the CPU this runs on, detected once (see LowLevelInterpreter.cpp).
+CPUFeatures cpuFeatures();
+
+// The tables of each width, indexed by OpcodeWidth, of the variant that the CPU
+// has every feature of and that needs the most features; the baseline tables if
+// there is none. They are picked the first time this is called.
+inline const int32_t* const* dispatchTables()
+{
+    static const int32_t* const* tables = [] {
+        static const int32_t* result[] = { jsc_llint_dispatch_table_narrow, jsc_llint_dispatch_table_wide16, jsc_llint_dispatch_table_wide32 };
+        CPUFeatures available = cpuFeatures();
+        int best = -1;
+        for (uint32_t i = 0; i < jsc_llint_dispatch_table_variant_count; ++i) {
+            CPUFeatures needed = jsc_llint_dispatch_table_variants[i];
+            if (!(needed & ~available) && (best < 0 || __builtin_popcount(needed) >= __builtin_popcount(jsc_llint_dispatch_table_variants[best])))
+                best = i;
+        }
+        for (auto& table : result)
+            table += (best + 1) * jsc_llint_dispatch_table_size;
+        return result;
+    }();
+    return tables;
+}
+
+inline const void* handler(OpcodeWidth width, uint32_t opcode)
+{
+    return reinterpret_cast<const char*>(&jsc_llint_begin) + dispatchTables()[static_cast<unsigned>(width)][opcode];
+}
+
+// When LLIntAssembly.h was generated with asm.rb --fixed-stride=(1 << strideShift),
+// handler n of a width sits n slots past that width's first handler, and finding
+// it takes no table load. LLIntAssembly.h defines OFFLINE_ASM_FIXED_STRIDE_SHIFT.
+extern "C" {
+void jsc_llint_narrow_handlers();
+void jsc_llint_wide16_handlers();
+void jsc_llint_wide32_handlers();
+}
+
+template<unsigned strideShift>
+inline const void* fixedStrideHandler(OpcodeWidth width, uint32_t opcode)
+{
+    auto base = width == OpcodeWidth::Narrow ? &jsc_llint_narrow_handlers
+        : width == OpcodeWidth::Wide16 ? &jsc_llint_wide16_handlers
+        : &jsc_llint_wide32_handlers;
+    return reinterpret_cast<const char*>(base) + (static_cast<uintptr_t>(opcode) << strideShift);
+}
+
+} } // namespace JSC::LLInt
@@ -5,6 +5,14 @@ namespace JSC {
 
 #define OFFLINE_ASM_OFFSETOF(clazz, field) (static_cast<unsigned>(OBJECT_OFFSETOF(clazz, field)))
 
+// offsets.rb reads offsetExtractorTable straight out of this section. Only for a
+// binary it cannot find the section in does it search for the table's magic numbers.
+#if OS(DARWIN)
+#define OFFLINE_ASM_OFFSETS_SECTION __attribute__((used, section("__DATA,__llint_offsets")))
+#else
+#define OFFLINE_ASM_OFFSETS_SECTION __attribute__((used, section("llint_offsets")))
+#endif
+
 class LLIntOffsetsExtractor {
     // These types are useful since we can't use '<...>' syntax in LLInt offsets extraction. e.g. Vector<int>::m_data
     using Vector = std::vector<int>;
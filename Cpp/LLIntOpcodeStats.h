@@ -0,0 +1,45 @@
+#pragma once
+
+// Counters sum to at most this many entries: three per handler commonOp defines.
+// A LLIntAssembly.h with more handlers fails to assemble.
+#define LLINT_OPCODE_STATS_CAPACITY 3072
+
+#if ENABLE(LLINT_OPCODE_STATS)
+
+#include <cstdint>
+#include <cstdio>
+
+namespace JSC { namespace LLInt {
+
+// Counter n * 3 + w counts entries into width w (narrow, wide16, wide32) of handler
+// n. Every thread bumps its own copy, aligned and sized to whole cache lines so no
+// two threads' counters ever share one.
+struct alignas(64) OpcodeCounters {
+    uint64_t counts[LLINT_OPCODE_STATS_CAPACITY];
+};
+static_assert(!(sizeof(OpcodeCounters) % 64));
+
+} } // namespace JSC::LLInt
+
+extern "C" {
+extern thread_local JSC::LLInt::OpcodeCounters jsc_llint_opcode_counters;
+// The handler names, NUL-separated, and the number of counters in use.
+extern const char jsc_llint_opcode_stats_names[];
+extern const uint32_t jsc_llint_opcode_stats_count;
+}
+
+namespace JSC { namespace LLInt { namespace OpcodeStats {
+
+// Makes the calling thread's counters visible to dump(). Call it on each thread
+// before it first enters the interpreter; when the thread exits its counts are
+// kept in the totals.
+void registerCurrentThread();
+
+// Prints the count of every handler width that was entered at least once, summed
+// over all registered threads, most frequent first. Counts of threads that are
+// still running may be slightly behind.
+void dump(FILE* = stderr);
+
+} } } // namespace JSC::LLInt::OpcodeStats
+
+#endif // ENABLE(LLINT_OPCODE_STATS)
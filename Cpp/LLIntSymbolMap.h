@@ -0,0 +1,38 @@
+#pragma once
+
+#if ENABLE(LLINT_SYMBOL_MAP)
+
+#include <cstdint>
+#include <cstdio>
+
+namespace JSC { namespace LLInt {
+
+// Where the code of one global or glue label (every handler width among them)
+// starts, as an offset from jsc_llint_begin, and how many bytes it takes.
+struct SymbolMapEntry {
+    int32_t offset;
+    uint32_t size;
+};
+
+} } // namespace JSC::LLInt
+
+extern "C" {
+void jsc_llint_begin();
+extern const JSC::LLInt::SymbolMapEntry jsc_llint_symbol_map[];
+// The label names, NUL-separated and in the order of jsc_llint_symbol_map.
+extern const char jsc_llint_symbol_map_names[];
+extern const uint32_t jsc_llint_symbol_map_size;
+}
+
+namespace JSC { namespace LLInt { namespace SymbolMap {
+
+// Prints one "start size name" line per label, in hex, as perf expects in a map file.
+void write(FILE*);
+
+// Appends the map to /tmp/perf-<pid>.map, where perf report and perf top look up
+// addresses that have no symbol of their own. Returns false if that failed.
+bool writePerfMap();
+
+} } } // namespace JSC::LLInt::SymbolMap
+
+#endif // ENABLE(LLINT_SYMBOL_MAP)
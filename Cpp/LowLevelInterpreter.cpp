@@ -2,6 +2,156 @@
 
 #include "LLIntOfflineAsmConfig.h"
 #include "InlineASM.h"
+#include "LLIntDispatch.h"
+#include "LLIntOpcodeStats.h"
+#include "LLIntSymbolMap.h"
+
+#if ENABLE(C_LOOP)
+
+#include "LLIntCLoop.h"
+
+#include <cstring>
+#include <iterator>
+
+//============================================================================
+// Define the opcode dispatch mechanism when using the C loop:
+//
+// LLIntAssembly.h is included into the body of CLoop::run(), and lists its global
+// and glue labels in FOR_EACH_OFFLINE_ASM_CLOOP_LABEL ahead of OFFLINE_ASM_BEGIN.
+// With ENABLE(COMPUTED_GOTO_OPCODES) an opcode is a label's address, and every
+// DISPATCH_OPCODE() is an indirect goto of its own at the end of the handler that
+// dispatches, so each gets its own branch prediction. Compilers without labels as
+// values get the same code with every label also a case of one switch, which each
+// DISPATCH_OPCODE() goes back to.
+
+#define CAST reinterpret_cast
+#define CRASH() __builtin_trap()
+
+#define PUSH(cloopReg) \
+    do { \
+        sp = sp.i8p() - sizeof(CPURegister); \
+        *CAST<CPURegister*>(sp.i8p()) = cloopReg.i(); \
+    } while (false)
+
+#define POP(cloopReg) \
+    do { \
+        cloopReg = *CAST<CPURegister*>(sp.i8p()); \
+        sp = sp.i8p() + sizeof(CPURegister); \
+    } while (false)
+
+#if ENABLE(COMPUTED_GOTO_OPCODES)
+
+#define getOpcode(label) static_cast<Opcode>(&&label)
+#define DISPATCH_OPCODE() goto *opcode
+#define OFFLINE_ASM_CLOOP_OPCODE_IDS
+#define OFFLINE_ASM_CLOOP_DISPATCH_BEGIN DISPATCH_OPCODE();
+#define OFFLINE_ASM_CLOOP_DISPATCH_END
+#define OFFLINE_ASM_GLUE_LABEL(label) label:
+
+#else // !ENABLE(COMPUTED_GOTO_OPCODES)
+
+// Not every label is also the target of a goto.
+#define OFFLINE_ASM_CLOOP_USE_LABEL(label) \
+    do { \
+        if (false) \
+            goto label; \
+    } while (false)
+
+#define OFFLINE_ASM_CLOOP_OPCODE_ID(label) label##_opcodeID,
+#define getOpcode(label) static_cast<Opcode>(label##_opcodeID)
+#define DISPATCH_OPCODE() goto dispatchOpcode
+#define OFFLINE_ASM_CLOOP_OPCODE_IDS \
+    enum : Opcode { FOR_EACH_OFFLINE_ASM_CLOOP_LABEL(OFFLINE_ASM_CLOOP_OPCODE_ID) cloopExit_opcodeID };
+#define OFFLINE_ASM_CLOOP_DISPATCH_BEGIN \
+    dispatchOpcode: \
+    OFFLINE_ASM_CLOOP_USE_LABEL(dispatchOpcode); \
+    switch (opcode) {
+#define OFFLINE_ASM_CLOOP_DISPATCH_END \
+    default: \
+        CRASH(); \
+    }
+#define OFFLINE_ASM_GLUE_LABEL(label) case label##_opcodeID: label: OFFLINE_ASM_CLOOP_USE_LABEL(label);
+
+#endif // ENABLE(COMPUTED_GOTO_OPCODES)
+
+#define OFFLINE_ASM_CLOOP_LABEL_OPCODE(label) getOpcode(label),
+#define OFFLINE_ASM_CLOOP_LABEL_NAME(label) #label,
+
+// The initialization pass only hands out the opcodes, for CLoop::opcode(). Every
+// other pass starts at entry with a return address that leaves the loop.
+#define OFFLINE_ASM_BEGIN \
+    OFFLINE_ASM_CLOOP_OPCODE_IDS \
+    static const Opcode opcodes[] = { FOR_EACH_OFFLINE_ASM_CLOOP_LABEL(OFFLINE_ASM_CLOOP_LABEL_OPCODE) }; \
+    static const char* const names[] = { FOR_EACH_OFFLINE_ASM_CLOOP_LABEL(OFFLINE_ASM_CLOOP_LABEL_NAME) }; \
+    if (isInitializationPass) { \
+        s_opcodes = opcodes; \
+        s_names = names; \
+        s_numberOfOpcodes = std::size(names); \
+        return 0; \
+    } \
+    lr = getOpcode(cloopExit); \
+    opcode = entry; \
+    OFFLINE_ASM_CLOOP_DISPATCH_BEGIN
+
+#define OFFLINE_ASM_END \
+    OFFLINE_ASM_GLUE_LABEL(cloopExit) \
+    return t0.u(); \
+    OFFLINE_ASM_CLOOP_DISPATCH_END
+
+#define OFFLINE_ASM_OPCODE_LABEL(opcode) OFFLINE_ASM_GLUE_LABEL(opcode)
+#define OFFLINE_ASM_GLOBAL_LABEL(label) OFFLINE_ASM_GLUE_LABEL(label)
+#define OFFLINE_ASM_GLOBAL_EXPORT_LABEL(label) OFFLINE_ASM_GLUE_LABEL(label)
+#define OFFLINE_ASM_UNALIGNED_GLOBAL_LABEL(label) OFFLINE_ASM_GLUE_LABEL(label)
+#define OFFLINE_ASM_UNALIGNED_GLOBAL_EXPORT_LABEL(label) OFFLINE_ASM_GLUE_LABEL(label)
+#define OFFLINE_ASM_ALIGNED_GLOBAL_LABEL(label, alignment) OFFLINE_ASM_GLUE_LABEL(label)
+#define OFFLINE_ASM_LOCAL_LABEL(label) label:
+#define OFFLINE_ASM_ALIGN_TRAP(alignment)
+
+namespace JSC { namespace CLoop {
+
+static const Opcode* s_opcodes;
+static const char* const* s_names;
+static size_t s_numberOfOpcodes;
+
+static UCPURegister run(Opcode entry, UCPURegister a0, UCPURegister a1, bool isInitializationPass)
+{
+    constexpr size_t stackSize = 64 * 1024;
+    alignas(16) int8_t stack[stackSize];
+
+    CLoopRegister t0, t1, t2, t3, t5, t6, t7, pc, pcBase, numberTag, notCellMask, metadataTable;
+    CLoopRegister cfr, lr, sp;
+    CLoopRegister d0, d1, d2, d3, d4, d5, d6;
+    Opcode opcode;
+
+    t0 = a0;
+    t1 = a1;
+    sp = stack + stackSize;
+    cfr = sp;
+
+// This is a file generated by offlineasm, which contains all of the C loop's
+// code, as compiled from LowLevelInterpreter.asm.
+#include "../build/LLIntAssembly.h"
+}
+
+UCPURegister execute(Opcode entry, UCPURegister a0, UCPURegister a1)
+{
+    return run(entry, a0, a1, false);
+}
+
+const Opcode* opcode(const char* name)
+{
+    if (!s_opcodes)
+        run({ }, 0, 0, true);
+    for (size_t i = 0; i < s_numberOfOpcodes; ++i) {
+        if (!strcmp(s_names[i], name))
+            return &s_opcodes[i];
+    }
+    return nullptr;
+}
+
+} } // namespace JSC::CLoop
+
+#else // !ENABLE(C_LOOP)
 
 //============================================================================
 // Define the opcode dispatch mechanism when using an ASM loop:
@@ -135,12 +285,176 @@
     LOCAL_LABEL_STRING(label) ":\n" \
     OFFLINE_ASM_ALT_GLOBAL_LABEL(label)
 
-#if OS(LINUX)
+// Handlers and glue get symbols of their own in ELF objects, for debuggers and profilers.
+#if !OS(DARWIN) && !OS(WINDOWS)
 #define OFFLINE_ASM_OPCODE_DEBUG_LABEL(label)  #label ":\n"
 #else
 #define OFFLINE_ASM_OPCODE_DEBUG_LABEL(label)
 #endif
 
+// The opcode -> handler tables offlineasm emits for the handlers commonOp defines, one
+// per width (see LLIntDispatch.h). Entries are 32-bit offsets from jsc_llint_begin, so
+// the tables need no relocations and can stay read-only.
+#if OS(DARWIN)
+#define OFFLINE_ASM_DISPATCH_TABLE_SECTION ".section __TEXT,__const\n"
+#else
+#define OFFLINE_ASM_DISPATCH_TABLE_SECTION ".section .rodata\n"
+#endif
+
+#define OFFLINE_ASM_DISPATCH_TABLE(name) \
+    OFFLINE_ASM_DISPATCH_TABLE_SECTION \
+    ".balign 4\n" \
+    ".globl " SYMBOL_STRING(name) "\n" \
+    HIDE_SYMBOL(name) "\n" \
+    SYMBOL_STRING(name) ":\n"
+
+#define OFFLINE_ASM_DISPATCH_TABLE_ENTRY(label) \
+    ".int " LOCAL_LABEL_STRING(label) " - " SYMBOL_STRING(jsc_llint_begin) "\n"
+
+#define OFFLINE_ASM_DISPATCH_TABLE_SIZE(size) \
+    OFFLINE_ASM_DISPATCH_TABLE(jsc_llint_dispatch_table_size) \
+    ".int " #size "\n"
+
+// The CPUFeatures of each variant whose tables follow the baseline ones.
+#define OFFLINE_ASM_DISPATCH_TABLE_VARIANTS \
+    OFFLINE_ASM_DISPATCH_TABLE(jsc_llint_dispatch_table_variants)
+
+#define OFFLINE_ASM_DISPATCH_TABLE_VARIANT(features, name) \
+    ".int " #features "\n"
+
+#define OFFLINE_ASM_DISPATCH_TABLE_VARIANT_COUNT(count) \
+    OFFLINE_ASM_DISPATCH_TABLE(jsc_llint_dispatch_table_variant_count) \
+    ".int " #count "\n"
+
+#define OFFLINE_ASM_DISPATCH_TABLE_END OFFLINE_ASM_TEXT_SECTION
+
+// Closes the code of a label that starts a handler or some other glue: in ELF
+// objects, where these labels have symbols, it gives the symbol the size of that
+// code so that profilers and debuggers can tell the handlers apart, and everywhere
+// it marks the end for the symbol map.
+#if !OS(DARWIN) && !OS(WINDOWS)
+#define OFFLINE_ASM_LABEL_SIZE(symbol) \
+    ".type " symbol ", function\n" \
+    ".size " symbol ", . - " symbol "\n"
+#else
+#define OFFLINE_ASM_LABEL_SIZE(symbol)
+#endif
+
+#define OFFLINE_ASM_LABEL_END(label) \
+    LOCAL_LABEL_STRING(label##_end) ":\n" \
+    OFFLINE_ASM_LABEL_SIZE(#label)
+
+// With asm.rb --fold-handlers, a handler whose code came out the same as that of
+// one before it is not emitted; its label is made to stand for the other's. It
+// has no OFFLINE_ASM_COUNT_OPCODE of its own, so its entries count as the other's.
+#if !OS(DARWIN) && !OS(WINDOWS)
+#define OFFLINE_ASM_ALIAS_LABEL(alias, label) \
+    ".set " LOCAL_LABEL_STRING(alias) ", " LOCAL_LABEL_STRING(label) "\n" \
+    ".set " #alias ", " LOCAL_LABEL_STRING(label) "\n"
+#else
+#define OFFLINE_ASM_ALIAS_LABEL(alias, label) \
+    ".set " LOCAL_LABEL_STRING(alias) ", " LOCAL_LABEL_STRING(label) "\n"
+#endif
+
+#define OFFLINE_ASM_GLOBAL_LABEL_END(label) \
+    LOCAL_LABEL_STRING(label##_end) ":\n" \
+    OFFLINE_ASM_LABEL_SIZE(SYMBOL_STRING(label))
+
+// With ENABLE(LLINT_SYMBOL_MAP), the offset from jsc_llint_begin and the size of
+// every label's code, and their names, for LLInt::SymbolMap (see LLIntSymbolMap.h).
+#if ENABLE(LLINT_SYMBOL_MAP)
+#define OFFLINE_ASM_SYMBOL_MAP \
+    OFFLINE_ASM_DISPATCH_TABLE(jsc_llint_symbol_map)
+
+#define OFFLINE_ASM_SYMBOL_MAP_ENTRY(label) \
+    ".int " LOCAL_LABEL_STRING(label) " - " SYMBOL_STRING(jsc_llint_begin) "\n" \
+    ".int " LOCAL_LABEL_STRING(label##_end) " - " LOCAL_LABEL_STRING(label) "\n"
+
+#define OFFLINE_ASM_SYMBOL_MAP_GLOBAL_ENTRY(label) \
+    ".int " SYMBOL_STRING(label) " - " SYMBOL_STRING(jsc_llint_begin) "\n" \
+    ".int " LOCAL_LABEL_STRING(label##_end) " - " SYMBOL_STRING(label) "\n"
+
+#define OFFLINE_ASM_SYMBOL_MAP_NAMES \
+    OFFLINE_ASM_DISPATCH_TABLE(jsc_llint_symbol_map_names)
+
+#define OFFLINE_ASM_SYMBOL_MAP_NAME(label) \
+    ".asciz \"" #label "\"\n"
+
+#define OFFLINE_ASM_SYMBOL_MAP_SIZE(size) \
+    OFFLINE_ASM_DISPATCH_TABLE(jsc_llint_symbol_map_size) \
+    ".int " #size "\n" \
+    OFFLINE_ASM_TEXT_SECTION
+#else
+#define OFFLINE_ASM_SYMBOL_MAP
+#define OFFLINE_ASM_SYMBOL_MAP_ENTRY(label)
+#define OFFLINE_ASM_SYMBOL_MAP_GLOBAL_ENTRY(label)
+#define OFFLINE_ASM_SYMBOL_MAP_NAMES
+#define OFFLINE_ASM_SYMBOL_MAP_NAME(label)
+#define OFFLINE_ASM_SYMBOL_MAP_SIZE(size)
+#endif
+
+// With asm.rb --fixed-stride, closes the slot that starts at label. Should the
+// handler have outgrown its slot, this fails to assemble rather than shifting
+// every later handler.
+#define OFFLINE_ASM_FIXED_STRIDE_SLOT_END(label, stride) \
+    ".org " LOCAL_LABEL_STRING(label) " + " #stride "\n"
+
+// With asm.rb --profile, the blocks that only lead to a break (crash and assertion
+// paths) are gathered after all the handlers. On X86_64 ELF they go further, into
+// .text.unlikely; elsewhere conditional branches cannot reach another section
+// reliably (ARM64's b.cond and cbz span 1MB, and Mach-O has no relocation for
+// them at all), so the cold blocks stay at the end of the interpreter.
+#if CPU(X86_64) && !OS(DARWIN)
+#define OFFLINE_ASM_COLD_SECTION_BEGIN ".pushsection .text.unlikely\n"
+#define OFFLINE_ASM_COLD_SECTION_END ".popsection\n"
+#else
+#define OFFLINE_ASM_COLD_SECTION_BEGIN
+#define OFFLINE_ASM_COLD_SECTION_END
+#endif
+
+// With ENABLE(LLINT_OPCODE_STATS), every handler commonOp defines starts by bumping
+// its counter in the calling thread's jsc_llint_opcode_counters (see LLIntOpcodeStats.h).
+// The counters are found through the thread pointer with local-exec TLS, so this
+// only links into executables. The increment clobbers x16/x17 on ARM64 and the flags
+// on X86_64, neither of which is live at a handler's entry.
+#if ENABLE(LLINT_OPCODE_STATS)
+#if OS(DARWIN)
+#error "LLINT_OPCODE_STATS needs ELF thread-local relocations"
+#elif CPU(ARM64) || CPU(ARM64E)
+#define OFFLINE_ASM_COUNT_OPCODE(index) \
+    "mrs x16, tpidr_el0\n" \
+    "add x16, x16, #:tprel_hi12:jsc_llint_opcode_counters, lsl #12\n" \
+    "add x16, x16, #:tprel_lo12_nc:jsc_llint_opcode_counters\n" \
+    "ldr x17, [x16, #" #index " * 8]\n" \
+    "add x17, x17, #1\n" \
+    "str x17, [x16, #" #index " * 8]\n"
+#elif CPU(X86_64)
+#define OFFLINE_ASM_COUNT_OPCODE(index) \
+    "incq %fs:jsc_llint_opcode_counters@tpoff + " #index " * 8\n"
+#else
+#error "LLINT_OPCODE_STATS is not implemented for this CPU"
+#endif
+
+// The handler names, in opcode order, for LLInt::OpcodeStats::dump().
+#define OFFLINE_ASM_OPCODE_STATS_NAMES \
+    OFFLINE_ASM_DISPATCH_TABLE(jsc_llint_opcode_stats_names)
+
+#define OFFLINE_ASM_OPCODE_STATS_NAME(label) \
+    ".asciz \"" #label "\"\n"
+
+#define OFFLINE_ASM_OPCODE_STATS_COUNT(count) \
+    ".if " #count " > " STRINGIZE_VALUE_OF(LLINT_OPCODE_STATS_CAPACITY) "\n" \
+    ".error \"more opcode counters than LLINT_OPCODE_STATS_CAPACITY\"\n" \
+    ".endif\n" \
+    OFFLINE_ASM_DISPATCH_TABLE(jsc_llint_opcode_stats_count) \
+    ".int " #count "\n"
+#else
+#define OFFLINE_ASM_COUNT_OPCODE(index)
+#define OFFLINE_ASM_OPCODE_STATS_NAMES
+#define OFFLINE_ASM_OPCODE_STATS_NAME(label)
+#define OFFLINE_ASM_OPCODE_STATS_COUNT(count)
+#endif
+
 
 // This works around a bug in GDB where, if the compilation unit
 // doesn't have any address range information, its line table won't
@@ -151,6 +465,10 @@
 // up the line number information.
 DEBUGGER_ANNOTATION_MARKER(before_llint_asm)
 
+// With ENABLE(OFFLINE_ASM_OBJECT) the interpreter is not assembled here at all:
+// OfflineASM --object has encoded it into build/LLIntAssembly.o, with the symbols
+// and unwind rules the asm below would have produced, and that is linked instead.
+#if !ENABLE(OFFLINE_ASM_OBJECT)
 
 // We do not set them on Darwin since Mach-O does not support nested cfi_startproc & global symbols.
 // https://github.com/llvm/llvm-project/issues/72802
@@ -205,4 +523,138 @@ asm (
 #endif
 #endif
 
+#endif // !ENABLE(OFFLINE_ASM_OBJECT)
+
 DEBUGGER_ANNOTATION_MARKER(after_llint_asm)
+
+#if CPU(X86_64) && (COMPILER(GCC) || COMPILER(CLANG))
+#include <cpuid.h>
+#endif
+
+namespace JSC { namespace LLInt {
+
+// What dispatchTables() (see LLIntDispatch.h) resolves the handlers of feature
+// variants against, like an ifunc resolver would: asked once, when the tables are
+// first needed, and never again.
+CPUFeatures cpuFeatures()
+{
+    static const CPUFeatures features = [] {
+        CPUFeatures result = 0;
+#if CPU(X86_64) && (COMPILER(GCC) || COMPILER(CLANG))
+        unsigned eax, ebx, ecx, edx;
+        // BMI1 is bit 3 of EBX in leaf 7, LZCNT bit 5 of ECX in leaf 0x80000001.
+        bool bmi1 = __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & (1 << 3));
+        bool lzcnt = __get_cpuid(0x80000001, &eax, &ebx, &ecx, &edx) && (ecx & (1 << 5));
+        if (bmi1 && lzcnt)
+            result |= CPUFeatureBMI;
+#endif
+        return result;
+    }();
+    return features;
+}
+
+} } // namespace JSC::LLInt
+
+#if ENABLE(LLINT_OPCODE_STATS)
+
+#include <algorithm>
+#include <cstring>
+#include <mutex>
+#include <vector>
+
+thread_local JSC::LLInt::OpcodeCounters jsc_llint_opcode_counters;
+
+namespace JSC { namespace LLInt { namespace OpcodeStats {
+
+static std::mutex s_lock;
+static std::vector<OpcodeCounters*> s_liveThreads;
+static uint64_t s_exitedThreads[LLINT_OPCODE_STATS_CAPACITY];
+
+namespace {
+struct ThreadRegistration {
+    ThreadRegistration()
+    {
+        std::lock_guard<std::mutex> locker(s_lock);
+        s_liveThreads.push_back(&jsc_llint_opcode_counters);
+    }
+
+    ~ThreadRegistration()
+    {
+        std::lock_guard<std::mutex> locker(s_lock);
+        for (unsigned i = 0; i < jsc_llint_opcode_stats_count; ++i)
+            s_exitedThreads[i] += jsc_llint_opcode_counters.counts[i];
+        s_liveThreads.erase(std::find(s_liveThreads.begin(), s_liveThreads.end(), &jsc_llint_opcode_counters));
+    }
+};
+}
+
+void registerCurrentThread()
+{
+    static thread_local ThreadRegistration registration;
+}
+
+void dump(FILE* file)
+{
+    std::vector<uint64_t> totals;
+    {
+        std::lock_guard<std::mutex> locker(s_lock);
+        totals.assign(s_exitedThreads, s_exitedThreads + jsc_llint_opcode_stats_count);
+        for (OpcodeCounters* counters : s_liveThreads) {
+            for (unsigned i = 0; i < jsc_llint_opcode_stats_count; ++i)
+                totals[i] += counters->counts[i];
+        }
+    }
+
+    std::vector<const char*> names;
+    for (const char* name = jsc_llint_opcode_stats_names; names.size() * 3 < totals.size(); name += strlen(name) + 1)
+        names.push_back(name);
+
+    std::vector<unsigned> order;
+    for (unsigned i = 0; i < totals.size(); ++i) {
+        if (totals[i])
+            order.push_back(i);
+    }
+    std::stable_sort(order.begin(), order.end(), [&] (unsigned a, unsigned b) { return totals[a] > totals[b]; });
+
+    static const char* const suffixes[] = { "", "_wide16", "_wide32" };
+    for (unsigned i : order)
+        fprintf(file, "%20llu %s%s\n", static_cast<unsigned long long>(totals[i]), names[i / 3], suffixes[i % 3]);
+}
+
+} } } // namespace JSC::LLInt::OpcodeStats
+
+#endif // ENABLE(LLINT_OPCODE_STATS)
+
+#if ENABLE(LLINT_SYMBOL_MAP)
+
+#include <cstring>
+#include <unistd.h>
+
+namespace JSC { namespace LLInt { namespace SymbolMap {
+
+void write(FILE* file)
+{
+    const char* name = jsc_llint_symbol_map_names;
+    uintptr_t begin = reinterpret_cast<uintptr_t>(&jsc_llint_begin);
+    for (unsigned i = 0; i < jsc_llint_symbol_map_size; ++i, name += strlen(name) + 1) {
+        const SymbolMapEntry& entry = jsc_llint_symbol_map[i];
+        fprintf(file, "%llx %x %s\n", static_cast<unsigned long long>(begin + entry.offset), entry.size, name);
+    }
+}
+
+bool writePerfMap()
+{
+    char fileName[64];
+    snprintf(fileName, sizeof(fileName), "/tmp/perf-%d.map", static_cast<int>(getpid()));
+    FILE* file = fopen(fileName, "a");
+    if (!file)
+        return false;
+    write(file);
+    return !fclose(file);
+}
+
+} } } // namespace JSC::LLInt::SymbolMap
+
+#endif // ENABLE(LLINT_SYMBOL_MAP)
+
+#endif // ENABLE(C_LOOP)
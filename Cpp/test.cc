@@ -1,5 +1,8 @@
 #include "test.h"
 
+#include "LLIntOpcodeStats.h"
+#include "LLIntSymbolMap.h"
+
 namespace JSC { namespace Wasm {
 
 extern "C" uint32_t __attribute__((__used__)) call_test(uint32_t arg1, uint32_t arg2) {
@@ -11,8 +14,17 @@ extern "C" uint32_t __attribute__((__used__)) call_test(uint32_t arg1, uint32_t
 } }
 
 int main() {
+#if ENABLE(LLINT_OPCODE_STATS)
+    JSC::LLInt::OpcodeStats::registerCurrentThread();
+#endif
+#if ENABLE(LLINT_SYMBOL_MAP)
+    JSC::LLInt::SymbolMap::writePerfMap();
+#endif
     std::cout << "A" << std::endl;
     std::cout << std::hex << ipint_trampoline(5) << std::endl;
     std::cout << "B" << std::endl;
+#if ENABLE(LLINT_OPCODE_STATS)
+    JSC::LLInt::OpcodeStats::dump();
+#endif
     return 0;
 }
@@ -6,7 +6,7 @@
 
 #define SYSV_ABI
 
-#define ENABLE(f) 0
+#define ENABLE(WTF_FEATURE) (defined ENABLE_##WTF_FEATURE  && ENABLE_##WTF_FEATURE)
 #define USE(f) 0
 #define HAVE(WTF_FEATURE) (defined WTF_HAVE_##WTF_FEATURE  && WTF_COMPILER_##WTF_FEATURE)
 #define COMPILER(WTF_FEATURE) (defined WTF_COMPILER_##WTF_FEATURE  && WTF_COMPILER_##WTF_FEATURE)
@@ -22,6 +22,11 @@
 
 #define ASSERT_ENABLED 1
 
+// Labels as values, which the C loop dispatches through (see LowLevelInterpreter.cpp).
+#if !defined(ENABLE_COMPUTED_GOTO_OPCODES) && (COMPILER(GCC) || COMPILER(CLANG))
+#define ENABLE_COMPUTED_GOTO_OPCODES 1
+#endif
+
 #if !defined(DEBUGGER_ANNOTATION_MARKER) && COMPILER(GCC)
 #define DEBUGGER_ANNOTATION_MARKER(name) \
     __attribute__((__no_reorder__)) void name(void) { __asm__(""); }
@@ -79,3 +84,4 @@ public:
 } // namespace JSC
 
 extern "C" uint32_t SYSV_ABI ipint_trampoline(uint32_t);
+extern "C" uint32_t SYSV_ABI ipint_prologue_trampoline(uint32_t);
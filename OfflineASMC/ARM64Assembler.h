@@ -0,0 +1,550 @@
+#pragma once
+
+#include <optional>
+#include <unordered_map>
+
+#include "CodeGen.h"
+#include "ObjectFile.h"
+
+// Encodes the flat IR of an ARM64 body straight into machine code, with the
+// instructions OfflineASMRB/arm64.rb picks for the same opcodes, and lays it out
+// the way LowLevelInterpreter.cpp lays out the text form:
+//
+//     brk (x3)             the .cfi_* stubs that precede LLIntAssembly.h
+//     jsc_llint_begin:
+//     brk                  OFFLINE_ASM_BEGIN_SPACER
+//     ...the body...
+//     brk
+//     jsc_llint_end:
+//
+// Global labels become hidden global symbols and other labels that do not start
+// with '.' local ones, each a function that runs up to the next such label, named
+// without the leading '_' as SYMBOL_STRING() would on ELF. References to labels the
+// body does not define are relocated against undefined symbols. x17 is the
+// encoder's own scratch register, as in arm64.rb.
+namespace ARM64 {
+
+constexpr uint16_t EM_AARCH64 = 183;
+constexpr uint32_t R_AARCH64_PREL32 = 261;
+constexpr uint32_t R_AARCH64_CONDBR19 = 280;
+constexpr uint32_t R_AARCH64_JUMP26 = 282;
+constexpr uint32_t R_AARCH64_CALL26 = 283;
+
+constexpr uint32_t fatalCrashCode = 0xc471; // WTF_FATAL_CRASH_CODE in Cpp/test.h.
+constexpr uint32_t breakInstruction = 0xd4200000 | fatalCrashCode << 5;
+
+constexpr unsigned fp = 29;
+constexpr unsigned lr = 30;
+constexpr unsigned zr = 31; // Or sp, depending on the instruction.
+constexpr unsigned scratch = 17;
+
+struct Register {
+    unsigned number;
+    bool isSP { false };
+};
+
+// N:immr:imms of the logical immediate that is value, if there is one; see
+// arm64LogicalImmediates in arm64.rb.
+inline std::optional<uint32_t> logicalImmediate(uint64_t value)
+{
+    if (!value || !~value)
+        return std::nullopt;
+    unsigned size = 64;
+    while (size > 2) {
+        unsigned half = size / 2;
+        uint64_t mask = (1ull << half) - 1;
+        if ((value & mask) != ((value >> half) & mask))
+            break;
+        size = half;
+    }
+    uint64_t mask = size == 64 ? ~0ull : (1ull << size) - 1;
+    uint64_t element = value & mask;
+    // Rotate the element right until its ones form a run that starts at bit 0.
+    for (unsigned rotation = 0; rotation < size; ++rotation) {
+        uint64_t rotated = rotation ? ((element >> rotation) | (element << (size - rotation))) & mask : element;
+        if ((rotated & 1) && !((rotated + 1) & rotated)) {
+            unsigned ones = __builtin_popcountll(rotated);
+            uint32_t immr = (size - rotation) % size;
+            uint32_t imms = ((~(size - 1) << 1) & 0x3f) | (ones - 1);
+            uint32_t n = size == 64;
+            return n << 12 | immr << 6 | imms;
+        }
+    }
+    return std::nullopt;
+}
+
+class Assembler {
+public:
+    ObjectFile assemble(const IRBuffer& ir)
+    {
+        m_object.machine = EM_AARCH64;
+        m_object.codeAlignment = 4;
+        m_object.dataAlignment = -8;
+        m_object.returnAddressRegister = lr;
+        m_object.pcRelative32Relocation = R_AARCH64_PREL32;
+        CFI::defCFA(m_object.initialFrameInstructions, zr, 0);
+
+        // The stubs' rules, in the same order: each takes effect before one spacer.
+        for (bool zero : { false, true, false }) {
+            if (m_object.text.size())
+                CFI::advance(m_object, m_object.frameInstructions, 4);
+            CFI::defCFA(m_object.frameInstructions, fp, zero ? 0 : 16);
+            CFI::offset(m_object, m_object.frameInstructions, lr, zero ? 0 : -8);
+            CFI::offset(m_object, m_object.frameInstructions, fp, zero ? 0 : -16);
+            emit(breakInstruction);
+        }
+        defineSymbol("jsc_llint_begin", true, false);
+        emit(breakInstruction);
+
+        for (const IRInstruction& instruction : ir.instructions()) {
+            if (instruction.opcode == Opcode::LabelDefinition)
+                defineLabel(ir.labels()[ir.operand(instruction, 0).value]);
+            else if (instruction.opcode != Opcode::SpillArea)
+                encode(ir, instruction);
+        }
+
+        closeFunction();
+        emit(breakInstruction);
+        defineSymbol("jsc_llint_end", true, false);
+        resolveBranches();
+        return std::move(m_object);
+    }
+
+private:
+    enum class BranchKind : uint8_t { Jump, Call, Conditional };
+
+    struct Branch {
+        uint64_t offset;
+        BranchKind kind;
+        Symbol target;
+    };
+
+    struct Definition {
+        uint64_t offset;
+        bool duplicated;
+    };
+
+    [[noreturn]] static void unsupported(const IRBuffer& ir, const IRInstruction& instruction, const char* why)
+    {
+        fprintf(stderr, "OfflineASM: cannot encode %s", mnemonic(instruction.opcode));
+        for (unsigned i = 0; i < instruction.numOperands; ++i)
+            fprintf(stderr, "%s%s", i ? ", " : " ", operandKindName(ir.operand(instruction, i).kind));
+        fprintf(stderr, " for ARM64: %s\n", why);
+        std::exit(1);
+    }
+
+    static const char* operandKindName(OperandKind kind)
+    {
+        switch (kind) {
+        case OperandKind::Register:
+            return "register";
+        case OperandKind::Immediate:
+            return "immediate";
+        case OperandKind::Address:
+            return "address";
+        case OperandKind::LabelReference:
+            return "label";
+        case OperandKind::VectorRegister:
+            return "vector register";
+        }
+        return "";
+    }
+
+    static Register reg(const IROperand& operand)
+    {
+        if (operand.tmp)
+            unallocatedTemporary();
+        const char* name = machineRegisterName<Target::ARM64>(operand.gpr);
+        if (!name)
+            unavailableRegister(Target::ARM64, operand.gpr);
+        if (!strcmp(name, "sp"))
+            return { zr, true };
+        if (!strcmp(name, "lr"))
+            return { lr };
+        return { static_cast<unsigned>(atoi(name + 1)) };
+    }
+
+    // The number of the q register a vector register operand names.
+    static unsigned vreg(const IROperand& operand)
+    {
+        const char* name = machineRegisterName<Target::ARM64>(operand.vector);
+        if (!name)
+            unavailableVectorRegister(Target::ARM64, operand.vector);
+        return atoi(name + 1);
+    }
+
+    void emit(uint32_t instruction)
+    {
+        for (unsigned i = 0; i < 4; ++i)
+            m_object.text.push_back(instruction >> (8 * i));
+    }
+
+    uint64_t here() const { return m_object.text.size(); }
+
+    static std::string symbolName(std::string_view label)
+    {
+        return std::string(label.substr(!label.empty() && label[0] == '_'));
+    }
+
+    void defineSymbol(std::string name, bool global, bool function)
+    {
+        m_object.symbols.push_back({ std::move(name), true, global, function, here(), 0 });
+    }
+
+    void closeFunction()
+    {
+        if (m_openFunction) {
+            ObjectSymbol& symbol = m_object.symbols[*m_openFunction];
+            symbol.size = here() - symbol.offset;
+        }
+        m_openFunction = std::nullopt;
+    }
+
+    void defineLabel(const IRLabel& label)
+    {
+        std::string_view name = label.symbol.string();
+        bool isLocal = !name.empty() && name[0] == '.';
+        if (!isLocal) {
+            closeFunction();
+            if (label.alignTo > 4) {
+                emit(breakInstruction);
+                while (here() % label.alignTo)
+                    emit(breakInstruction);
+                m_object.textAlignment = std::max<uint32_t>(m_object.textAlignment, label.alignTo);
+            }
+        }
+        auto [iter, isNew] = m_definitions.emplace(label.symbol.id, Definition { here(), false });
+        if (!isNew)
+            iter->second.duplicated = true;
+        if (isLocal)
+            return;
+        m_openFunction = m_object.symbols.size();
+        defineSymbol(symbolName(name), label.global, true);
+    }
+
+    // Puts value in rd, as arm64MoveImmediatePlan() would, but without the movk
+    // patched onto a logical immediate.
+    void moveImmediate(uint64_t value, unsigned rd)
+    {
+        auto halfWord = [&](unsigned shift) -> uint32_t { return (value >> shift) & 0xffff; };
+        unsigned filled = 0, zero = 0;
+        for (unsigned shift = 0; shift < 64; shift += 16) {
+            filled += halfWord(shift) == 0xffff;
+            zero += !halfWord(shift);
+        }
+        uint32_t fill = filled > zero ? 0xffff : 0;
+        unsigned numberOfInstructions = 0;
+        for (unsigned shift = 0; shift < 64; shift += 16)
+            numberOfInstructions += halfWord(shift) != fill;
+        if (numberOfInstructions > 1) {
+            if (auto immediate = logicalImmediate(value)) {
+                emit(0xb2000000 | *immediate << 10 | zr << 5 | rd); // orr xd, xzr, #value
+                return;
+            }
+            if (value < (1ull << 32)) {
+                if (auto immediate = logicalImmediate(value | (value << 32)); immediate && !(*immediate & (1 << 12))) {
+                    emit(0x32000000 | *immediate << 10 | zr << 5 | rd); // orr wd, wzr, #value
+                    return;
+                }
+            }
+        }
+
+        bool first = true;
+        for (int shift = 48; shift >= 0; shift -= 16) {
+            uint32_t current = halfWord(shift);
+            if (current == fill && (shift || !first))
+                continue;
+            uint32_t hw = shift / 16;
+            if (first)
+                emit((fill ? 0x92800000 | (~current & 0xffff) << 5 : 0xd2800000 | current << 5) | hw << 21 | rd); // movn / movz
+            else
+                emit(0xf2800000 | hw << 21 | current << 5 | rd); // movk
+            first = false;
+        }
+    }
+
+    // rd = rn + value, or - value, through x17 if value is no arithmetic immediate.
+    void addImmediate(Register rd, Register rn, int64_t value, bool subtract)
+    {
+        if (value < 0 && value != INT64_MIN) {
+            value = -value;
+            subtract = !subtract;
+        }
+        uint32_t opcode = subtract ? 0xd1000000 : 0x91000000;
+        if (value < 4096) {
+            emit(opcode | static_cast<uint32_t>(value) << 10 | rn.number << 5 | rd.number);
+            return;
+        }
+        if (!(value & 0xfff) && value < (1 << 24)) {
+            emit(opcode | 1 << 22 | static_cast<uint32_t>(value >> 12) << 10 | rn.number << 5 | rd.number);
+            return;
+        }
+        moveImmediate(value, scratch);
+        addRegister(rd, rn, { scratch }, subtract);
+    }
+
+    // rd = rn + rm or rn - rm; the extended form when sp is involved.
+    void addRegister(Register rd, Register rn, Register rm, bool subtract)
+    {
+        if (rm.isSP) {
+            if (subtract || rn.isSP)
+                reportUnsupported("sp can only be added to another register");
+            std::swap(rn, rm);
+        }
+        uint32_t opcode = subtract ? 0xcb000000 : 0x8b000000;
+        if (rd.isSP || rn.isSP)
+            opcode |= 0x00206000; // uxtx
+        emit(opcode | rm.number << 16 | rn.number << 5 | rd.number);
+    }
+
+    void moveRegister(Register rd, Register rm)
+    {
+        if (rd.number == rm.number && rd.isSP == rm.isSP)
+            return;
+        if (rd.isSP || rm.isSP)
+            emit(0x91000000 | rm.number << 5 | rd.number); // add xd, xn, #0
+        else
+            emit(0xaa000000 | rm.number << 16 | zr << 5 | rd.number); // orr xd, xzr, xm
+    }
+
+    // An 8-byte load or store of rt at base + offset: scaled, unscaled, or with the
+    // offset in x17.
+    void access(bool isLoad, unsigned rt, Register base, int64_t offset)
+    {
+        if (offset >= 0 && !(offset % 8) && offset < 8 * 4096) {
+            emit((isLoad ? 0xf9400000 : 0xf9000000) | static_cast<uint32_t>(offset / 8) << 10 | base.number << 5 | rt);
+            return;
+        }
+        if (offset >= -256 && offset < 256) {
+            emit((isLoad ? 0xf8400000 : 0xf8000000) | (static_cast<uint32_t>(offset) & 0x1ff) << 12 | base.number << 5 | rt);
+            return;
+        }
+        if (rt == scratch)
+            reportUnsupported("the offset needs x17, which the value is in");
+        moveImmediate(offset, scratch);
+        emit((isLoad ? 0xf8606800 : 0xf8206800) | scratch << 16 | base.number << 5 | rt);
+    }
+
+    // The same for a 16-byte load or store of qt.
+    void accessVector(bool isLoad, unsigned qt, Register base, int64_t offset)
+    {
+        if (offset >= 0 && !(offset % 16) && offset < 16 * 4096) {
+            emit((isLoad ? 0x3dc00000 : 0x3d800000) | static_cast<uint32_t>(offset / 16) << 10 | base.number << 5 | qt);
+            return;
+        }
+        if (offset >= -256 && offset < 256) {
+            emit((isLoad ? 0x3cc00000 : 0x3c800000) | (static_cast<uint32_t>(offset) & 0x1ff) << 12 | base.number << 5 | qt);
+            return;
+        }
+        moveImmediate(offset, scratch);
+        emit((isLoad ? 0x3ce06800 : 0x3ca06800) | scratch << 16 | base.number << 5 | qt);
+    }
+
+    // ldp and stp of two size-byte registers, x or q.
+    void accessPair(uint32_t opcode, unsigned rt1, unsigned rt2, Register base, int64_t offset, int64_t size = 8)
+    {
+        if (offset % size || offset < -64 * size || offset > 63 * size)
+            reportUnsupported("the offset does not fit a pair instruction");
+        emit(opcode | (static_cast<uint32_t>(offset / size) & 0x7f) << 15 | rt2 << 10 | base.number << 5 | rt1);
+    }
+
+    void branch(BranchKind kind, const IROperand& target, uint32_t instruction)
+    {
+        m_branches.push_back({ here(), kind, target.symbol });
+        emit(instruction);
+    }
+
+    // The value in operand as a register: itself, xzr for 0, or x17.
+    unsigned valueRegister(const IROperand& operand)
+    {
+        if (operand.kind == OperandKind::Register)
+            return reg(operand).number;
+        if (!operand.value)
+            return zr;
+        moveImmediate(operand.value, scratch);
+        return scratch;
+    }
+
+    [[noreturn]] void reportUnsupported(const char* why) { unsupported(*m_ir, *m_instruction, why); }
+
+    void encode(const IRBuffer& ir, const IRInstruction& instruction)
+    {
+        m_ir = &ir;
+        m_instruction = &instruction;
+        auto operand = [&](unsigned index) -> const IROperand& { return ir.operand(instruction, index); };
+        auto is = [&](unsigned index, OperandKind kind) { return index < instruction.numOperands && operand(index).kind == kind; };
+
+        switch (instruction.opcode) {
+        case Opcode::addp:
+        case Opcode::subp: {
+            bool subtract = instruction.opcode == Opcode::subp;
+            if (instruction.numOperands == 2 && is(1, OperandKind::Register)) {
+                Register rd = reg(operand(1));
+                if (is(0, OperandKind::Immediate)) {
+                    if (operand(0).value)
+                        addImmediate(rd, rd, operand(0).value, subtract);
+                    return;
+                }
+                if (is(0, OperandKind::Register))
+                    return addRegister(rd, rd, reg(operand(0)), subtract);
+            }
+            if (instruction.numOperands == 3 && is(2, OperandKind::Register)) {
+                Register rd = reg(operand(2));
+                // addp a, b, c is c = b + a; subp a, b, c is c = a - b.
+                const IROperand& immediate = subtract ? operand(1) : operand(0);
+                const IROperand& other = subtract ? operand(0) : operand(1);
+                if (immediate.kind == OperandKind::Immediate && other.kind == OperandKind::Register) {
+                    if (!immediate.value)
+                        return moveRegister(rd, reg(other));
+                    return addImmediate(rd, reg(other), immediate.value, subtract);
+                }
+                if (is(0, OperandKind::Register) && is(1, OperandKind::Register))
+                    return subtract ? addRegister(rd, reg(operand(0)), reg(operand(1)), true) : addRegister(rd, reg(operand(1)), reg(operand(0)), false);
+            }
+            break;
+        }
+        case Opcode::move:
+            if (instruction.numOperands != 2 || !is(1, OperandKind::Register))
+                break;
+            if (is(0, OperandKind::Immediate)) {
+                Register rd = reg(operand(1));
+                if (rd.isSP)
+                    break;
+                return moveImmediate(operand(0).value, rd.number);
+            }
+            if (is(0, OperandKind::Register))
+                return moveRegister(reg(operand(1)), reg(operand(0)));
+            break;
+        case Opcode::push:
+        case Opcode::pop:
+            if (instruction.numOperands % 2)
+                reportUnsupported("ARM64 pushes and pops registers in pairs");
+            for (unsigned i = 0; i < instruction.numOperands; i += 2) {
+                if (!is(i, OperandKind::Register) || !is(i + 1, OperandKind::Register))
+                    reportUnsupported("only registers can be pushed and popped");
+                unsigned first = reg(operand(i)).number;
+                unsigned second = reg(operand(i + 1)).number;
+                if (instruction.opcode == Opcode::push)
+                    emit(0xa9800000 | (static_cast<uint32_t>(-2) & 0x7f) << 15 | second << 10 | zr << 5 | first); // stp first, second, [sp, #-16]!
+                else
+                    emit(0xa8c00000 | 2 << 15 | first << 10 | zr << 5 | second); // ldp second, first, [sp], #16
+            }
+            return;
+        case Opcode::storeq:
+        case Opcode::storep:
+            if (instruction.numOperands == 2 && is(1, OperandKind::Address))
+                return access(false, valueRegister(operand(0)), reg(operand(1)), operand(1).value);
+            break;
+        case Opcode::loadq:
+        case Opcode::loadp:
+            if (instruction.numOperands == 2 && is(0, OperandKind::Address) && is(1, OperandKind::Register))
+                return access(true, reg(operand(1)).number, reg(operand(0)), operand(0).value);
+            break;
+        case Opcode::storepairq:
+            if (instruction.numOperands == 3 && is(0, OperandKind::Register) && is(1, OperandKind::Register) && is(2, OperandKind::Address))
+                return accessPair(0xa9000000, reg(operand(0)).number, reg(operand(1)).number, reg(operand(2)), operand(2).value);
+            break;
+        case Opcode::loadpairq:
+            if (instruction.numOperands == 3 && is(0, OperandKind::Address) && is(1, OperandKind::Register) && is(2, OperandKind::Register))
+                return accessPair(0xa9400000, reg(operand(1)).number, reg(operand(2)).number, reg(operand(0)), operand(0).value);
+            break;
+        case Opcode::storev:
+            if (instruction.numOperands == 2 && is(0, OperandKind::VectorRegister) && is(1, OperandKind::Address))
+                return accessVector(false, vreg(operand(0)), reg(operand(1)), operand(1).value);
+            break;
+        case Opcode::loadv:
+            if (instruction.numOperands == 2 && is(0, OperandKind::Address) && is(1, OperandKind::VectorRegister))
+                return accessVector(true, vreg(operand(1)), reg(operand(0)), operand(0).value);
+            break;
+        case Opcode::storepairv:
+            if (instruction.numOperands == 3 && is(0, OperandKind::VectorRegister) && is(1, OperandKind::VectorRegister) && is(2, OperandKind::Address))
+                return accessPair(0xad000000, vreg(operand(0)), vreg(operand(1)), reg(operand(2)), operand(2).value, 16);
+            break;
+        case Opcode::loadpairv:
+            if (instruction.numOperands == 3 && is(0, OperandKind::Address) && is(1, OperandKind::VectorRegister) && is(2, OperandKind::VectorRegister))
+                return accessPair(0xad400000, vreg(operand(1)), vreg(operand(2)), reg(operand(0)), operand(0).value, 16);
+            break;
+        case Opcode::_break:
+            return emit(breakInstruction);
+        case Opcode::ret:
+            return emit(0xd65f03c0);
+        case Opcode::jmp:
+        case Opcode::call: {
+            bool isCall = instruction.opcode == Opcode::call;
+            if (is(0, OperandKind::LabelReference))
+                return branch(isCall ? BranchKind::Call : BranchKind::Jump, operand(0), isCall ? 0x94000000 : 0x14000000);
+            if (is(0, OperandKind::Register))
+                return emit((isCall ? 0xd63f0000 : 0xd61f0000) | reg(operand(0)).number << 5); // blr / br
+            break;
+        }
+        case Opcode::bpeq: {
+            if (instruction.numOperands != 3 || !is(2, OperandKind::LabelReference))
+                break;
+            unsigned left = 0, right = 1;
+            if (is(left, OperandKind::Immediate))
+                std::swap(left, right);
+            if (!is(left, OperandKind::Register))
+                break;
+            unsigned rn = reg(operand(left)).number;
+            if (is(right, OperandKind::Immediate) && !operand(right).value)
+                return branch(BranchKind::Conditional, operand(2), 0xb4000000 | rn); // cbz
+            if (is(right, OperandKind::Immediate) && operand(right).value > 0 && operand(right).value < 4096)
+                emit(0xf1000000 | static_cast<uint32_t>(operand(right).value) << 10 | rn << 5 | zr); // cmp xn, #imm
+            else
+                emit(0xeb000000 | valueRegister(operand(right)) << 16 | rn << 5 | zr); // cmp xn, xm
+            return branch(BranchKind::Conditional, operand(2), 0x54000000); // b.eq
+        }
+        case Opcode::LabelDefinition:
+        case Opcode::SpillArea:
+            return;
+        }
+        reportUnsupported("no encoding for these operands");
+    }
+
+    void resolveBranches()
+    {
+        std::unordered_map<uint32_t, uint32_t> undefinedSymbols;
+        for (const Branch& branch : m_branches) {
+            uint32_t instruction;
+            memcpy(&instruction, m_object.text.data() + branch.offset, sizeof(instruction));
+            auto definition = m_definitions.find(branch.target.id);
+            if (definition == m_definitions.end()) {
+                auto [iter, isNew] = undefinedSymbols.emplace(branch.target.id, m_object.symbols.size());
+                if (isNew)
+                    m_object.symbols.push_back({ symbolName(branch.target.string()), false, true, false, 0, 0 });
+                uint32_t type = branch.kind == BranchKind::Call ? R_AARCH64_CALL26 : branch.kind == BranchKind::Jump ? R_AARCH64_JUMP26 : R_AARCH64_CONDBR19;
+                m_object.relocations.push_back({ branch.offset, type, iter->second, 0 });
+                continue;
+            }
+            if (definition->second.duplicated) {
+                fprintf(stderr, "OfflineASM: %.*s is defined more than once, so a branch to it is ambiguous\n", static_cast<int>(branch.target.string().size()), branch.target.string().data());
+                std::exit(1);
+            }
+            int64_t delta = (static_cast<int64_t>(definition->second.offset) - static_cast<int64_t>(branch.offset)) / 4;
+            if (branch.kind == BranchKind::Conditional) {
+                if (delta < -(1 << 18) || delta >= (1 << 18)) {
+                    fprintf(stderr, "OfflineASM: %.*s is out of range of a conditional branch\n", static_cast<int>(branch.target.string().size()), branch.target.string().data());
+                    std::exit(1);
+                }
+                instruction |= (static_cast<uint32_t>(delta) & 0x7ffff) << 5;
+            } else
+                instruction |= static_cast<uint32_t>(delta) & 0x3ffffff;
+            memcpy(m_object.text.data() + branch.offset, &instruction, sizeof(instruction));
+        }
+    }
+
+    ObjectFile m_object;
+    std::vector<Branch> m_branches;
+    std::unordered_map<uint32_t, Definition> m_definitions;
+    std::optional<size_t> m_openFunction;
+    const IRBuffer* m_ir { nullptr };
+    const IRInstruction* m_instruction { nullptr };
+};
+
+} // namespace ARM64
+
+// The relocatable object OfflineASM --object writes for an ARM64 body.
+inline std::string emitARM64Object(const IRBuffer& ir)
+{
+    return writeELFObject(ARM64::Assembler().assemble(ir));
+}
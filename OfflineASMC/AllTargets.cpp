@@ -0,0 +1,25 @@
+// Links the generated body once per supported target, so a single OfflineASM
+// binary can emit LLIntAssembly.h for all of them. Use this in place of
+// build/test.asm.cpp; see the README.
+
+#include "CodeGen.h"
+
+#define OFFLINE_ASM_BODY_NAMESPACE ARM64Body
+#define OFFLINE_ASM_TARGET_ARM64
+#include "TargetBody.h"
+
+#define OFFLINE_ASM_BODY_NAMESPACE ARM64EBody
+#define OFFLINE_ASM_TARGET_ARM64E
+#include "TargetBody.h"
+
+#define OFFLINE_ASM_BODY_NAMESPACE X86_64Body
+#define OFFLINE_ASM_TARGET_X86_64
+#include "TargetBody.h"
+
+#define OFFLINE_ASM_BODY_NAMESPACE RISCV64Body
+#define OFFLINE_ASM_TARGET_RISCV64
+#include "TargetBody.h"
+
+#define OFFLINE_ASM_BODY_NAMESPACE ARMv7Body
+#define OFFLINE_ASM_TARGET_ARMv7
+#include "TargetBody.h"
@@ -1,241 +1,1021 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
 #include <string>
+#include <string_view>
+#include <cstdint>
 #include <memory>
+#include <new>
 #include <vector>
 #include <utility>
 #include <cassert>
+#include <cstdio>
 #include <cstdlib>
-#include <cstdlib>
+#include <cstring>
+#include <functional>
 #include <stack>
+#include <type_traits>
+#include <unordered_map>
 
 #include "../Cpp/LLIntOfflineAsmConfig.h"
+#include "IR.h"
+#include "WorkStealing.h"
+
+// Generated code is streamed into a Sink rather than returned by value, so that
+// emitting a whole interpreter is a single linear walk that appends into one
+// buffer. A Sink backed by a FILE* flushes whenever its buffer fills up; a Sink
+// without one just grows, and its contents can be taken as a string.
+class Sink {
+public:
+    static constexpr size_t bufferSize = 64 * 1024;
+
+    explicit Sink(FILE* file = nullptr)
+        : m_file(file)
+    {
+        m_buffer.reserve(bufferSize);
+    }
+
+    ~Sink()
+    {
+        flush();
+    }
+
+    Sink(const Sink&) = delete;
+    Sink& operator=(const Sink&) = delete;
+
+    void append(const char* data, size_t length)
+    {
+        if (m_file && m_buffer.size() + length > bufferSize) {
+            flush();
+            if (length > bufferSize) {
+                write(data, length);
+                return;
+            }
+        }
+        m_buffer.append(data, length);
+    }
+
+    Sink& operator<<(std::string_view text)
+    {
+        append(text.data(), text.size());
+        return *this;
+    }
+
+    Sink& operator<<(char c)
+    {
+        append(&c, 1);
+        return *this;
+    }
+
+    Sink& operator<<(int64_t value)
+    {
+        char buffer[32];
+        int length = snprintf(buffer, sizeof(buffer), "%lld", static_cast<long long>(value));
+        append(buffer, length);
+        return *this;
+    }
+
+    void flush()
+    {
+        if (!m_file || m_buffer.empty())
+            return;
+        write(m_buffer.data(), m_buffer.size());
+        m_buffer.clear();
+        fflush(m_file);
+    }
+
+    std::string take()
+    {
+        assert(!m_file);
+        return std::move(m_buffer);
+    }
+
+private:
+    void write(const char* data, size_t length)
+    {
+        if (fwrite(data, 1, length, m_file) != length) {
+            perror("OfflineASM: write failed");
+            std::exit(1);
+        }
+    }
+
+    FILE* m_file;
+    std::string m_buffer;
+};
 
 class Generator {
 public:
-    virtual std::string generate() const = 0;
+    virtual ~Generator() = default;
+
+    virtual void generate(Sink&) const = 0;
+
+    std::string generate() const
+    {
+        Sink sink;
+        generate(sink);
+        return sink.take();
+    }
 };
 
-using Code = std::unique_ptr<Generator>;
+// Generator nodes are placement-allocated out of an Arena and all freed at once
+// when it goes away, so building a tree costs a pointer bump per node and tearing
+// it down costs nothing for the common, trivially destructible case.
+class Arena {
+public:
+    static constexpr size_t chunkSize = 64 * 1024;
+
+    Arena() = default;
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
 
-class TextGenerator : public Generator {
+    ~Arena()
+    {
+        for (size_t i = m_destructors.size(); i--;)
+            m_destructors[i].destroy(m_destructors[i].object);
+    }
+
+    void* allocate(size_t size, size_t alignment)
+    {
+        uintptr_t cursor = (reinterpret_cast<uintptr_t>(m_cursor) + alignment - 1) & ~(alignment - 1);
+        if (!m_cursor || cursor + size > reinterpret_cast<uintptr_t>(m_end)) {
+            size_t length = std::max(chunkSize, size + alignment);
+            m_chunks.push_back(std::make_unique<char[]>(length));
+            m_cursor = m_chunks.back().get();
+            m_end = m_cursor + length;
+            cursor = (reinterpret_cast<uintptr_t>(m_cursor) + alignment - 1) & ~(alignment - 1);
+        }
+        m_cursor = reinterpret_cast<char*>(cursor + size);
+        return reinterpret_cast<void*>(cursor);
+    }
+
+    template<typename T, typename... Args>
+    T* make(Args&&... args)
+    {
+        T* result = new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+        if constexpr (!std::is_trivially_destructible_v<T>)
+            m_destructors.push_back({ [](void* object) { static_cast<T*>(object)->~T(); }, result });
+        return result;
+    }
+
+private:
+    struct Destructor {
+        void (*destroy)(void*);
+        void* object;
+    };
+
+    std::vector<std::unique_ptr<char[]>> m_chunks;
+    char* m_cursor { nullptr };
+    char* m_end { nullptr };
+    std::vector<Destructor> m_destructors;
+};
+
+class CodeCollectionScope;
+
+// The tree form of a body forked by generateInParallel(). The body is generated
+// into its own context, and its code is filled in when the fork joins.
+class ForkedGenerator : public Generator {
 public:
-    TextGenerator(const std::string& text) : text(text) {}
+    void generate(Sink& sink) const override {
+        if (code)
+            code->generate(sink);
+    }
+
+    Generator* code { nullptr };
+};
 
-    std::string generate() const override {
-        return text;
+// Owns everything produced while generating one body(): the node arena, the
+// flat IR and the stack of collection scopes that instructions are appended to.
+// Code handles handed out while a context is alive stay valid until the context
+// is destroyed. A context builds the Generator tree, the flat IR, or both.
+// Contexts are per-thread, so several bodies can be generated concurrently.
+class CodeGenContext {
+public:
+    enum Representation : unsigned {
+        Tree = 1 << 0,
+        FlatIR = 1 << 1,
+    };
+
+    explicit CodeGenContext(unsigned representations = Tree, Target target = Target::ARM64)
+        : m_previous(s_current)
+        , m_active(true)
+        , m_representations(representations)
+        , m_target(target)
+    {
+        s_current = this;
+    }
+
+    // A context for a forked body. It is made current only while a worker runs
+    // that body (see Activation) and lives on in the forking context afterwards.
+    enum DetachedTag { Detached };
+    CodeGenContext(DetachedTag, unsigned representations, Target target)
+        : m_previous(nullptr)
+        , m_active(false)
+        , m_representations(representations)
+        , m_target(target)
+    {
+    }
+
+    ~CodeGenContext()
+    {
+        if (!m_scopes.empty() || !m_forks.empty())
+            std::exit(1);
+        if (!m_active)
+            return;
+        if (s_current != this)
+            std::exit(1);
+        s_current = m_previous;
+    }
+
+    CodeGenContext(const CodeGenContext&) = delete;
+    CodeGenContext& operator=(const CodeGenContext&) = delete;
+
+    class Activation {
+    public:
+        explicit Activation(CodeGenContext& context)
+            : m_previous(s_current)
+        {
+            s_current = &context;
+        }
+
+        ~Activation() { s_current = m_previous; }
+
+    private:
+        CodeGenContext* m_previous;
+    };
+
+    static CodeGenContext& current()
+    {
+        if (!s_current) {
+            fputs("OfflineASM: no CodeGenContext\n", stderr);
+            std::exit(1);
+        }
+        return *s_current;
+    }
+
+    Arena& arena() { return m_arena; }
+    IRBuffer& ir() { return m_ir; }
+
+    Target target() const { return m_target; }
+    unsigned representations() const { return m_representations; }
+
+    bool buildsTree() const { return m_representations & Tree; }
+    bool buildsIR() const { return m_representations & FlatIR; }
+
+    // How many threads generateInParallel() may use; 1, the default, generates
+    // every body in place on the calling thread.
+    unsigned parallelism() const { return m_parallelism; }
+    void setParallelism(unsigned parallelism) { m_parallelism = std::max(1u, parallelism); }
+
+    CodeCollectionScope* currentScope() const { return m_scopes.empty() ? nullptr : m_scopes.top(); }
+
+    void pushScope(CodeCollectionScope* scope) { m_scopes.push(scope); }
+
+    void popScope(CodeCollectionScope* scope)
+    {
+        if (m_scopes.empty() || m_scopes.top() != scope)
+            std::exit(1);
+        m_scopes.pop();
+    }
+
+    // A body that has been forked but not yet joined, and where its output goes.
+    struct Fork {
+        std::function<void()> body;
+        size_t instructionIndex; // Its IR is spliced in before m_ir.instructions()[instructionIndex].
+        ForkedGenerator* placeholder; // Its tree, if this context builds one.
+        std::unique_ptr<CodeGenContext> context;
+    };
+
+    std::vector<Fork>& forks() { return m_forks; }
+
+    // Forked contexts still own the arena nodes their trees are made of.
+    void adoptForkedContext(std::unique_ptr<CodeGenContext> context) { m_forkedContexts.push_back(std::move(context)); }
+
+    // What a memoized macro produced the first time it was expanded with some
+    // arguments: its subtree, and the instructions [irBegin, irEnd) it recorded.
+    struct MacroExpansion {
+        Generator* code;
+        uint32_t irBegin;
+        uint32_t irEnd;
+    };
+
+    using MacroExpansionKey = std::vector<uint64_t>;
+
+    const MacroExpansion* findMacroExpansion(const MacroExpansionKey& key) const
+    {
+        auto iter = m_macroExpansions.find(key);
+        return iter == m_macroExpansions.end() ? nullptr : &iter->second;
     }
 
+    void addMacroExpansion(MacroExpansionKey key, MacroExpansion expansion) { m_macroExpansions.emplace(std::move(key), expansion); }
+
+    // Recorded IR ranges no longer mean anything once the IR has been rewritten.
+    void clearMacroExpansions() { m_macroExpansions.clear(); }
+
 private:
-    std::string text;
+    static inline thread_local CodeGenContext* s_current = nullptr;
+
+    CodeGenContext* m_previous;
+    bool m_active;
+    unsigned m_representations;
+    unsigned m_parallelism { 1 };
+    Target m_target;
+    Arena m_arena;
+    IRBuffer m_ir;
+    std::stack<CodeCollectionScope*> m_scopes;
+    std::vector<Fork> m_forks;
+    std::vector<std::unique_ptr<CodeGenContext>> m_forkedContexts;
+
+    struct MacroExpansionKeyHash {
+        size_t operator()(const MacroExpansionKey& key) const
+        {
+            uint64_t hash = 0xcbf29ce484222325ull;
+            for (uint64_t word : key)
+                hash = (hash ^ word) * 0x100000001b3ull;
+            return hash;
+        }
+    };
+    std::unordered_map<MacroExpansionKey, MacroExpansion, MacroExpansionKeyHash> m_macroExpansions;
 };
 
-class Reg : public Generator {
+template<typename T, typename... Args>
+inline T* make(Args&&... args)
+{
+    return CodeGenContext::current().arena().make<T>(std::forward<Args>(args)...);
+}
+
+using Code = Generator*;
+
+// The operands of an instruction, or the parts of a sequence. Up to
+// inlineCapacity of them live in the node itself, which covers nearly every
+// instruction; longer runs get an array from the arena. Either way the node
+// allocates nothing of its own and stays trivially destructible, so the arena
+// records no destructor for it.
+class CodeArray {
 public:
-    Reg(const std::string& name) : name(name) {}
-    Reg(const Reg& other) : name(other.name)
+    static constexpr size_t inlineCapacity = 4;
+
+    template<typename... Codes, typename = std::enable_if_t<(std::is_same_v<Codes, Code> && ...)>>
+    explicit CodeArray(Codes... codes)
+        : m_size(sizeof...(Codes))
     {
+        Code* data = storage();
+        [[maybe_unused]] size_t i = 0;
+        ((data[i++] = codes), ...);
     }
 
-    std::string generate() const override {
-        return name;
+    CodeArray(const Code* codes, size_t size)
+        : m_size(size)
+    {
+        std::copy(codes, codes + size, storage());
+    }
+
+    CodeArray(const CodeArray&) = delete;
+    CodeArray& operator=(const CodeArray&) = delete;
+
+    size_t size() const { return m_size; }
+    const Code* begin() const { return m_size > inlineCapacity ? m_outOfLine : m_inline; }
+    const Code* end() const { return begin() + m_size; }
+    Code operator[](size_t i) const { return begin()[i]; }
+
+private:
+    Code* storage()
+    {
+        if (m_size <= inlineCapacity)
+            return m_inline;
+        m_outOfLine = static_cast<Code*>(CodeGenContext::current().arena().allocate(m_size * sizeof(Code), alignof(Code)));
+        return m_outOfLine;
+    }
+
+    size_t m_size;
+    union {
+        Code m_inline[inlineCapacity];
+        Code* m_outOfLine;
+    };
+};
+
+class TextGenerator : public Generator {
+public:
+    TextGenerator(Symbol text) : text(text) {}
+
+    void generate(Sink& sink) const override {
+        sink << text.string();
+    }
+
+private:
+    Symbol text;
+};
+
+class ImmediateGenerator : public Generator {
+public:
+    ImmediateGenerator(int64_t value) : value(value) {}
+
+    void generate(Sink& sink) const override {
+        sink << value;
     }
 
 private:
-    std::string name;
+    int64_t value;
+};
+
+[[noreturn]] inline void unavailableRegister(Target target, GPR gpr)
+{
+    fprintf(stderr, "OfflineASM: register %s is not available on %s\n", gprName(gpr), targetName(target));
+    std::exit(1);
+}
+
+// A register operand names one of the target-independent GPRs; which machine
+// register that is only gets decided when the code is lowered for a target. It
+// may instead be a temporary (see tmp()), which is given a register only once
+// the whole body has been recorded.
+struct Reg {
+    GPR gpr;
+    uint32_t tmp { 0 }; // 1 + the temporary's number, or 0 for gpr itself.
+
+    bool isTmp() const { return tmp; }
+};
+
+using Tmp = Reg;
+
+[[noreturn]] inline void unallocatedTemporary()
+{
+    fputs("OfflineASM: a temporary has no register; only the flat IR gets them, from allocateRegisters()\n", stderr);
+    std::exit(1);
+}
+
+class RegGenerator : public Generator {
+public:
+    RegGenerator(Reg reg) : reg(reg) {}
+
+    void generate(Sink& sink) const override {
+        if (reg.isTmp())
+            unallocatedTemporary();
+        Target target = CodeGenContext::current().target();
+        const char* name = machineRegisterName(target, reg.gpr);
+        if (!name)
+            unavailableRegister(target, reg.gpr);
+        sink << name;
+    }
+
+private:
+    Reg reg;
+};
+
+[[noreturn]] inline void unavailableVectorRegister(Target target, VectorRegister vector)
+{
+    fprintf(stderr, "OfflineASM: vector register %s is not available on %s\n", vectorRegisterName(vector), targetName(target));
+    std::exit(1);
+}
+
+// A 128-bit vector register operand, for loadv, storev and their pairs. Vector
+// registers have no temporaries; bodies always name them.
+struct VReg {
+    VectorRegister vector;
+};
+
+class VRegGenerator : public Generator {
+public:
+    VRegGenerator(VReg reg) : reg(reg) {}
+
+    void generate(Sink& sink) const override {
+        Target target = CodeGenContext::current().target();
+        const char* name = machineRegisterName(target, reg.vector);
+        if (!name)
+            unavailableVectorRegister(target, reg.vector);
+        sink << name;
+    }
+
+private:
+    VReg reg;
 };
 
 class SequenceGenerator : public Generator {
 public:
-    SequenceGenerator(std::vector<Code> sequence) : sequence(sequence) {}
-    SequenceGenerator(std::initializer_list<Code> sequence) : sequence(sequence) {}
+    template<typename... Codes>
+    SequenceGenerator(Codes... codes) : sequence(codes...) {}
+    SequenceGenerator(const Code* codes, size_t size) : sequence(codes, size) {}
 
-    std::string generate() const override {
-        std::string result;
-        for (const auto& code : sequence) {
-            result += code->generate();
-        }
-        return result;
+    void generate(Sink& sink) const override {
+        for (const auto& code : sequence)
+            code->generate(sink);
     }
 
 private:
-    std::vector<Code> sequence;
+    CodeArray sequence;
+};
+
+inline Code text(std::string_view expr) {
+    return make<TextGenerator>(intern(expr));
+}
+
+// A memory operand, offset[base]. Kept as a value rather than built as a tree
+// so that it can be recorded in the flat IR as-is.
+struct Address {
+    Reg base;
+    int64_t offset;
 };
 
+inline Code toCode(Code code) { return code; }
+inline Code toCode(Reg reg) { return make<RegGenerator>(reg); }
+inline Code toCode(VReg reg) { return make<VRegGenerator>(reg); }
+inline Code toCode(const char* expr) { return text(expr); }
+inline Code toCode(const std::string& expr) { return text(expr); }
+
+template<typename T, typename = std::enable_if_t<std::is_integral_v<T>>>
+inline Code toCode(T value) { return make<ImmediateGenerator>(value); }
+
 template<typename... Args>
 inline Code seq(Args&&... args) {
-    return std::make_unique<SequenceGenerator>({ std::forward<Args>(args)... });
+    return make<SequenceGenerator>(toCode(std::forward<Args>(args))...);
 }
 
-inline Code text(const std::string& expr) {
-    return std::make_unique<TextGenerator>(expr);
+inline Code toCode(const Address& address) {
+    return seq(address.offset, "[", address.base, "]");
 }
 
-inline Reg reg(const std::string& expr) {
-    return std::make_unique<RegGenerator>(expr);
+inline IROperand toOperand(Reg reg) {
+    return { OperandKind::Register, reg.gpr, { 0 }, 0, reg.tmp };
 }
 
-class CodeCollectionScope;
-static std::stack<std::unique_ptr<CodeCollectionScope>> s_scopes;
+inline IROperand toOperand(VReg reg) {
+    return { OperandKind::VectorRegister, GPR::invalidGPR, { 0 }, 0, 0, reg.vector };
+}
+
+inline IROperand toOperand(const Address& address) {
+    return { OperandKind::Address, address.base.gpr, { 0 }, address.offset, address.base.tmp };
+}
+
+inline IROperand toOperand(const char* labelName) {
+    return { OperandKind::LabelReference, GPR::invalidGPR, intern(labelName), 0 };
+}
+
+inline IROperand toOperand(const std::string& labelName) {
+    return { OperandKind::LabelReference, GPR::invalidGPR, intern(labelName), 0 };
+}
+
+template<typename T, typename = std::enable_if_t<std::is_integral_v<T>>>
+inline IROperand toOperand(T value) {
+    return { OperandKind::Immediate, GPR::invalidGPR, { 0 }, static_cast<int64_t>(value) };
+}
 
 class CodeCollectionScope {
 public:
     CodeCollectionScope()
+        : m_context(CodeGenContext::current())
+        , m_parent(m_context.currentScope())
     {
-        s_scopes.push(std::make_unique<CodeCollectionScope>());
+        m_context.pushScope(this);
     }
+
+    // A nested scope belongs to a macro expansion; whatever it collected is
+    // spliced into the enclosing scope at the macro's call site.
     ~CodeCollectionScope()
     {
-        if (s_scopes.top().get() != this) {
-            std::exit(1);
-        }
-        s_scopes.pop();
+        m_context.popScope(this);
+        if (m_parent && m_context.buildsTree())
+            m_parent->addCode(code());
     }
 
     void addCode(Code code) {
         codes.push_back(code);
+        m_code = nullptr;
     }
 
+    // A macro returns its scope's code() and then ends the scope, which splices
+    // the same sequence into its parent; it is built once for both.
     Code code() const {
-        return seq(codes);
+        if (!m_context.buildsTree())
+            return nullptr;
+        if (!m_code)
+            m_code = make<SequenceGenerator>(codes.data(), codes.size());
+        return m_code;
     }
 
 private:
+    CodeGenContext& m_context;
+    CodeCollectionScope* m_parent;
     std::vector<Code> codes;
+    mutable Code m_code { nullptr };
 };
 
-#define INSTR(name, impl) \
-inline Code name##_impl(std::vector<Code> operands) { \
-        return impl; \
-    } \
+inline void emit(Code code)
+{
+    if (auto* scope = CodeGenContext::current().currentScope())
+        scope->addCode(code);
+}
+
+// The tree form of one instruction: "    mnemonic op, op\n". lowerIR() prints
+// the flat IR in exactly the same format.
+class InstructionGenerator : public Generator {
+public:
+    template<typename... Operands>
+    InstructionGenerator(Opcode opcode, Operands... operands) : opcode(opcode), operands(operands...) {}
+
+    void generate(Sink& sink) const override {
+        sink << "    " << mnemonic(opcode);
+        for (size_t i = 0; i < operands.size(); ++i) {
+            sink << (i ? ", " : " ");
+            operands[i]->generate(sink);
+        }
+        sink << '\n';
+    }
+
+private:
+    Opcode opcode;
+    CodeArray operands;
+};
+
+#define INSTR(name, mnemonic) \
 template<typename... Args> \
 inline Code name(Args&&... args) { \
-    return name##_impl(std::vector<Code>{std::forward<Args>(args)...}); \
+    CodeGenContext& context = CodeGenContext::current(); \
+    if (context.buildsIR()) { \
+        IROperand operands[] = { toOperand(args)..., IROperand { } }; \
+        context.ir().append(Opcode::name, operands, sizeof...(Args)); \
+    } \
+    if (!context.buildsTree()) \
+        return nullptr; \
+    Code code = make<InstructionGenerator>(Opcode::name, toCode(std::forward<Args>(args))...); \
+    emit(code); \
+    return code; \
 } \
 
-
-INSTR(addp, seq("add", seq(operands), "32"));
-INSTR(push, seq("push", seq(operands), "32"));
-INSTR(error, [](){std::exit(1); return seq();}());
-INSTR(move, seq("move", seq(operands), "32"));
-INSTR(pop, seq("pop", seq(operands), "32"));
-INSTR(subp, seq("sub", seq(operands), "32"));
-INSTR(storepairq, seq("storepairq", seq(operands), "32"));
-INSTR(storeq, seq("storeq", seq(operands), "32"));
-INSTR(loadpairq, seq("loadpairq", seq(operands), "32"));
-INSTR(loadq, seq("loadq", seq(operands), "32"));
-INSTR(_break, seq("brk", seq(operands), "32"));
-INSTR(jmp, seq("jmp", seq(operands), "32"));
-INSTR(ret, seq("ret", seq(operands), "32"));
-INSTR(call, seq("call", seq(operands), "32"));
-INSTR(bpeq, seq("bpeq", seq(operands), "32"));
+FOR_EACH_OFFLINE_ASM_OPCODE(INSTR)
 
 #undef INSTR
 
-Code address(Reg reg, int offset) {
-    return seq(reg, offset);
+inline Code error() {
+    fputs("OfflineASM: reached an error instruction\n", stderr);
+    std::exit(1);
+}
+
+inline Address address(Reg reg, int64_t offset) {
+    return { reg, offset };
+}
+
+// A new temporary. Any instruction may take it wherever it takes a register;
+// allocateRegisters() (RegisterAllocation.h) then gives it one of the target's
+// scratch registers that is free wherever the temporary is live, or a slot of the
+// handler's spillArea() if none is. A temporary must not be live across a global
+// or glue label.
+inline Tmp tmp() {
+    return { GPR::invalidGPR, CodeGenContext::current().ir().newTmp() };
+}
+
+// Hands count 8-byte slots from base on to the register allocator, for the
+// temporaries of the handler this is recorded in. Only needed by handlers that
+// keep more temporaries live than there are scratch registers.
+inline void spillArea(const Address& base, unsigned count) {
+    CodeGenContext& context = CodeGenContext::current();
+    if (!context.buildsIR())
+        return;
+    IROperand operands[] = { toOperand(base), toOperand(count) };
+    context.ir().append(Opcode::SpillArea, operands, 2);
 }
 
 class Label : public Generator {
 public:
-    Label(const std::string& name) : name(name) {}
+    Label(Symbol name) : name(name) {}
 
-    std::string generate() const override {
-        return name;
+    void generate(Sink& sink) const override {
+        sink << name.string() << ":\n";
+    }
+
+    // Labels are defined where they are created, so the IR record exists before
+    // the chained flag setters run; they keep it in sync.
+    void setIRLabel(IRBuffer* ir, uint32_t index)
+    {
+        m_ir = ir;
+        m_irLabelIndex = index;
     }
     
     Label& inFile() {
         m_inFile = true;
+        if (m_ir)
+            m_ir->labels()[m_irLabelIndex].inFile = true;
         return *this;
     }
     
     Label& global() {
         m_global = true;
+        if (m_ir)
+            m_ir->labels()[m_irLabelIndex].global = true;
         return *this;
     }
     
     Label& aligned(int alignTo) {
         m_alignTo = alignTo;
+        if (m_ir)
+            m_ir->labels()[m_irLabelIndex].alignTo = alignTo;
         return *this;
     }
     
     Label& extern_() {
         m_extern = true;
+        if (m_ir)
+            m_ir->labels()[m_irLabelIndex].extern_ = true;
         return *this;
     }
 
 private:
-    std::string name;
+    Symbol name;
+    IRBuffer* m_ir = nullptr;
+    uint32_t m_irLabelIndex = 0;
     bool m_inFile = false;
     bool m_global = false;
     int m_alignTo = 0;
     bool m_extern = false;
 };
 
-std::unique_ptr<Label> label(const std::string& name) {
-    return std::make_unique<Label>(name);
-}
-
-#define ARM64 1
-#define ARM64E 0
-#define ARMv7 0
-#define X86_64 0
-#define RISCV64 0
-#define C_LOOP 0
-
-auto invalidGPR = reg("invalid");
-
-auto t0 = reg("x0");
-auto t1 = reg("x1");
-auto t2 = reg("x2");
-auto t3 = reg("x3");
-auto t4 = reg("x4");
-auto t5 = reg("x5");
-auto t6 = reg("x6");
-auto t7 = reg("x7");
-auto t8 = reg("x8");
-auto t9 = reg("x9");
-auto t10 = reg("x10");
-auto t11 = reg("x11");
-auto t12 = reg("x12");
-auto cfr = reg("x29");
-auto csr0 = reg("x19");
-auto csr1 = reg("x20");
-auto csr2 = reg("x21");
-auto csr3 = reg("x22");
-auto csr4 = reg("x23");
-auto csr5 = reg("x24");
-auto csr6 = reg("x25");
-auto csr7 = reg("x26");
-auto csr8 = reg("x27");
-auto csr9 = reg("x28");
-auto csr10 = invalidGPR;
-auto sp = reg("sp");
-auto lr = reg("lr");
-
-auto& ws0 = t9;
-auto& ws1 = t10;
-auto& ws2 = t11;
-auto& ws3 = t12;
-
-auto& a0 = t0;
-auto& a1 = t1;
-auto& a2 = t2;
-auto& a3 = t3;
-auto& a4 = t4;
-auto& a5 = t5;
-auto& a6 = t6;
-auto& a7 = t7;
-
-auto& wa0 = t0;
-auto& wa1 = t1;
-auto& wa2 = t2;
-auto& wa3 = t3;
-auto& wa4 = t4;
-auto& wa5 = t5;
-auto& wa6 = t6;
-auto& wa7 = t7;
-
-auto& r0 = t0;
-auto& r1 = t1;
+inline Label* label(std::string_view name) {
+    CodeGenContext& context = CodeGenContext::current();
+    Symbol symbol = intern(name);
+    Label* result = make<Label>(symbol);
+    if (context.buildsIR())
+        result->setIRLabel(&context.ir(), context.ir().appendLabel(symbol));
+    if (context.buildsTree())
+        emit(result);
+    return result;
+}
+
+// Generates one top-level piece of a body -- in practice one op() and the
+// handlers it expands to -- independently of its neighbours. With parallelism()
+// above 1 the body is only queued here; joinParallelGeneration() generates all
+// queued bodies on worker threads, each into its own context, and splices their
+// output back where they were forked, so the result does not depend on which
+// worker ran what. Bodies must only read state shared with the rest of body().
+template<typename Function>
+inline void generateInParallel(Function&& body)
+{
+    CodeGenContext& context = CodeGenContext::current();
+    if (context.parallelism() <= 1) {
+        body();
+        return;
+    }
+    ForkedGenerator* placeholder = nullptr;
+    if (context.buildsTree()) {
+        placeholder = make<ForkedGenerator>();
+        emit(placeholder);
+    }
+    context.forks().push_back({ std::forward<Function>(body), context.ir().instructions().size(), placeholder, nullptr });
+}
+
+inline void joinParallelGeneration()
+{
+    CodeGenContext& context = CodeGenContext::current();
+    std::vector<CodeGenContext::Fork> forks = std::move(context.forks());
+    context.forks().clear();
+    if (forks.empty())
+        return;
+
+    runWorkStealing(forks.size(), context.parallelism(), [&](size_t index) {
+        CodeGenContext::Fork& fork = forks[index];
+        fork.context = std::make_unique<CodeGenContext>(CodeGenContext::Detached, context.representations(), context.target());
+        CodeGenContext::Activation activation(*fork.context);
+        CodeCollectionScope root;
+        fork.body();
+        if (fork.placeholder)
+            fork.placeholder->code = root.code();
+    });
+
+    if (context.buildsIR()) {
+        // Every fork numbered its temporaries from 1; they go after this context's.
+        IRBuffer stitched;
+        stitched.reserveTmps(context.ir().numTmps());
+        size_t next = 0;
+        for (CodeGenContext::Fork& fork : forks) {
+            stitched.appendRange(context.ir(), next, fork.instructionIndex);
+            stitched.appendRange(fork.context->ir(), 0, fork.context->ir().instructions().size(), stitched.numTmps());
+            stitched.reserveTmps(fork.context->ir().numTmps());
+            next = fork.instructionIndex;
+        }
+        stitched.appendRange(context.ir(), next, context.ir().instructions().size());
+        context.ir() = std::move(stitched);
+        context.clearMacroExpansions();
+    }
+
+    for (CodeGenContext::Fork& fork : forks)
+        context.adoptForkedContext(std::move(fork.context));
+}
+
+inline bool appendMacroArgumentKey(CodeGenContext::MacroExpansionKey& key, Reg reg)
+{
+    key.insert(key.end(), { 1, static_cast<uint64_t>(reg.gpr), reg.tmp });
+    return true;
+}
+
+inline bool appendMacroArgumentKey(CodeGenContext::MacroExpansionKey& key, VReg reg)
+{
+    key.insert(key.end(), { 5, static_cast<uint64_t>(reg.vector) });
+    return true;
+}
+
+inline bool appendMacroArgumentKey(CodeGenContext::MacroExpansionKey& key, const Address& address)
+{
+    key.insert(key.end(), { 2, static_cast<uint64_t>(address.base.gpr), address.base.tmp, static_cast<uint64_t>(address.offset) });
+    return true;
+}
+
+inline bool appendMacroArgumentKey(CodeGenContext::MacroExpansionKey& key, std::string_view name)
+{
+    key.insert(key.end(), { 3, intern(name).id });
+    return true;
+}
+
+inline bool appendMacroArgumentKey(CodeGenContext::MacroExpansionKey& key, const char* name)
+{
+    return appendMacroArgumentKey(key, std::string_view(name));
+}
+
+inline bool appendMacroArgumentKey(CodeGenContext::MacroExpansionKey& key, const std::string& name)
+{
+    return appendMacroArgumentKey(key, std::string_view(name));
+}
+
+template<typename T, typename = std::enable_if_t<std::is_integral_v<T>>>
+inline bool appendMacroArgumentKey(CodeGenContext::MacroExpansionKey& key, T value)
+{
+    key.insert(key.end(), { 4, static_cast<uint64_t>(value) });
+    return true;
+}
+
+// Macros passed as arguments, and Code, have no identity worth comparing.
+template<typename T, typename = std::enable_if_t<!std::is_integral_v<T>>, typename = void>
+inline bool appendMacroArgumentKey(CodeGenContext::MacroExpansionKey&, const T&)
+{
+    return false;
+}
+
+// Lets a named macro reuse its first expansion for every later call with the
+// same arguments: the same subtree is emitted again and the recorded IR range is
+// copied, instead of the body being run again. Only calls whose arguments are all
+// registers, vector registers, addresses, immediates or names are memoized, and
+// only expansions that make no temporaries of their own are reused, since every
+// expansion needs fresh ones. Every MacroMemo gets a fresh id, so a macro defined
+// inside another one -- whose body may depend on the outer macro's arguments --
+// starts over on every expansion of the outer one.
+class MacroMemo {
+public:
+    MacroMemo()
+        : m_id(s_nextID.fetch_add(1, std::memory_order_relaxed))
+    {
+    }
+
+    template<typename Body, typename... Args>
+    Code expand(const Body& body, const Args&... args) const
+    {
+        CodeGenContext& context = CodeGenContext::current();
+        // Hits are the common case, so they look up a reused buffer rather than allocating a key.
+        static thread_local CodeGenContext::MacroExpansionKey scratch;
+        scratch.assign(1, m_id);
+        if (!(appendMacroArgumentKey(scratch, args) && ...))
+            return body(args...);
+
+        if (auto* expansion = context.findMacroExpansion(scratch)) {
+            if (context.buildsIR())
+                context.ir().appendRange(context.ir(), expansion->irBegin, expansion->irEnd);
+            if (context.buildsTree())
+                emit(expansion->code);
+            return expansion->code;
+        }
+
+        // The body may expand other memoized macros, which reuse the scratch buffer.
+        CodeGenContext::MacroExpansionKey key = scratch;
+        uint32_t irBegin = context.ir().instructions().size();
+        uint32_t numTmps = context.ir().numTmps();
+        Code code = body(args...);
+        if (context.ir().numTmps() == numTmps)
+            context.addMacroExpansion(std::move(key), { code, irBegin, static_cast<uint32_t>(context.ir().instructions().size()) });
+        return code;
+    }
+
+private:
+    static inline std::atomic<uint64_t> s_nextID { 0 };
+
+    uint64_t m_id;
+};
+
+// Prints the flat IR in a single pass over its instruction records, producing the
+// same text as generating the equivalent Generator tree. Register names come
+// from the target's compile-time table.
+template<Target target>
+void lowerIR(const IRBuffer& ir, Sink& sink)
+{
+    auto registerName = [](const IROperand& operand) {
+        if (operand.tmp)
+            unallocatedTemporary();
+        const char* name = machineRegisterName<target>(operand.gpr);
+        if (!name)
+            unavailableRegister(target, operand.gpr);
+        return name;
+    };
+
+    auto vectorRegisterName = [](const IROperand& operand) {
+        const char* name = machineRegisterName<target>(operand.vector);
+        if (!name)
+            unavailableVectorRegister(target, operand.vector);
+        return name;
+    };
+
+    for (const IRInstruction& instruction : ir.instructions()) {
+        if (instruction.opcode == Opcode::LabelDefinition) {
+            sink << ir.operand(instruction, 0).symbol.string() << ":\n";
+            continue;
+        }
+        if (instruction.opcode == Opcode::SpillArea)
+            continue;
+        sink << "    " << mnemonic(instruction.opcode);
+        for (unsigned i = 0; i < instruction.numOperands; ++i) {
+            const IROperand& operand = ir.operand(instruction, i);
+            sink << (i ? ", " : " ");
+            switch (operand.kind) {
+            case OperandKind::Register:
+                sink << registerName(operand);
+                break;
+            case OperandKind::LabelReference:
+                sink << operand.symbol.string();
+                break;
+            case OperandKind::Immediate:
+                sink << operand.value;
+                break;
+            case OperandKind::Address:
+                sink << operand.value << '[' << registerName(operand) << ']';
+                break;
+            case OperandKind::VectorRegister:
+                sink << vectorRegisterName(operand);
+                break;
+            }
+        }
+        sink << '\n';
+    }
+}
+
+inline void lowerIR(Target target, const IRBuffer& ir, Sink& sink)
+{
+    switch (target) {
+    case Target::ARM64:
+        return lowerIR<Target::ARM64>(ir, sink);
+    case Target::ARM64E:
+        return lowerIR<Target::ARM64E>(ir, sink);
+    case Target::X86_64:
+        return lowerIR<Target::X86_64>(ir, sink);
+    case Target::RISCV64:
+        return lowerIR<Target::RISCV64>(ir, sink);
+    case Target::ARMv7:
+        return lowerIR<Target::ARMv7>(ir, sink);
+    }
+}
+
+// Every generated body registers itself with the target it was preprocessed for.
+// A plain build links one body, configured by LLIntOfflineAsmConfig.h; including
+// the generated file once per target (see TargetBody.h) links several.
+using BodyFunction = Code (*)();
+
+struct TargetBody {
+    Target target;
+    BodyFunction body;
+};
+
+inline std::vector<TargetBody>& targetBodies()
+{
+    static std::vector<TargetBody> bodies;
+    return bodies;
+}
+
+inline Target configuredTarget(bool arm64, bool arm64e, bool x86_64, bool riscv64, bool armv7)
+{
+    if (arm64e)
+        return Target::ARM64E;
+    if (arm64)
+        return Target::ARM64;
+    if (x86_64)
+        return Target::X86_64;
+    if (riscv64)
+        return Target::RISCV64;
+    if (armv7)
+        return Target::ARMv7;
+    fputs("OfflineASM: body was not configured for a supported target\n", stderr);
+    std::exit(1);
+}
+
+struct TargetBodyRegistration {
+    TargetBodyRegistration(Target target, BodyFunction body)
+    {
+        targetBodies().push_back({ target, body });
+    }
+};
+
+// Expands at the registration site, so it sees that body's OFFLINE_ASM_* settings.
+#define OFFLINE_ASM_REGISTER_BODY(body) \
+    static const TargetBodyRegistration s_##body##Registration { configuredTarget(OFFLINE_ASM_ARM64, OFFLINE_ASM_ARM64E, OFFLINE_ASM_X86_64, OFFLINE_ASM_RISCV64, OFFLINE_ASM_ARMv7), body };
+
+#define DEFINE_REGISTER(name) inline constexpr Reg name { GPR::name };
+FOR_EACH_OFFLINE_ASM_GPR(DEFINE_REGISTER)
+#undef DEFINE_REGISTER
+
+#define DEFINE_VECTOR_REGISTER(name) inline constexpr VReg name { VectorRegister::name };
+FOR_EACH_OFFLINE_ASM_VECTOR_REGISTER(DEFINE_VECTOR_REGISTER)
+#undef DEFINE_VECTOR_REGISTER
 
 using namespace JSC;
 using namespace JSC::Wasm;
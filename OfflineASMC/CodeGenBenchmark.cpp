@@ -0,0 +1,102 @@
+// clang++ -O2 -g OfflineASMC/CodeGenBenchmark.cpp -o build/CodeGenBenchmark -lbenchmark -std=c++20
+// % build/CodeGenBenchmark --benchmark_filter='BM_(Tree|FlatIR)' --benchmark_repetitions=10
+//
+// Compares building and emitting a synthetic interpreter through the Generator
+// tree against recording and lowering the flat IR, each with and without macro
+// memoization (the template argument). All produce the same text; the argument
+// is the number of opcode handlers generated.
+
+#include <benchmark/benchmark.h>
+
+#include "CodeGen.h"
+
+// Wraps a macro the way OfflineASMRBToC does for named macros when memoize is set.
+template<bool memoize, typename Body>
+static auto macro(Body body)
+{
+    if constexpr (memoize) {
+        return [body, memo = MacroMemo()](auto... args) -> Code {
+            return memo.expand(body, args...);
+        };
+    } else
+        return body;
+}
+
+template<bool memoize>
+static void emitHandlers(int64_t count)
+{
+    CodeCollectionScope _;
+    auto preserveCallerPCAndCFR = macro<memoize>([&]() -> Code {
+        CodeCollectionScope __;
+        {
+            push(cfr, lr);
+            move(sp, cfr);
+        }
+        return __.code();
+    });
+    auto saveIPIntRegisters = macro<memoize>([&]() -> Code {
+        CodeCollectionScope __;
+        {
+            subp(96, sp);
+            storepairq(csr6, csr7, address(cfr, -0x10));
+            storeq(csr0, address(cfr, -0x18));
+        }
+        return __.code();
+    });
+    auto restoreIPIntRegisters = macro<memoize>([&]() -> Code {
+        CodeCollectionScope __;
+        {
+            loadpairq(address(cfr, -0x10), csr6, csr7);
+            loadq(address(cfr, -0x18), csr0);
+            addp(96, sp);
+        }
+        return __.code();
+    });
+    for (int64_t i = 0; i < count; ++i) {
+        label("_op_" + std::to_string(i))->inFile();
+        preserveCallerPCAndCFR();
+        saveIPIntRegisters();
+        addp(i, wa0);
+        call("_call_test");
+        bpeq(r0, i + 5, ".success");
+        _break();
+        label(".success");
+        restoreIPIntRegisters();
+        move(cfr, sp);
+        pop(lr, cfr);
+        ret();
+    }
+}
+
+template<bool memoize>
+static void BM_Tree(benchmark::State& state)
+{
+    for (auto _ : state) {
+        CodeGenContext context(CodeGenContext::Tree);
+        Sink sink;
+        CodeCollectionScope root;
+        emitHandlers<memoize>(state.range(0));
+        root.code()->generate(sink);
+        benchmark::DoNotOptimize(sink.take());
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK_TEMPLATE(BM_Tree, false)->Arg(1000)->Arg(10000)->Arg(100000);
+BENCHMARK_TEMPLATE(BM_Tree, true)->Arg(1000)->Arg(10000)->Arg(100000);
+
+template<bool memoize>
+static void BM_FlatIR(benchmark::State& state)
+{
+    for (auto _ : state) {
+        CodeGenContext context(CodeGenContext::FlatIR);
+        Sink sink;
+        emitHandlers<memoize>(state.range(0));
+        lowerIR(context.target(), context.ir(), sink);
+        benchmark::DoNotOptimize(sink.take());
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK_TEMPLATE(BM_FlatIR, false)->Arg(1000)->Arg(10000)->Arg(100000);
+BENCHMARK_TEMPLATE(BM_FlatIR, true)->Arg(1000)->Arg(10000)->Arg(100000);
+
+BENCHMARK_MAIN();
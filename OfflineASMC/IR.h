@@ -0,0 +1,208 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstdio>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+#include "Registers.h"
+#include "SymbolTable.h"
+
+// Every instruction the C++ generator knows about, as (function name, mnemonic).
+// The function name is what the generated test.asm.cpp calls; the mnemonic is
+// what gets printed when the instruction is lowered.
+#define FOR_EACH_OFFLINE_ASM_OPCODE(macro) \
+    macro(addp, "add") \
+    macro(push, "push") \
+    macro(move, "move") \
+    macro(pop, "pop") \
+    macro(subp, "sub") \
+    macro(storepairq, "storepairq") \
+    macro(storeq, "storeq") \
+    macro(loadpairq, "loadpairq") \
+    macro(loadq, "loadq") \
+    macro(storep, "storep") \
+    macro(loadp, "loadp") \
+    macro(storepairv, "storepairv") \
+    macro(storev, "storev") \
+    macro(loadpairv, "loadpairv") \
+    macro(loadv, "loadv") \
+    macro(_break, "brk") \
+    macro(jmp, "jmp") \
+    macro(ret, "ret") \
+    macro(call, "call") \
+    macro(bpeq, "bpeq") \
+
+enum class Opcode : uint8_t {
+#define DECLARE_OPCODE(name, mnemonic) name,
+    FOR_EACH_OFFLINE_ASM_OPCODE(DECLARE_OPCODE)
+#undef DECLARE_OPCODE
+    // Not an instruction: marks the definition of labels()[operand.value].
+    LabelDefinition,
+    // Not an instruction: operand 1 slots of 8 bytes from the address in operand 0
+    // on are free for the register allocator to spill the current handler's
+    // temporaries to (see RegisterAllocation.h).
+    SpillArea,
+};
+
+inline const char* mnemonic(Opcode opcode)
+{
+    switch (opcode) {
+#define OPCODE_MNEMONIC(name, mnemonic) case Opcode::name: return mnemonic;
+    FOR_EACH_OFFLINE_ASM_OPCODE(OPCODE_MNEMONIC)
+#undef OPCODE_MNEMONIC
+    case Opcode::LabelDefinition:
+    case Opcode::SpillArea:
+        break;
+    }
+    return "";
+}
+
+enum class OperandKind : uint8_t {
+    Register, // gpr, or tmp
+    Immediate, // value
+    Address, // gpr or tmp: base register, value: offset
+    LabelReference, // symbol: label name
+    VectorRegister, // vector
+};
+
+struct IROperand {
+    OperandKind kind;
+    GPR gpr;
+    Symbol symbol;
+    int64_t value;
+    // 1 + the number of the temporary that stands in for gpr (then invalidGPR)
+    // until register allocation, or 0.
+    uint32_t tmp { 0 };
+    VectorRegister vector { };
+};
+
+static_assert(sizeof(IROperand) == 24);
+
+struct IRInstruction {
+    Opcode opcode;
+    uint8_t numOperands;
+    uint32_t firstOperand; // Index into IRBuffer::operands().
+};
+
+struct IRLabel {
+    Symbol symbol;
+    bool inFile : 1;
+    bool global : 1;
+    bool extern_ : 1;
+    int alignTo;
+};
+
+static_assert(std::is_trivially_copyable_v<IRInstruction>);
+static_assert(std::is_trivially_copyable_v<IROperand>);
+
+// An instruction with its operands inline, for passes that rewrite the IR one
+// instruction at a time and then build a new IRBuffer out of the result.
+struct FlatInstruction {
+    static constexpr unsigned maxOperands = 4;
+
+    Opcode opcode;
+    uint8_t numOperands;
+    IROperand operands[maxOperands];
+
+    const IROperand& operand(unsigned index) const { return operands[index]; }
+    const IROperand& last() const { return operands[numOperands - 1]; }
+};
+
+// The flat representation of a generated body: instruction records laid out in
+// program order, with their operands in one side array and every name a Symbol.
+// Passes walk instructions() linearly and never chase pointers.
+class IRBuffer {
+public:
+    static constexpr unsigned maxOperands = FlatInstruction::maxOperands;
+
+    void append(Opcode opcode, const IROperand* operands, unsigned numOperands)
+    {
+        if (numOperands > maxOperands) {
+            fprintf(stderr, "OfflineASM: too many operands for %s\n", mnemonic(opcode));
+            std::exit(1);
+        }
+        m_instructions.push_back({ opcode, static_cast<uint8_t>(numOperands), static_cast<uint32_t>(m_operands.size()) });
+        m_operands.insert(m_operands.end(), operands, operands + numOperands);
+    }
+
+    uint32_t appendLabel(Symbol name)
+    {
+        uint32_t index = m_labels.size();
+        m_labels.push_back({ name, false, false, false, 0 });
+        IROperand operand { OperandKind::LabelReference, GPR::invalidGPR, m_labels.back().symbol, index };
+        append(Opcode::LabelDefinition, &operand, 1);
+        return index;
+    }
+
+    // Copies instructions [begin, end) of a buffer, possibly this one, onto the end
+    // of this one. Labels defined in that range are copied too and renumbered.
+    // Temporaries are renumbered by adding tmpOffset; to keep another buffer's
+    // apart from this one's, pass numTmps() and then reserveTmps(other.numTmps()).
+    void appendRange(const IRBuffer& other, size_t begin, size_t end, uint32_t tmpOffset = 0)
+    {
+        for (size_t i = begin; i < end; ++i) {
+            // Copied out first: appending may reallocate other's vectors when it is this buffer.
+            IRInstruction instruction = other.m_instructions[i];
+            IROperand operands[maxOperands];
+            std::copy_n(other.m_operands.begin() + instruction.firstOperand, instruction.numOperands, operands);
+            if (instruction.opcode == Opcode::LabelDefinition) {
+                IRLabel label = other.m_labels[operands[0].value];
+                m_labels.push_back(label);
+                operands[0].value = m_labels.size() - 1;
+            }
+            for (unsigned j = 0; tmpOffset && j < instruction.numOperands; ++j) {
+                if (operands[j].tmp)
+                    operands[j].tmp += tmpOffset;
+            }
+            append(instruction.opcode, operands, instruction.numOperands);
+        }
+    }
+
+    void reserveTmps(uint32_t count) { m_numTmps += count; }
+
+    std::vector<FlatInstruction> flatInstructions() const
+    {
+        std::vector<FlatInstruction> result;
+        result.reserve(m_instructions.size());
+        for (const IRInstruction& instruction : m_instructions) {
+            FlatInstruction copy { instruction.opcode, instruction.numOperands, { } };
+            std::copy_n(m_operands.begin() + instruction.firstOperand, instruction.numOperands, copy.operands);
+            result.push_back(copy);
+        }
+        return result;
+    }
+
+    // Replaces the instructions, keeping the labels and temporaries.
+    void setInstructions(const std::vector<FlatInstruction>& instructions)
+    {
+        m_instructions.clear();
+        m_operands.clear();
+        for (const FlatInstruction& instruction : instructions)
+            append(instruction.opcode, instruction.operands, instruction.numOperands);
+    }
+
+    // Temporaries are numbered per buffer; see appendRange().
+    uint32_t newTmp() { return ++m_numTmps; }
+    uint32_t numTmps() const { return m_numTmps; }
+
+    const std::vector<IRInstruction>& instructions() const { return m_instructions; }
+    const std::vector<IROperand>& operands() const { return m_operands; }
+    std::vector<IRLabel>& labels() { return m_labels; }
+    const std::vector<IRLabel>& labels() const { return m_labels; }
+
+    const IROperand& operand(const IRInstruction& instruction, unsigned index) const
+    {
+        return m_operands[instruction.firstOperand + index];
+    }
+
+private:
+    std::vector<IRInstruction> m_instructions;
+    std::vector<IROperand> m_operands;
+    std::vector<IRLabel> m_labels;
+    uint32_t m_numTmps { 0 };
+};
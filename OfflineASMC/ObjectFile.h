@@ -0,0 +1,324 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// The machine code of a body as an encoder (see ARM64Assembler.h) produces it: one
+// text section, the symbols defined in it or referenced from it, the relocations
+// of those references, and the unwind rules for the whole section, for
+// writeELFObject() to write out as a relocatable object.
+struct ObjectSymbol {
+    std::string name;
+    bool defined { true };
+    bool global { false };
+    bool function { false };
+    uint64_t offset { 0 };
+    uint64_t size { 0 };
+};
+
+struct ObjectRelocation {
+    uint64_t offset;
+    uint32_t type; // In the target's ELF numbering.
+    uint32_t symbol; // Index into ObjectFile::symbols.
+    int64_t addend;
+};
+
+struct ObjectFile {
+    uint16_t machine; // ELF e_machine.
+    uint32_t textAlignment { 4 };
+    std::vector<uint8_t> text;
+    std::vector<ObjectSymbol> symbols;
+    std::vector<ObjectRelocation> relocations;
+
+    // One FDE covers all of text. Its CIE says what the frameInstructions' factored
+    // operands are in units of, and where a caller's return address is.
+    uint32_t codeAlignment { 1 };
+    int32_t dataAlignment { -8 };
+    uint32_t returnAddressRegister { 0 };
+    std::vector<uint8_t> initialFrameInstructions;
+    std::vector<uint8_t> frameInstructions;
+    uint32_t pcRelative32Relocation { 0 }; // What the FDE's pc_begin is relocated with.
+};
+
+// Appends the DWARF call frame instructions the .cfi_* directives of the same
+// names stand for to instructions; offsets are in bytes, and are factored here.
+namespace CFI {
+
+inline void appendULEB128(std::vector<uint8_t>& bytes, uint64_t value)
+{
+    do {
+        uint8_t byte = value & 0x7f;
+        value >>= 7;
+        bytes.push_back(byte | (value ? 0x80 : 0));
+    } while (value);
+}
+
+inline void appendSLEB128(std::vector<uint8_t>& bytes, int64_t value)
+{
+    while (true) {
+        uint8_t byte = value & 0x7f;
+        value >>= 7;
+        bool done = (!value && !(byte & 0x40)) || (value == -1 && (byte & 0x40));
+        bytes.push_back(byte | (done ? 0 : 0x80));
+        if (done)
+            return;
+    }
+}
+
+inline void defCFA(std::vector<uint8_t>& instructions, unsigned reg, uint64_t offset)
+{
+    instructions.push_back(0x0c); // DW_CFA_def_cfa
+    appendULEB128(instructions, reg);
+    appendULEB128(instructions, offset);
+}
+
+inline void offset(const ObjectFile& object, std::vector<uint8_t>& instructions, unsigned reg, int64_t cfaOffset)
+{
+    int64_t factored = cfaOffset / object.dataAlignment;
+    if (factored >= 0 && reg < 0x40) {
+        instructions.push_back(0x80 | reg); // DW_CFA_offset
+        appendULEB128(instructions, factored);
+        return;
+    }
+    instructions.push_back(0x11); // DW_CFA_offset_extended_sf
+    appendULEB128(instructions, reg);
+    appendSLEB128(instructions, factored);
+}
+
+inline void advance(const ObjectFile& object, std::vector<uint8_t>& instructions, uint64_t bytes)
+{
+    uint64_t delta = bytes / object.codeAlignment;
+    if (delta < 0x40) {
+        instructions.push_back(0x40 | delta); // DW_CFA_advance_loc
+        return;
+    }
+    instructions.push_back(0x04); // DW_CFA_advance_loc4
+    for (unsigned i = 0; i < 4; ++i)
+        instructions.push_back(delta >> (8 * i));
+}
+
+} // namespace CFI
+
+namespace ELF {
+
+constexpr uint32_t SHT_PROGBITS = 1;
+constexpr uint32_t SHT_SYMTAB = 2;
+constexpr uint32_t SHT_STRTAB = 3;
+constexpr uint32_t SHT_RELA = 4;
+constexpr uint64_t SHF_ALLOC = 0x2;
+constexpr uint64_t SHF_EXECINSTR = 0x4;
+constexpr uint64_t SHF_INFO_LINK = 0x40;
+constexpr uint8_t STB_LOCAL = 0;
+constexpr uint8_t STB_GLOBAL = 1;
+constexpr uint8_t STT_NOTYPE = 0;
+constexpr uint8_t STT_FUNC = 2;
+constexpr uint8_t STT_SECTION = 3;
+constexpr uint8_t STV_HIDDEN = 2;
+
+class Writer {
+public:
+    template<typename T>
+    void append(T value)
+    {
+        for (size_t i = 0; i < sizeof(T); ++i)
+            m_bytes.push_back(static_cast<uint64_t>(value) >> (8 * i));
+    }
+
+    void append(const std::vector<uint8_t>& bytes) { m_bytes.insert(m_bytes.end(), bytes.begin(), bytes.end()); }
+
+    void alignTo(size_t alignment)
+    {
+        while (m_bytes.size() % alignment)
+            m_bytes.push_back(0);
+    }
+
+    template<typename T>
+    void patch(size_t offset, T value)
+    {
+        for (size_t i = 0; i < sizeof(T); ++i)
+            m_bytes[offset + i] = static_cast<uint64_t>(value) >> (8 * i);
+    }
+
+    size_t size() const { return m_bytes.size(); }
+    std::vector<uint8_t>& bytes() { return m_bytes; }
+
+private:
+    std::vector<uint8_t> m_bytes;
+};
+
+class StringTable {
+public:
+    StringTable() { m_bytes.push_back(0); }
+
+    uint32_t add(std::string_view string)
+    {
+        uint32_t offset = m_bytes.size();
+        m_bytes.insert(m_bytes.end(), string.begin(), string.end());
+        m_bytes.push_back(0);
+        return offset;
+    }
+
+    const std::vector<uint8_t>& bytes() const { return m_bytes; }
+
+private:
+    std::vector<uint8_t> m_bytes;
+};
+
+// .eh_frame with one CIE and one FDE over all of .text, whose pc_begin relocation
+// is returned in relocations against symbol textSymbol.
+inline std::vector<uint8_t> frameSection(const ObjectFile& object, uint32_t textSymbol, std::vector<ObjectRelocation>& relocations)
+{
+    Writer writer;
+    auto entry = [&](auto&& body) {
+        size_t start = writer.size();
+        writer.append<uint32_t>(0); // length, patched below.
+        body();
+        writer.alignTo(8);
+        writer.patch<uint32_t>(start, writer.size() - start - 4);
+    };
+
+    entry([&] {
+        writer.append<uint32_t>(0); // CIE id
+        writer.append<uint8_t>(1); // version
+        writer.append(std::vector<uint8_t> { 'z', 'R', 0 });
+        std::vector<uint8_t> fields;
+        CFI::appendULEB128(fields, object.codeAlignment);
+        CFI::appendSLEB128(fields, object.dataAlignment);
+        CFI::appendULEB128(fields, object.returnAddressRegister);
+        fields.push_back(1); // augmentation data length
+        fields.push_back(0x1b); // DW_EH_PE_pcrel | DW_EH_PE_sdata4
+        writer.append(fields);
+        writer.append(object.initialFrameInstructions);
+    });
+
+    entry([&] {
+        writer.append<uint32_t>(writer.size()); // CIE pointer, back to offset 0
+        relocations.push_back({ writer.size(), object.pcRelative32Relocation, textSymbol, 0 });
+        writer.append<int32_t>(0); // pc_begin
+        writer.append<uint32_t>(object.text.size()); // pc_range
+        writer.append<uint8_t>(0); // augmentation data length
+        writer.append(object.frameInstructions);
+    });
+    return std::move(writer.bytes());
+}
+
+} // namespace ELF
+
+// A little-endian ELF64 relocatable object with .text, its relocations, .eh_frame
+// and a non-executable stack note. Local symbols come first, as ELF requires.
+inline std::string writeELFObject(const ObjectFile& object)
+{
+    enum Section : uint16_t { Null, Text, TextRelocations, Frame, FrameRelocations, StackNote, SymbolTable, Strings, SectionNames, NumberOfSections };
+
+    ELF::StringTable strings;
+    ELF::Writer symbols;
+    std::vector<uint32_t> symbolIndex(object.symbols.size());
+    auto appendSymbol = [&](uint32_t name, uint8_t binding, uint8_t type, uint8_t visibility, uint16_t section, uint64_t value, uint64_t size) {
+        symbols.append<uint32_t>(name);
+        symbols.append<uint8_t>((binding << 4) | type);
+        symbols.append<uint8_t>(visibility);
+        symbols.append<uint16_t>(section);
+        symbols.append<uint64_t>(value);
+        symbols.append<uint64_t>(size);
+    };
+    appendSymbol(0, ELF::STB_LOCAL, ELF::STT_NOTYPE, 0, 0, 0, 0);
+    uint32_t textSymbol = 1;
+    appendSymbol(0, ELF::STB_LOCAL, ELF::STT_SECTION, 0, Text, 0, 0);
+    uint32_t numberOfSymbols = 2;
+    uint32_t firstGlobalSymbol = 0;
+    for (bool global : { false, true }) {
+        if (global)
+            firstGlobalSymbol = numberOfSymbols;
+        for (size_t i = 0; i < object.symbols.size(); ++i) {
+            const ObjectSymbol& symbol = object.symbols[i];
+            if (symbol.global != global)
+                continue;
+            symbolIndex[i] = numberOfSymbols++;
+            appendSymbol(strings.add(symbol.name), global ? ELF::STB_GLOBAL : ELF::STB_LOCAL, symbol.function ? ELF::STT_FUNC : ELF::STT_NOTYPE,
+                global && symbol.defined ? ELF::STV_HIDDEN : 0, symbol.defined ? Text : 0, symbol.offset, symbol.size);
+        }
+    }
+
+    auto relocationSection = [](const std::vector<ObjectRelocation>& relocations, auto&& symbolOf) {
+        ELF::Writer writer;
+        for (const ObjectRelocation& relocation : relocations) {
+            writer.append<uint64_t>(relocation.offset);
+            writer.append<uint64_t>((static_cast<uint64_t>(symbolOf(relocation.symbol)) << 32) | relocation.type);
+            writer.append<int64_t>(relocation.addend);
+        }
+        return std::move(writer.bytes());
+    };
+    std::vector<uint8_t> textRelocations = relocationSection(object.relocations, [&](uint32_t symbol) { return symbolIndex[symbol]; });
+    std::vector<ObjectRelocation> frameRelocationList;
+    std::vector<uint8_t> frame = ELF::frameSection(object, textSymbol, frameRelocationList);
+    std::vector<uint8_t> frameRelocations = relocationSection(frameRelocationList, [](uint32_t symbol) { return symbol; });
+
+    ELF::StringTable sectionNames;
+    struct SectionHeader {
+        uint32_t name { 0 };
+        uint32_t type { 0 };
+        uint64_t flags { 0 };
+        uint64_t offset { 0 };
+        uint64_t size { 0 };
+        uint32_t link { 0 };
+        uint32_t info { 0 };
+        uint64_t alignment { 0 };
+        uint64_t entrySize { 0 };
+        const std::vector<uint8_t>* contents { nullptr };
+    };
+    SectionHeader sections[NumberOfSections];
+    sections[Text] = { sectionNames.add(".text"), ELF::SHT_PROGBITS, ELF::SHF_ALLOC | ELF::SHF_EXECINSTR, 0, 0, 0, 0, object.textAlignment, 0, &object.text };
+    sections[TextRelocations] = { sectionNames.add(".rela.text"), ELF::SHT_RELA, ELF::SHF_INFO_LINK, 0, 0, SymbolTable, Text, 8, 24, &textRelocations };
+    sections[Frame] = { sectionNames.add(".eh_frame"), ELF::SHT_PROGBITS, ELF::SHF_ALLOC, 0, 0, 0, 0, 8, 0, &frame };
+    sections[FrameRelocations] = { sectionNames.add(".rela.eh_frame"), ELF::SHT_RELA, ELF::SHF_INFO_LINK, 0, 0, SymbolTable, Frame, 8, 24, &frameRelocations };
+    static const std::vector<uint8_t> empty;
+    sections[StackNote] = { sectionNames.add(".note.GNU-stack"), ELF::SHT_PROGBITS, 0, 0, 0, 0, 0, 1, 0, &empty };
+    sections[SymbolTable] = { sectionNames.add(".symtab"), ELF::SHT_SYMTAB, 0, 0, 0, Strings, firstGlobalSymbol, 8, 24, &symbols.bytes() };
+    sections[Strings] = { sectionNames.add(".strtab"), ELF::SHT_STRTAB, 0, 0, 0, 0, 0, 1, 0, &strings.bytes() };
+    uint32_t sectionNamesName = sectionNames.add(".shstrtab");
+    sections[SectionNames] = { sectionNamesName, ELF::SHT_STRTAB, 0, 0, 0, 0, 0, 1, 0, &sectionNames.bytes() };
+
+    constexpr size_t headerSize = 64;
+    ELF::Writer writer;
+    writer.bytes().resize(headerSize);
+    for (SectionHeader& section : sections) {
+        if (!section.contents)
+            continue;
+        writer.alignTo(std::max<uint64_t>(section.alignment, 1));
+        section.offset = writer.size();
+        section.size = section.contents->size();
+        writer.append(*section.contents);
+    }
+    writer.alignTo(8);
+    size_t sectionHeaders = writer.size();
+    for (const SectionHeader& section : sections) {
+        writer.append<uint32_t>(section.name);
+        writer.append<uint32_t>(section.type);
+        writer.append<uint64_t>(section.flags);
+        writer.append<uint64_t>(0); // sh_addr
+        writer.append<uint64_t>(section.offset);
+        writer.append<uint64_t>(section.size);
+        writer.append<uint32_t>(section.link);
+        writer.append<uint32_t>(section.info);
+        writer.append<uint64_t>(section.alignment);
+        writer.append<uint64_t>(section.entrySize);
+    }
+
+    static constexpr uint8_t identification[16] = { 0x7f, 'E', 'L', 'F', 2 /* ELFCLASS64 */, 1 /* ELFDATA2LSB */, 1 /* EV_CURRENT */ };
+    memcpy(writer.bytes().data(), identification, sizeof(identification));
+    writer.patch<uint16_t>(16, 1); // ET_REL
+    writer.patch<uint16_t>(18, object.machine);
+    writer.patch<uint32_t>(20, 1); // EV_CURRENT
+    writer.patch<uint64_t>(40, sectionHeaders);
+    writer.patch<uint16_t>(52, headerSize);
+    writer.patch<uint16_t>(58, 64); // e_shentsize
+    writer.patch<uint16_t>(60, NumberOfSections);
+    writer.patch<uint16_t>(62, SectionNames);
+    return std::string(writer.bytes().begin(), writer.bytes().end());
+}
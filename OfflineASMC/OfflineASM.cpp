@@ -1,9 +1,145 @@
+#include "ARM64Assembler.h"
 #include "CodeGen.h"
+#include "Peephole.h"
+#include "RegisterAllocation.h"
+#include "ShrinkWrapping.h"
 
-Code body();
+#include <thread>
 
-int main(int, char**)
+struct Options {
+    bool useTree { false };
+    bool peephole { false };
+    bool shrinkWrap { false };
+    bool object { false };
+    unsigned jobs { 1 };
+    std::vector<Target> targets;
+    const char* outputFileName { nullptr };
+};
+
+static void generateForTarget(const TargetBody& targetBody, const Options& options, std::string& result)
+{
+    CodeGenContext context(options.useTree ? CodeGenContext::Tree : CodeGenContext::FlatIR, targetBody.target);
+    context.setParallelism(options.jobs);
+    Sink sink;
+    sink << "#if OFFLINE_ASM_" << targetName(targetBody.target) << '\n';
+    if (options.useTree)
+        targetBody.body()->generate(sink);
+    else {
+        targetBody.body();
+        if (allocateRegisters(targetBody.target, context.ir()))
+            context.clearMacroExpansions();
+        if (options.shrinkWrap && shrinkWrap(targetBody.target, context.ir()))
+            context.clearMacroExpansions();
+        if (options.peephole && optimizePeephole(targetBody.target, context.ir()))
+            context.clearMacroExpansions();
+        if (options.object) {
+            result = emitARM64Object(context.ir());
+            return;
+        }
+        lowerIR(targetBody.target, context.ir(), sink);
+    }
+    sink << "#endif // OFFLINE_ASM_" << targetName(targetBody.target) << '\n';
+    result = sink.take();
+}
+
+// Usage: OfflineASM [--tree | [--shrink-wrap] [--peephole]] [--object] [--jobs=<n>] [--targets=<backend>[,<backend>...]] [outputFile]
+//
+// Emits every linked target body (or just the requested ones), each guarded by its
+// OFFLINE_ASM_<backend> setting. Targets are generated on their own threads and
+// written out in the requested order. By default body() records the flat IR,
+// which is then lowered in one pass; --tree builds and walks the Generator tree
+// instead. Temporaries (tmp() in CodeGen.h) only exist in the flat IR, which gets
+// them registers from RegisterAllocation.h first. --shrink-wrap then narrows the
+// callee-save frames of the flat IR (see ShrinkWrapping.h), and --peephole runs the
+// rules of Peephole.h over it before lowering it. --object encodes the flat IR as
+// machine code instead and writes a relocatable ELF object, which
+// LowLevelInterpreter.cpp built with ENABLE(OFFLINE_ASM_OBJECT) links against;
+// only ARM64 has an encoder (see ARM64Assembler.h). --jobs=<n> generates the op()
+// bodies of each target on up to n worker threads (0 means one per core); the
+// output is the same for any n.
+int main(int argc, char** argv)
 {
-    puts(body()->generate().c_str());
+    Options options;
+    for (int i = 1; i < argc; ++i) {
+        std::string_view argument = argv[i];
+        if (argument == "--tree")
+            options.useTree = true;
+        else if (argument == "--peephole")
+            options.peephole = true;
+        else if (argument == "--shrink-wrap")
+            options.shrinkWrap = true;
+        else if (argument == "--object")
+            options.object = true;
+        else if (argument.substr(0, 7) == "--jobs=") {
+            options.jobs = std::strtoul(argv[i] + 7, nullptr, 10);
+            if (!options.jobs)
+                options.jobs = std::max(1u, std::thread::hardware_concurrency());
+        } else if (argument.substr(0, 10) == "--targets=") {
+            std::string_view list = argument.substr(10);
+            while (!list.empty()) {
+                size_t comma = list.find(',');
+                std::string_view name = list.substr(0, comma);
+                auto target = parseTarget(name);
+                if (!target) {
+                    fprintf(stderr, "OfflineASM: unknown target %.*s\n", static_cast<int>(name.size()), name.data());
+                    return 1;
+                }
+                options.targets.push_back(*target);
+                list = comma == std::string_view::npos ? std::string_view() : list.substr(comma + 1);
+            }
+        } else
+            options.outputFileName = argv[i];
+    }
+
+    if (options.useTree && options.peephole) {
+        fprintf(stderr, "OfflineASM: --peephole only applies to the flat IR, not --tree\n");
+        return 1;
+    }
+
+    if (options.useTree && options.shrinkWrap) {
+        fprintf(stderr, "OfflineASM: --shrink-wrap only applies to the flat IR, not --tree\n");
+        return 1;
+    }
+
+    std::vector<TargetBody> bodies;
+    if (options.targets.empty())
+        bodies = targetBodies();
+    for (Target target : options.targets) {
+        auto iter = std::find_if(targetBodies().begin(), targetBodies().end(), [&](const TargetBody& body) {
+            return body.target == target;
+        });
+        if (iter == targetBodies().end()) {
+            fprintf(stderr, "OfflineASM: no body was built for %s\n", targetName(target));
+            return 1;
+        }
+        bodies.push_back(*iter);
+    }
+
+    if (options.object && (options.useTree || bodies.size() != 1 || bodies[0].target != Target::ARM64)) {
+        fprintf(stderr, "OfflineASM: --object encodes exactly one ARM64 body, from the flat IR\n");
+        return 1;
+    }
+
+    FILE* output = options.outputFileName ? fopen(options.outputFileName, options.object ? "wb" : "w") : stdout;
+    if (!output) {
+        perror(options.outputFileName);
+        return 1;
+    }
+
+    std::vector<std::string> results(bodies.size());
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < bodies.size(); ++i)
+        threads.emplace_back(generateForTarget, std::cref(bodies[i]), std::cref(options), std::ref(results[i]));
+    for (auto& thread : threads)
+        thread.join();
+
+    {
+        Sink sink(output);
+        for (const std::string& result : results)
+            sink << result;
+    }
+
+    if (output != stdout)
+        fclose(output);
     return 0;
 }
@@ -0,0 +1,258 @@
+#pragma once
+
+#include <span>
+#include <vector>
+
+#include "IR.h"
+
+// Rewrites the flat IR between body() and lowering. Each rule looks at the
+// instructions from some point on and either declines, or consumes a prefix of
+// them and emits their replacement; rules run in order at every instruction, and
+// passes repeat until none applies. A rule only sees instructions, so it must not
+// reorder anything across a LabelDefinition it has not looked at.
+using PeepholeInstruction = FlatInstruction;
+
+struct PeepholeRule {
+    using Function = size_t (*)(Target, std::span<const PeepholeInstruction>, std::vector<PeepholeInstruction>& replacement);
+
+    const char* name;
+    bool (*appliesTo)(Target);
+    Function apply; // Returns how many instructions it consumed; 0 if it did not apply.
+};
+
+namespace Peephole {
+
+inline bool isRegister(const IROperand& operand, GPR gpr)
+{
+    return operand.kind == OperandKind::Register && operand.gpr == gpr;
+}
+
+inline bool mentions(const PeepholeInstruction& instruction, GPR gpr)
+{
+    for (unsigned i = 0; i < instruction.numOperands; ++i) {
+        const IROperand& operand = instruction.operand(i);
+        if ((operand.kind == OperandKind::Register || operand.kind == OperandKind::Address) && operand.gpr == gpr)
+            return true;
+    }
+    return false;
+}
+
+inline bool isArithmeticOrMove(Opcode opcode)
+{
+    return opcode == Opcode::addp || opcode == Opcode::subp || opcode == Opcode::move;
+}
+
+// addp/subp/move whose destination, always the last operand, is gpr.
+inline bool overwrites(const PeepholeInstruction& instruction, GPR gpr)
+{
+    return isArithmeticOrMove(instruction.opcode) && instruction.numOperands >= 2 && isRegister(instruction.last(), gpr);
+}
+
+inline bool anyTarget(Target) { return true; }
+inline bool hasPairInstructions(Target target) { return target == Target::ARM64 || target == Target::ARM64E; }
+
+// A write to sp that a later "move x, sp" replaces before anything reads it, such
+// as the addp that restoreIPIntRegisters() ends with when restoreCallerPCAndCFR()
+// follows. Only register arithmetic that leaves sp alone may come in between, so
+// no memory access ever sees the stack pointer change.
+inline size_t removeDeadStackPointerWrite(Target, std::span<const PeepholeInstruction> window, std::vector<PeepholeInstruction>&)
+{
+    if (!overwrites(window[0], GPR::sp))
+        return 0;
+    for (size_t i = 1; i < window.size(); ++i) {
+        const PeepholeInstruction& instruction = window[i];
+        if (instruction.opcode == Opcode::move && isRegister(instruction.operand(1), GPR::sp))
+            return isRegister(instruction.operand(0), GPR::sp) ? 0 : 1;
+        if (!isArithmeticOrMove(instruction.opcode) || mentions(instruction, GPR::sp))
+            return 0;
+    }
+    return 0;
+}
+
+// Whether operand is a register that is the same machine register as gpr on
+// target; several GPRs can name one, like t0, a0, r0 and wa0 on ARM64.
+inline bool isRegister(Target target, const IROperand& operand, GPR gpr)
+{
+    return operand.kind == OperandKind::Register && sameRegister(target, operand.gpr, gpr);
+}
+
+inline size_t removeRedundantMove(Target target, std::span<const PeepholeInstruction> window, std::vector<PeepholeInstruction>& replacement)
+{
+    const PeepholeInstruction& first = window[0];
+    if (first.opcode != Opcode::move || first.operand(0).kind != OperandKind::Register)
+        return 0;
+    GPR source = first.operand(0).gpr;
+    GPR destination = first.operand(1).gpr;
+    if (sameRegister(target, source, destination))
+        return 1;
+    // move a, b; move b, a: the second one changes nothing.
+    if (window.size() >= 2) {
+        const PeepholeInstruction& second = window[1];
+        if (second.opcode == Opcode::move && isRegister(target, second.operand(0), destination) && isRegister(target, second.operand(1), source)) {
+            replacement.push_back(first);
+            return 2;
+        }
+    }
+    return 0;
+}
+
+// Whether a pair of size-byte slots can start at offset: a signed 7-bit multiple of size.
+inline bool isPairOffset(int64_t offset, int64_t size = 8)
+{
+    return !(offset % size) && offset >= -64 * size && offset <= 63 * size;
+}
+
+// Two 8-byte stores or loads of adjacent slots off the same base, in either order,
+// become one storepairq or loadpairq, and two 16-byte vector ones one storepairv
+// or loadpairv. A load pair must not clobber its base, or the register the other
+// load writes, with its first load.
+inline size_t formPair(Target target, std::span<const PeepholeInstruction> window, std::vector<PeepholeInstruction>& replacement)
+{
+    if (window.size() < 2)
+        return 0;
+    const PeepholeInstruction& first = window[0];
+    const PeepholeInstruction& second = window[1];
+    if (first.opcode != second.opcode)
+        return 0;
+
+    if (first.opcode == Opcode::storev || first.opcode == Opcode::loadv) {
+        bool isLoad = first.opcode == Opcode::loadv;
+        unsigned addressIndex = isLoad ? 0 : 1;
+        unsigned valueIndex = isLoad ? 1 : 0;
+        const IROperand& firstAddress = first.operand(addressIndex);
+        const IROperand& secondAddress = second.operand(addressIndex);
+        if (firstAddress.kind != OperandKind::Address || secondAddress.kind != OperandKind::Address || !sameRegister(target, firstAddress.gpr, secondAddress.gpr))
+            return 0;
+        if (first.operand(valueIndex).kind != OperandKind::VectorRegister || second.operand(valueIndex).kind != OperandKind::VectorRegister)
+            return 0;
+        if (isLoad && first.operand(1).vector == second.operand(1).vector)
+            return 0;
+        const PeepholeInstruction* low = &first;
+        const PeepholeInstruction* high = &second;
+        if (secondAddress.value + 16 == firstAddress.value)
+            std::swap(low, high);
+        else if (firstAddress.value + 16 != secondAddress.value)
+            return 0;
+        if (!isPairOffset(low->operand(addressIndex).value, 16))
+            return 0;
+        if (isLoad)
+            replacement.push_back({ Opcode::loadpairv, 3, { low->operand(0), low->operand(1), high->operand(1) } });
+        else
+            replacement.push_back({ Opcode::storepairv, 3, { low->operand(0), high->operand(0), low->operand(1) } });
+        return 2;
+    }
+
+    if (first.opcode == Opcode::storeq) {
+        const IROperand& firstAddress = first.operand(1);
+        const IROperand& secondAddress = second.operand(1);
+        if (firstAddress.kind != OperandKind::Address || secondAddress.kind != OperandKind::Address || !sameRegister(target, firstAddress.gpr, secondAddress.gpr))
+            return 0;
+        if (first.operand(0).kind != OperandKind::Register || second.operand(0).kind != OperandKind::Register)
+            return 0;
+        const PeepholeInstruction* low = &first;
+        const PeepholeInstruction* high = &second;
+        if (secondAddress.value + 8 == firstAddress.value)
+            std::swap(low, high);
+        else if (firstAddress.value + 8 != secondAddress.value)
+            return 0;
+        if (!isPairOffset(low->operand(1).value))
+            return 0;
+        replacement.push_back({ Opcode::storepairq, 3, { low->operand(0), high->operand(0), low->operand(1) } });
+        return 2;
+    }
+
+    if (first.opcode == Opcode::loadq) {
+        const IROperand& firstAddress = first.operand(0);
+        const IROperand& secondAddress = second.operand(0);
+        if (firstAddress.kind != OperandKind::Address || secondAddress.kind != OperandKind::Address || !sameRegister(target, firstAddress.gpr, secondAddress.gpr))
+            return 0;
+        GPR firstDestination = first.operand(1).gpr;
+        GPR secondDestination = second.operand(1).gpr;
+        if (sameRegister(target, firstDestination, firstAddress.gpr) || sameRegister(target, firstDestination, secondDestination))
+            return 0;
+        const PeepholeInstruction* low = &first;
+        const PeepholeInstruction* high = &second;
+        if (secondAddress.value + 8 == firstAddress.value)
+            std::swap(low, high);
+        else if (firstAddress.value + 8 != secondAddress.value)
+            return 0;
+        if (!isPairOffset(low->operand(0).value))
+            return 0;
+        replacement.push_back({ Opcode::loadpairq, 3, { low->operand(0), low->operand(1), high->operand(1) } });
+        return 2;
+    }
+
+    return 0;
+}
+
+// A jump, or a compare-and-branch, to a label defined right after it.
+inline size_t removeBranchToNext(Target, std::span<const PeepholeInstruction> window, std::vector<PeepholeInstruction>&)
+{
+    const PeepholeInstruction& branch = window[0];
+    if (branch.opcode != Opcode::jmp && branch.opcode != Opcode::bpeq)
+        return 0;
+    if (branch.last().kind != OperandKind::LabelReference)
+        return 0;
+    for (size_t i = 1; i < window.size() && window[i].opcode == Opcode::LabelDefinition; ++i) {
+        if (window[i].operand(0).symbol == branch.last().symbol)
+            return 1;
+    }
+    return 0;
+}
+
+} // namespace Peephole
+
+inline std::vector<PeepholeRule>& peepholeRules()
+{
+    static std::vector<PeepholeRule> rules {
+        { "dead stack pointer write", Peephole::anyTarget, Peephole::removeDeadStackPointerWrite },
+        { "redundant move", Peephole::anyTarget, Peephole::removeRedundantMove },
+        { "pair formation", Peephole::hasPairInstructions, Peephole::formPair },
+        { "branch to next", Peephole::anyTarget, Peephole::removeBranchToNext },
+    };
+    return rules;
+}
+
+// Runs every rule that applies to target over ir until none fires, and returns
+// how many instructions that saved.
+inline size_t optimizePeephole(Target target, IRBuffer& ir, const std::vector<PeepholeRule>& rules = peepholeRules())
+{
+    std::vector<const PeepholeRule*> activeRules;
+    for (const PeepholeRule& rule : rules) {
+        if (rule.appliesTo(target))
+            activeRules.push_back(&rule);
+    }
+
+    std::vector<PeepholeInstruction> instructions = ir.flatInstructions();
+    size_t originalSize = instructions.size();
+
+    std::vector<PeepholeInstruction> rewritten;
+    bool optimized = false;
+    for (bool changed = true; changed; optimized |= changed) {
+        changed = false;
+        rewritten.clear();
+        for (size_t i = 0; i < instructions.size();) {
+            std::span<const PeepholeInstruction> window(instructions.data() + i, instructions.size() - i);
+            size_t consumed = 0;
+            if (window[0].opcode != Opcode::LabelDefinition) {
+                for (const PeepholeRule* rule : activeRules) {
+                    if ((consumed = rule->apply(target, window, rewritten)))
+                        break;
+                }
+            }
+            if (!consumed) {
+                rewritten.push_back(window[0]);
+                consumed = 1;
+            } else
+                changed = true;
+            i += consumed;
+        }
+        std::swap(instructions, rewritten);
+    }
+
+    if (!optimized)
+        return 0;
+
+    ir.setInstructions(instructions);
+    return originalSize - instructions.size();
+}
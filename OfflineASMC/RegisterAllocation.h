@@ -0,0 +1,514 @@
+#pragma once
+
+#include <algorithm>
+#include <cstring>
+#include <span>
+#include <unordered_map>
+#include <vector>
+
+#include "IR.h"
+
+// Gives the temporaries of the flat IR (see tmp() in CodeGen.h) machine registers,
+// one handler at a time: a handler runs from a global or glue label up to the
+// next one, and local labels (".name") are inside it. A liveness analysis over the
+// handler's instructions finds where each temporary and each scratch register it
+// names holds a value, and a linear scan over the temporaries' live ranges gives
+// each one a scratch register that is free over all of its range. Only when more
+// temporaries are live at once than there are registers is one spilled, the one
+// whose range reaches furthest: it then lives in a slot of the handler's
+// spillArea(), loaded into a fresh temporary before every instruction that reads
+// it and stored after every one that writes it, and the handler is allocated
+// again.
+//
+// Registers the handler never names are assumed to hold nothing on entry and to be
+// dead on exit. At a ret, r0 and r1 are live; at a call every argument register is
+// live and every scratch register is clobbered, so a temporary live across a call
+// is always spilled. Wherever the handler leaves for code of its own choosing (a
+// jmp to another handler or through a register, or falling into the next one),
+// every scratch register it names is treated as live.
+namespace RegisterAllocation {
+
+enum Access : uint8_t {
+    Use = 1 << 0,
+    Def = 1 << 1,
+};
+
+// How operand index of opcode is accessed, if it is a register. The base of an
+// address is only ever read.
+inline unsigned access(Opcode opcode, unsigned index, unsigned numOperands)
+{
+    switch (opcode) {
+    case Opcode::addp:
+    case Opcode::subp:
+        if (index != numOperands - 1)
+            return Use;
+        return numOperands == 2 ? Use | Def : Def;
+    case Opcode::move:
+    case Opcode::loadq:
+    case Opcode::loadp:
+    case Opcode::loadpairq:
+    case Opcode::loadv:
+    case Opcode::loadpairv:
+        return index ? Def : Use;
+    case Opcode::pop:
+        return Def;
+    default:
+        return Use;
+    }
+}
+
+inline unsigned access(const FlatInstruction& instruction, unsigned index)
+{
+    if (instruction.operand(index).kind == OperandKind::Address)
+        return Use;
+    return access(instruction.opcode, index, instruction.numOperands);
+}
+
+// The registers temporaries may be given, in order of preference: the target's
+// caller-saved scratch registers, without the ones Asm/test.asm pins (PL on every
+// target, and MC on ARMv7), argument registers last. Every other register
+// test.asm pins (PC, MC, WI, MB, BC) is callee-saved and never given out.
+inline constexpr GPR arm64ScratchRegisters[] = { GPR::t8, GPR::t9, GPR::t10, GPR::t11, GPR::t12, GPR::t7, GPR::t5, GPR::t4, GPR::t3, GPR::t2, GPR::t1, GPR::t0 };
+inline constexpr GPR x86_64ScratchRegisters[] = { GPR::t4, GPR::t7, GPR::t3, GPR::t2, GPR::t1, GPR::t6, GPR::t0 };
+inline constexpr GPR riscv64ScratchRegisters[] = { GPR::ws0, GPR::ws1, GPR::t7, GPR::t6, GPR::t5, GPR::t4, GPR::t3, GPR::t2, GPR::t1, GPR::t0 };
+inline constexpr GPR armv7ScratchRegisters[] = { GPR::t3, GPR::t2, GPR::t1, GPR::t0 };
+
+inline std::span<const GPR> scratchRegisters(Target target)
+{
+    switch (target) {
+    case Target::ARM64:
+    case Target::ARM64E:
+        return arm64ScratchRegisters;
+    case Target::X86_64:
+        return x86_64ScratchRegisters;
+    case Target::RISCV64:
+        return riscv64ScratchRegisters;
+    case Target::ARMv7:
+        return armv7ScratchRegisters;
+    }
+    return { };
+}
+
+inline constexpr GPR argumentRegisters[] = { GPR::a0, GPR::a1, GPR::a2, GPR::a3, GPR::a4, GPR::a5, GPR::a6, GPR::a7 };
+inline constexpr GPR returnRegisters[] = { GPR::r0, GPR::r1 };
+
+inline bool isHandlerLabel(const FlatInstruction& instruction)
+{
+    return instruction.opcode == Opcode::LabelDefinition && instruction.operand(0).symbol.string()[0] != '.';
+}
+
+class LiveSet {
+public:
+    explicit LiveSet(size_t size = 0)
+        : m_words((size + 63) / 64)
+    {
+    }
+
+    bool contains(size_t index) const { return m_words[index / 64] & (1ull << (index % 64)); }
+    void add(size_t index) { m_words[index / 64] |= 1ull << (index % 64); }
+    void remove(size_t index) { m_words[index / 64] &= ~(1ull << (index % 64)); }
+
+    // Returns whether this changed.
+    bool merge(const LiveSet& other)
+    {
+        bool changed = false;
+        for (size_t i = 0; i < m_words.size(); ++i) {
+            uint64_t merged = m_words[i] | other.m_words[i];
+            changed |= merged != m_words[i];
+            m_words[i] = merged;
+        }
+        return changed;
+    }
+
+    friend bool operator==(const LiveSet&, const LiveSet&) = default;
+
+private:
+    std::vector<uint64_t> m_words;
+};
+
+// Allocates one handler, instructions [begin, end) of a body, rewriting them in place.
+class HandlerAllocator {
+public:
+    HandlerAllocator(Target target, IRBuffer& ir, std::vector<FlatInstruction>& instructions, std::vector<bool>& unspillable)
+        : m_target(target)
+        , m_ir(ir)
+        , m_instructions(instructions)
+        , m_unspillable(unspillable)
+        , m_registers(scratchRegisters(target))
+    {
+        // Registers that are the same machine register (t0, a0 and r0 on ARM64) are one.
+        for (unsigned gpr = 0; gpr < numberOfGPRs; ++gpr) {
+            m_registerIndex[gpr] = -1;
+            const char* name = machineRegisterName(target, static_cast<GPR>(gpr));
+            for (size_t i = 0; name && i < m_registers.size(); ++i) {
+                if (!strcmp(name, machineRegisterName(target, m_registers[i])))
+                    m_registerIndex[gpr] = i;
+            }
+        }
+    }
+
+    void allocate()
+    {
+        while (!allocateOnce()) { }
+    }
+
+private:
+    // Values are the scratch registers, then the handler's temporaries.
+    size_t value(const IROperand& operand) const
+    {
+        if (operand.tmp)
+            return m_registers.size() + m_tmpIndex.at(operand.tmp);
+        int index = m_registerIndex[static_cast<unsigned>(operand.gpr)];
+        return index < 0 ? notAValue : index;
+    }
+
+    static constexpr size_t notAValue = SIZE_MAX;
+
+    void addRegisters(std::vector<size_t>& values, std::span<const GPR> gprs) const
+    {
+        for (GPR gpr : gprs) {
+            int index = m_registerIndex[static_cast<unsigned>(gpr)];
+            if (index >= 0)
+                values.push_back(index);
+        }
+    }
+
+    const char* handlerName() const
+    {
+        return isHandlerLabel(m_instructions[0]) ? m_instructions[0].operand(0).symbol.string().data() : "the body's first handler";
+    }
+
+    // Returns false if it spilled, and the handler has to be allocated again.
+    bool allocateOnce()
+    {
+        size_t size = m_instructions.size();
+        m_tmps.clear();
+        m_tmpIndex.clear();
+        std::unordered_map<uint32_t, size_t> labels;
+        LiveSet namedRegisters(m_registers.size());
+        for (size_t i = 0; i < size; ++i) {
+            const FlatInstruction& instruction = m_instructions[i];
+            if (instruction.opcode == Opcode::LabelDefinition) {
+                labels[instruction.operand(0).symbol.id] = i;
+                continue;
+            }
+            for (unsigned j = 0; j < instruction.numOperands; ++j) {
+                const IROperand& operand = instruction.operand(j);
+                if (operand.kind != OperandKind::Register && operand.kind != OperandKind::Address)
+                    continue;
+                if (operand.tmp) {
+                    if (m_tmpIndex.emplace(operand.tmp, m_tmps.size()).second)
+                        m_tmps.push_back(operand.tmp);
+                } else if (m_registerIndex[static_cast<unsigned>(operand.gpr)] >= 0)
+                    namedRegisters.add(m_registerIndex[static_cast<unsigned>(operand.gpr)]);
+            }
+        }
+        if (m_tmps.empty())
+            return true;
+
+        size_t numValues = m_registers.size() + m_tmps.size();
+        std::vector<std::vector<size_t>> uses(size), defs(size);
+        std::vector<std::vector<size_t>> successors(size);
+        std::vector<bool> exits(size);
+        for (size_t i = 0; i < size; ++i) {
+            const FlatInstruction& instruction = m_instructions[i];
+            for (unsigned j = 0; j < instruction.numOperands; ++j) {
+                const IROperand& operand = instruction.operand(j);
+                if (operand.kind != OperandKind::Register && operand.kind != OperandKind::Address)
+                    continue;
+                size_t operandValue = value(operand);
+                if (operandValue == notAValue)
+                    continue;
+                unsigned operandAccess = access(instruction, j);
+                if (operandAccess & Use)
+                    uses[i].push_back(operandValue);
+                if (operandAccess & Def)
+                    defs[i].push_back(operandValue);
+            }
+
+            auto branchTo = [&](const IROperand& target) {
+                auto iter = target.kind == OperandKind::LabelReference ? labels.find(target.symbol.id) : labels.end();
+                if (iter == labels.end())
+                    exits[i] = true;
+                else
+                    successors[i].push_back(iter->second);
+            };
+            switch (instruction.opcode) {
+            case Opcode::jmp:
+                branchTo(instruction.operand(0));
+                break;
+            case Opcode::bpeq:
+                branchTo(instruction.last());
+                if (i + 1 < size)
+                    successors[i].push_back(i + 1);
+                else
+                    exits[i] = true;
+                break;
+            case Opcode::ret:
+                addRegisters(uses[i], returnRegisters);
+                break;
+            case Opcode::_break:
+                break;
+            case Opcode::call:
+                addRegisters(uses[i], argumentRegisters);
+                for (size_t r = 0; r < m_registers.size(); ++r)
+                    defs[i].push_back(r);
+                [[fallthrough]];
+            default:
+                if (i + 1 < size)
+                    successors[i].push_back(i + 1);
+                else
+                    exits[i] = true;
+                break;
+            }
+        }
+
+        // Live before and after every instruction, iterated backwards to a fixpoint.
+        std::vector<LiveSet> liveIn(size, LiveSet(numValues)), liveOut(size, LiveSet(numValues));
+        LiveSet exitLive(numValues);
+        for (size_t r = 0; r < m_registers.size(); ++r) {
+            if (namedRegisters.contains(r))
+                exitLive.add(r);
+        }
+        for (bool changed = true; changed;) {
+            changed = false;
+            for (size_t i = size; i--;) {
+                LiveSet out(numValues);
+                if (exits[i])
+                    out.merge(exitLive);
+                for (size_t successor : successors[i])
+                    out.merge(liveIn[successor]);
+                LiveSet in = out;
+                for (size_t def : defs[i])
+                    in.remove(def);
+                for (size_t use : uses[i])
+                    in.add(use);
+                changed |= !(in == liveIn[i]) || !(out == liveOut[i]);
+                liveIn[i] = std::move(in);
+                liveOut[i] = std::move(out);
+            }
+        }
+        for (size_t t = 0; t < m_tmps.size(); ++t) {
+            if (liveIn[0].contains(m_registers.size() + t)) {
+                fprintf(stderr, "OfflineASM: a temporary is read before it is written in %s\n", handlerName());
+                std::exit(1);
+            }
+        }
+
+        // Instruction i reads its operands at position 2i and writes at 2i + 1.
+        std::vector<std::vector<bool>> occupied(m_registers.size(), std::vector<bool>(2 * size));
+        std::vector<Interval> intervals(m_tmps.size(), Interval { SIZE_MAX, 0, 0, -1 });
+        for (size_t i = 0; i < size; ++i) {
+            auto occupy = [&](size_t value, size_t position) {
+                if (value < m_registers.size()) {
+                    occupied[value][position] = true;
+                    return;
+                }
+                Interval& interval = intervals[value - m_registers.size()];
+                interval.start = std::min(interval.start, position);
+                interval.end = std::max(interval.end, position);
+            };
+            for (size_t v = 0; v < numValues; ++v) {
+                if (liveIn[i].contains(v))
+                    occupy(v, 2 * i);
+                if (liveOut[i].contains(v))
+                    occupy(v, 2 * i + 1);
+            }
+            for (size_t def : defs[i])
+                occupy(def, 2 * i + 1);
+        }
+
+        std::vector<size_t> order(m_tmps.size());
+        for (size_t t = 0; t < order.size(); ++t) {
+            order[t] = t;
+            intervals[t].tmp = t;
+        }
+        std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+            return intervals[a].start < intervals[b].start;
+        });
+
+        auto fits = [&](size_t reg, const Interval& interval) {
+            for (size_t position = interval.start; position <= interval.end; ++position) {
+                if (occupied[reg][position])
+                    return false;
+            }
+            return true;
+        };
+
+        std::vector<size_t> active;
+        std::vector<uint32_t> spilled;
+        for (size_t t : order) {
+            Interval& current = intervals[t];
+            std::erase_if(active, [&](size_t a) { return intervals[a].end < current.start; });
+
+            std::vector<bool> held(m_registers.size());
+            for (size_t a : active)
+                held[intervals[a].reg] = true;
+            for (size_t reg = 0; reg < m_registers.size() && current.reg < 0; ++reg) {
+                if (!held[reg] && fits(reg, current))
+                    current.reg = reg;
+            }
+            if (current.reg >= 0) {
+                active.push_back(t);
+                continue;
+            }
+
+            bool currentIsSpillable = !m_unspillable[m_tmps[t]];
+            size_t victim = SIZE_MAX;
+            for (size_t a : active) {
+                if (m_unspillable[m_tmps[a]] || !fits(intervals[a].reg, current))
+                    continue;
+                if (victim == SIZE_MAX || intervals[a].end > intervals[victim].end)
+                    victim = a;
+            }
+            if (victim != SIZE_MAX && (intervals[victim].end > current.end || !currentIsSpillable)) {
+                current.reg = intervals[victim].reg;
+                intervals[victim].reg = -1;
+                spilled.push_back(m_tmps[victim]);
+                std::erase(active, victim);
+                active.push_back(t);
+            } else if (currentIsSpillable)
+                spilled.push_back(m_tmps[t]);
+            else {
+                fprintf(stderr, "OfflineASM: %s needs more registers at once than %s has\n", handlerName(), targetName(m_target));
+                std::exit(1);
+            }
+        }
+
+        if (!spilled.empty()) {
+            spill(spilled);
+            return false;
+        }
+
+        for (FlatInstruction& instruction : m_instructions) {
+            for (unsigned j = 0; j < instruction.numOperands; ++j) {
+                IROperand& operand = instruction.operands[j];
+                if (!operand.tmp)
+                    continue;
+                operand.gpr = m_registers[intervals[m_tmpIndex.at(operand.tmp)].reg];
+                operand.tmp = 0;
+            }
+        }
+        return true;
+    }
+
+    void spill(const std::vector<uint32_t>& spilled)
+    {
+        const FlatInstruction* area = nullptr;
+        for (const FlatInstruction& instruction : m_instructions) {
+            if (instruction.opcode == Opcode::SpillArea)
+                area = &instruction;
+        }
+        m_numSpillSlots += spilled.size();
+        if (!area) {
+            fprintf(stderr, "OfflineASM: %s has to spill a temporary but has no spillArea()\n", handlerName());
+            std::exit(1);
+        }
+        if (static_cast<uint64_t>(area->operand(1).value) < m_numSpillSlots) {
+            fprintf(stderr, "OfflineASM: %s needs %zu spill slots but its spillArea() has %lld\n", handlerName(), m_numSpillSlots, static_cast<long long>(area->operand(1).value));
+            std::exit(1);
+        }
+        IROperand base = area->operand(0);
+        if (base.tmp) {
+            fprintf(stderr, "OfflineASM: the spillArea() of %s must be based on a register, not a temporary\n", handlerName());
+            std::exit(1);
+        }
+
+        std::unordered_map<uint32_t, IROperand> slots;
+        for (uint32_t tmp : spilled) {
+            IROperand slot = base;
+            slot.value += 8 * (m_numSpillSlots - spilled.size() + slots.size());
+            slots.emplace(tmp, slot);
+        }
+
+        std::vector<FlatInstruction> rewritten;
+        rewritten.reserve(m_instructions.size());
+        for (FlatInstruction instruction : m_instructions) {
+            std::vector<FlatInstruction> stores;
+            std::unordered_map<uint32_t, uint32_t> replacements;
+            for (unsigned j = 0; j < instruction.numOperands; ++j) {
+                IROperand& operand = instruction.operands[j];
+                auto slot = operand.tmp ? slots.find(operand.tmp) : slots.end();
+                if (slot == slots.end())
+                    continue;
+                unsigned operandAccess = access(instruction, j);
+                auto [replacement, isNew] = replacements.emplace(operand.tmp, 0);
+                if (isNew) {
+                    replacement->second = m_ir.newTmp();
+                    m_unspillable.resize(m_ir.numTmps() + 1);
+                    m_unspillable[replacement->second] = true;
+                }
+                IROperand reloaded { OperandKind::Register, GPR::invalidGPR, { 0 }, 0, replacement->second };
+                if (operandAccess & Use)
+                    rewritten.push_back({ Opcode::loadq, 2, { slot->second, reloaded } });
+                if (operandAccess & Def)
+                    stores.push_back({ Opcode::storeq, 2, { reloaded, slot->second } });
+                operand.tmp = replacement->second;
+            }
+            rewritten.push_back(instruction);
+            rewritten.insert(rewritten.end(), stores.begin(), stores.end());
+        }
+        m_instructions = std::move(rewritten);
+    }
+
+    struct Interval {
+        size_t start;
+        size_t end;
+        size_t tmp;
+        int reg;
+    };
+
+    Target m_target;
+    IRBuffer& m_ir;
+    std::vector<FlatInstruction>& m_instructions;
+    std::vector<bool>& m_unspillable;
+    std::span<const GPR> m_registers;
+    int m_registerIndex[numberOfGPRs];
+    std::vector<uint32_t> m_tmps;
+    std::unordered_map<uint32_t, size_t> m_tmpIndex;
+    size_t m_numSpillSlots { 0 };
+};
+
+} // namespace RegisterAllocation
+
+// Replaces every temporary in ir with a machine register, and drops the
+// spillArea()s. Returns whether it changed anything.
+inline bool allocateRegisters(Target target, IRBuffer& ir)
+{
+    if (!ir.numTmps())
+        return false;
+
+    std::vector<FlatInstruction> instructions = ir.flatInstructions();
+    std::vector<FlatInstruction> result;
+    result.reserve(instructions.size());
+    std::vector<bool> unspillable(ir.numTmps() + 1);
+    std::vector<const char*> owners(ir.numTmps() + 1);
+    for (size_t begin = 0; begin < instructions.size();) {
+        size_t end = begin + 1;
+        while (end < instructions.size() && !RegisterAllocation::isHandlerLabel(instructions[end]))
+            ++end;
+        std::vector<FlatInstruction> handler(instructions.begin() + begin, instructions.begin() + end);
+        const char* name = RegisterAllocation::isHandlerLabel(handler[0]) ? handler[0].operand(0).symbol.string().data() : "the start of the body";
+        for (const FlatInstruction& instruction : handler) {
+            for (unsigned j = 0; j < instruction.numOperands; ++j) {
+                uint32_t tmp = instruction.operand(j).tmp;
+                if (!tmp)
+                    continue;
+                if (owners[tmp] && owners[tmp] != name) {
+                    fprintf(stderr, "OfflineASM: a temporary of %s is also used in %s\n", owners[tmp], name);
+                    std::exit(1);
+                }
+                owners[tmp] = name;
+            }
+        }
+
+        RegisterAllocation::HandlerAllocator(target, ir, handler, unspillable).allocate();
+        for (const FlatInstruction& instruction : handler) {
+            if (instruction.opcode != Opcode::SpillArea)
+                result.push_back(instruction);
+        }
+        begin = end;
+    }
+    ir.setInstructions(result);
+    return true;
+}
@@ -0,0 +1,361 @@
+#pragma once
+
+#include <array>
+#include <cctype>
+#include <cstdint>
+#include <optional>
+#include <string_view>
+
+enum class Target : uint8_t {
+    ARM64,
+    ARM64E,
+    X86_64,
+    RISCV64,
+    ARMv7,
+};
+
+inline constexpr Target allTargets[] = { Target::ARM64, Target::ARM64E, Target::X86_64, Target::RISCV64, Target::ARMv7 };
+
+constexpr const char* targetName(Target target)
+{
+    switch (target) {
+    case Target::ARM64:
+        return "ARM64";
+    case Target::ARM64E:
+        return "ARM64E";
+    case Target::X86_64:
+        return "X86_64";
+    case Target::RISCV64:
+        return "RISCV64";
+    case Target::ARMv7:
+        return "ARMv7";
+    }
+    return "";
+}
+
+// Accepts backend names the way the Ruby scripts do, ignoring case ("arm64", "x86_64").
+inline std::optional<Target> parseTarget(std::string_view name)
+{
+    for (Target target : allTargets) {
+        std::string_view candidate = targetName(target);
+        if (candidate.size() != name.size())
+            continue;
+        bool matches = true;
+        for (size_t i = 0; i < name.size(); ++i)
+            matches &= std::toupper(static_cast<unsigned char>(name[i])) == std::toupper(static_cast<unsigned char>(candidate[i]));
+        if (matches)
+            return target;
+    }
+    return std::nullopt;
+}
+
+// The target-independent GPR names offlineasm sources use; see GPRS in
+// OfflineASMRB/registers.rb. Each target maps them onto machine registers below.
+#define FOR_EACH_OFFLINE_ASM_GPR(macro) \
+    macro(t0) macro(t1) macro(t2) macro(t3) macro(t4) macro(t5) macro(t6) \
+    macro(t7) macro(t8) macro(t9) macro(t10) macro(t11) macro(t12) \
+    macro(cfr) \
+    macro(a0) macro(a1) macro(a2) macro(a3) macro(a4) macro(a5) macro(a6) macro(a7) \
+    macro(wa0) macro(wa1) macro(wa2) macro(wa3) macro(wa4) macro(wa5) macro(wa6) macro(wa7) \
+    macro(ws0) macro(ws1) macro(ws2) macro(ws3) \
+    macro(r0) macro(r1) \
+    macro(sp) macro(lr) macro(pc) \
+    macro(csr0) macro(csr1) macro(csr2) macro(csr3) macro(csr4) macro(csr5) \
+    macro(csr6) macro(csr7) macro(csr8) macro(csr9) macro(csr10) \
+    macro(invalidGPR) \
+
+enum class GPR : uint8_t {
+#define DECLARE_GPR(name) name,
+    FOR_EACH_OFFLINE_ASM_GPR(DECLARE_GPR)
+#undef DECLARE_GPR
+};
+
+#define COUNT_GPR(name) + 1
+inline constexpr unsigned numberOfGPRs = 0 FOR_EACH_OFFLINE_ASM_GPR(COUNT_GPR);
+#undef COUNT_GPR
+
+constexpr const char* gprName(GPR gpr)
+{
+    switch (gpr) {
+#define GPR_NAME(name) case GPR::name: return #name;
+    FOR_EACH_OFFLINE_ASM_GPR(GPR_NAME)
+#undef GPR_NAME
+    }
+    return "";
+}
+
+// The target-independent 128-bit vector registers; see VECS in
+// OfflineASMRB/registers.rb. Only whole registers are named here, not the
+// v0_b/v0_h/v0_i/v0_q lane views.
+#define FOR_EACH_OFFLINE_ASM_VECTOR_REGISTER(macro) \
+    macro(v0) macro(v1) macro(v2) macro(v3) macro(v4) macro(v5) macro(v6) macro(v7) \
+
+enum class VectorRegister : uint8_t {
+#define DECLARE_VECTOR_REGISTER(name) name,
+    FOR_EACH_OFFLINE_ASM_VECTOR_REGISTER(DECLARE_VECTOR_REGISTER)
+#undef DECLARE_VECTOR_REGISTER
+};
+
+#define COUNT_VECTOR_REGISTER(name) + 1
+inline constexpr unsigned numberOfVectorRegisters = 0 FOR_EACH_OFFLINE_ASM_VECTOR_REGISTER(COUNT_VECTOR_REGISTER);
+#undef COUNT_VECTOR_REGISTER
+
+constexpr const char* vectorRegisterName(VectorRegister vector)
+{
+    switch (vector) {
+#define VECTOR_REGISTER_NAME(name) case VectorRegister::name: return #name;
+    FOR_EACH_OFFLINE_ASM_VECTOR_REGISTER(VECTOR_REGISTER_NAME)
+#undef VECTOR_REGISTER_NAME
+    }
+    return "";
+}
+
+// Machine register names indexed by GPR; nullptr for registers a target lacks.
+using RegisterNames = std::array<const char*, numberOfGPRs>;
+using VectorRegisterNames = std::array<const char*, numberOfVectorRegisters>;
+
+template<Target> struct TargetRegisters;
+
+// Matches the conventions documented at the top of OfflineASMRB/arm64.rb.
+template<> struct TargetRegisters<Target::ARM64> {
+    static constexpr const char* machineName(GPR gpr)
+    {
+        switch (gpr) {
+        case GPR::t0: case GPR::a0: case GPR::wa0: case GPR::r0: return "x0";
+        case GPR::t1: case GPR::a1: case GPR::wa1: case GPR::r1: return "x1";
+        case GPR::t2: case GPR::a2: case GPR::wa2: return "x2";
+        case GPR::t3: case GPR::a3: case GPR::wa3: return "x3";
+        case GPR::t4: case GPR::a4: case GPR::wa4: return "x4";
+        case GPR::t5: case GPR::a5: case GPR::wa5: return "x5";
+        case GPR::t6: case GPR::a6: case GPR::wa6: return "x6";
+        case GPR::t7: case GPR::a7: case GPR::wa7: return "x7";
+        case GPR::t8: return "x8";
+        case GPR::t9: case GPR::ws0: return "x9";
+        case GPR::t10: case GPR::ws1: return "x10";
+        case GPR::t11: case GPR::ws2: return "x11";
+        case GPR::t12: case GPR::ws3: return "x12";
+        case GPR::csr0: return "x19";
+        case GPR::csr1: return "x20";
+        case GPR::csr2: return "x21";
+        case GPR::csr3: return "x22";
+        case GPR::csr4: return "x23";
+        case GPR::csr5: return "x24";
+        case GPR::csr6: return "x25";
+        case GPR::csr7: return "x26";
+        case GPR::csr8: return "x27";
+        case GPR::csr9: return "x28";
+        case GPR::cfr: return "x29";
+        case GPR::sp: return "sp";
+        case GPR::lr: return "lr";
+        default: return nullptr;
+        }
+    }
+
+    // The whole-register view arm64.rb uses for loadv and storev.
+    static constexpr const char* machineName(VectorRegister vector)
+    {
+        switch (vector) {
+        case VectorRegister::v0: return "q16";
+        case VectorRegister::v1: return "q17";
+        case VectorRegister::v2: return "q18";
+        case VectorRegister::v3: return "q19";
+        case VectorRegister::v4: return "q20";
+        case VectorRegister::v5: return "q21";
+        case VectorRegister::v6: return "q22";
+        case VectorRegister::v7: return "q23";
+        }
+        return nullptr;
+    }
+};
+
+template<> struct TargetRegisters<Target::ARM64E> : TargetRegisters<Target::ARM64> { };
+
+// Matches RegisterID#x86GPR in OfflineASMRB/x86.rb, in 64-bit form.
+template<> struct TargetRegisters<Target::X86_64> {
+    static constexpr const char* machineName(GPR gpr)
+    {
+        switch (gpr) {
+        case GPR::t0: case GPR::r0: case GPR::ws0: return "rax";
+        case GPR::t6: case GPR::a0: case GPR::wa0: return "rdi";
+        case GPR::t1: case GPR::a1: case GPR::wa1: return "rsi";
+        case GPR::t2: case GPR::r1: case GPR::a2: case GPR::wa2: return "rdx";
+        case GPR::t3: case GPR::a3: case GPR::wa3: return "rcx";
+        case GPR::t4: case GPR::a4: case GPR::wa4: return "r8";
+        case GPR::t5: case GPR::ws1: return "r10";
+        case GPR::t7: case GPR::a5: case GPR::wa5: return "r9";
+        case GPR::csr0: return "rbx";
+        case GPR::csr1: return "r12";
+        case GPR::csr2: return "r13";
+        case GPR::csr3: return "r14";
+        case GPR::csr4: return "r15";
+        case GPR::cfr: return "rbp";
+        case GPR::sp: return "rsp";
+        default: return nullptr;
+        }
+    }
+
+    static constexpr const char* machineName(VectorRegister vector)
+    {
+        switch (vector) {
+        case VectorRegister::v0: return "xmm0";
+        case VectorRegister::v1: return "xmm1";
+        case VectorRegister::v2: return "xmm2";
+        case VectorRegister::v3: return "xmm3";
+        case VectorRegister::v4: return "xmm4";
+        case VectorRegister::v5: return "xmm5";
+        case VectorRegister::v6: return "xmm6";
+        case VectorRegister::v7: return "xmm7";
+        }
+        return nullptr;
+    }
+};
+
+// Matches the conventions documented at the top of OfflineASMRB/riscv64.rb.
+template<> struct TargetRegisters<Target::RISCV64> {
+    static constexpr const char* machineName(GPR gpr)
+    {
+        switch (gpr) {
+        case GPR::lr: return "ra";
+        case GPR::sp: return "sp";
+        case GPR::ws0: return "x6";
+        case GPR::ws1: return "x7";
+        case GPR::cfr: return "fp";
+        case GPR::csr0: return "x9";
+        case GPR::t0: case GPR::a0: case GPR::wa0: case GPR::r0: return "x10";
+        case GPR::t1: case GPR::a1: case GPR::wa1: case GPR::r1: return "x11";
+        case GPR::t2: case GPR::a2: case GPR::wa2: return "x12";
+        case GPR::t3: case GPR::a3: case GPR::wa3: return "x13";
+        case GPR::t4: case GPR::a4: case GPR::wa4: return "x14";
+        case GPR::t5: case GPR::a5: case GPR::wa5: return "x15";
+        case GPR::t6: case GPR::a6: case GPR::wa6: return "x16";
+        case GPR::t7: case GPR::a7: case GPR::wa7: return "x17";
+        case GPR::csr1: return "x18";
+        case GPR::csr2: return "x19";
+        case GPR::csr3: return "x20";
+        case GPR::csr4: return "x21";
+        case GPR::csr5: return "x22";
+        case GPR::csr6: return "x23";
+        case GPR::csr7: return "x24";
+        case GPR::csr8: return "x25";
+        case GPR::csr9: return "x26";
+        case GPR::csr10: return "x27";
+        default: return nullptr;
+        }
+    }
+
+    // riscv64.rb has no vector registers.
+    static constexpr const char* machineName(VectorRegister) { return nullptr; }
+};
+
+// Matches RegisterID#armOperand in OfflineASMRB/arm.rb.
+template<> struct TargetRegisters<Target::ARMv7> {
+    static constexpr const char* machineName(GPR gpr)
+    {
+        switch (gpr) {
+        case GPR::t0: case GPR::a0: case GPR::wa0: case GPR::r0: return "r0";
+        case GPR::t1: case GPR::a1: case GPR::wa1: case GPR::r1: return "r1";
+        case GPR::t2: case GPR::a2: case GPR::wa2: return "r2";
+        case GPR::t3: case GPR::a3: case GPR::wa3: return "r3";
+        case GPR::t4: return "r4";
+        case GPR::t5: case GPR::ws0: return "r5";
+        case GPR::cfr: return "r7";
+        case GPR::t6: case GPR::ws1: return "r8";
+        case GPR::t7: return "r9";
+        case GPR::csr0: return "r10";
+        case GPR::csr1: return "r11";
+        case GPR::lr: return "lr";
+        case GPR::sp: return "sp";
+        case GPR::pc: return "pc";
+        default: return nullptr;
+        }
+    }
+
+    // Neither does arm.rb.
+    static constexpr const char* machineName(VectorRegister) { return nullptr; }
+};
+
+template<Target target>
+constexpr RegisterNames makeRegisterNames()
+{
+    RegisterNames names { };
+    for (unsigned i = 0; i < numberOfGPRs; ++i)
+        names[i] = TargetRegisters<target>::machineName(static_cast<GPR>(i));
+    return names;
+}
+
+// Built entirely at compile time, so no target pays for static initialization.
+template<Target target>
+inline constexpr RegisterNames registerNames = makeRegisterNames<target>();
+
+template<Target target>
+constexpr VectorRegisterNames makeVectorRegisterNames()
+{
+    VectorRegisterNames names { };
+    for (unsigned i = 0; i < numberOfVectorRegisters; ++i)
+        names[i] = TargetRegisters<target>::machineName(static_cast<VectorRegister>(i));
+    return names;
+}
+
+template<Target target>
+inline constexpr VectorRegisterNames vectorRegisterNames = makeVectorRegisterNames<target>();
+
+template<Target target>
+constexpr const char* machineRegisterName(GPR gpr)
+{
+    return registerNames<target>[static_cast<unsigned>(gpr)];
+}
+
+template<Target target>
+constexpr const char* machineRegisterName(VectorRegister vector)
+{
+    return vectorRegisterNames<target>[static_cast<unsigned>(vector)];
+}
+
+constexpr const char* machineRegisterName(Target target, GPR gpr)
+{
+    switch (target) {
+    case Target::ARM64:
+        return machineRegisterName<Target::ARM64>(gpr);
+    case Target::ARM64E:
+        return machineRegisterName<Target::ARM64E>(gpr);
+    case Target::X86_64:
+        return machineRegisterName<Target::X86_64>(gpr);
+    case Target::RISCV64:
+        return machineRegisterName<Target::RISCV64>(gpr);
+    case Target::ARMv7:
+        return machineRegisterName<Target::ARMv7>(gpr);
+    }
+    return nullptr;
+}
+
+constexpr const char* machineRegisterName(Target target, VectorRegister vector)
+{
+    switch (target) {
+    case Target::ARM64:
+        return machineRegisterName<Target::ARM64>(vector);
+    case Target::ARM64E:
+        return machineRegisterName<Target::ARM64E>(vector);
+    case Target::X86_64:
+        return machineRegisterName<Target::X86_64>(vector);
+    case Target::RISCV64:
+        return machineRegisterName<Target::RISCV64>(vector);
+    case Target::ARMv7:
+        return machineRegisterName<Target::ARMv7>(vector);
+    }
+    return nullptr;
+}
+
+// Whether a and b are the same machine register on target, like t0 and a0 on ARM64.
+constexpr bool sameRegister(Target target, GPR a, GPR b)
+{
+    if (a == b)
+        return true;
+    const char* aName = machineRegisterName(target, a);
+    const char* bName = machineRegisterName(target, b);
+    return aName && bName && std::string_view(aName) == bName;
+}
+
+static_assert(!machineRegisterName<Target::X86_64>(GPR::t8));
+static_assert(sameRegister(Target::ARM64, GPR::t0, GPR::a0));
+static_assert(!sameRegister(Target::ARM64, GPR::t0, GPR::t1));
+static_assert(!machineRegisterName<Target::ARMv7>(VectorRegister::v0));
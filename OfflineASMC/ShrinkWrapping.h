@@ -0,0 +1,395 @@
+#pragma once
+
+#include <algorithm>
+#include <optional>
+#include <vector>
+
+#include "IR.h"
+#include "RegisterAllocation.h"
+
+// Shrink-wraps the callee-save frames of the flat IR, such as the one
+// saveIPIntRegisters() and restoreIPIntRegisters() build in Asm/test.asm:
+//
+//     move sp, cfr
+//     subp size, sp                   reserve
+//     storepairq MC, PC, -16[cfr]     saves
+//     storeq wasmInstance, -24[cfr]
+//     ...the body...
+//     loadpairq -16[cfr], MC, PC      restores
+//     loadq -24[cfr], wasmInstance
+//     addp size, sp                   release
+//
+// One handler (as in RegisterAllocation.h) at a time. A register that the body
+// never writes needs neither its save nor its restore, unless the body reaches its
+// slot through cfr. The reservation then only has to cover the slots still saved
+// and whatever else the body keeps below cfr, rounded up to the stack alignment,
+// and goes away when that is nothing. What is left sinks past the straight-line
+// code at the start of the body that touches neither memory nor the saved
+// registers, and the restores rise past the same kind of code at its end. A frame
+// is only rewritten when every way out of its body runs the restores: the body
+// must not return, jump out of itself, push or pop, or name sp, or cfr other than
+// as the base of an address.
+namespace ShrinkWrapping {
+
+inline constexpr int64_t stackAlignment = 16;
+
+struct Frame {
+    size_t reserve;
+    size_t bodyBegin; // The first instruction after the saves.
+    size_t bodyEnd; // The first restore.
+    size_t release;
+    int64_t size;
+};
+
+inline bool isCalleeSave(Target target, GPR gpr)
+{
+    for (GPR calleeSave : { GPR::csr0, GPR::csr1, GPR::csr2, GPR::csr3, GPR::csr4, GPR::csr5, GPR::csr6, GPR::csr7, GPR::csr8, GPR::csr9, GPR::csr10 }) {
+        if (sameRegister(target, gpr, calleeSave))
+            return true;
+    }
+    return false;
+}
+
+inline bool isRegister(const IROperand& operand)
+{
+    return operand.kind == OperandKind::Register && !operand.tmp;
+}
+
+inline bool isRegister(const IROperand& operand, GPR gpr)
+{
+    return isRegister(operand) && operand.gpr == gpr;
+}
+
+inline bool isStackAdjustment(const FlatInstruction& instruction, Opcode opcode)
+{
+    return instruction.opcode == opcode && instruction.numOperands == 2
+        && instruction.operand(0).kind == OperandKind::Immediate && instruction.operand(0).value > 0
+        && isRegister(instruction.operand(1), GPR::sp);
+}
+
+inline bool isFrameAddress(const IROperand& operand)
+{
+    return operand.kind == OperandKind::Address && operand.gpr == GPR::cfr && !operand.tmp && operand.value < 0;
+}
+
+// The number of bytes instruction accesses at its address operand.
+inline int64_t accessSize(const FlatInstruction& instruction)
+{
+    switch (instruction.opcode) {
+    case Opcode::storepairq:
+    case Opcode::loadpairq:
+    case Opcode::storev:
+    case Opcode::loadv:
+        return 16;
+    case Opcode::storepairv:
+    case Opcode::loadpairv:
+        return 32;
+    default:
+        return 8;
+    }
+}
+
+// storeq r, -n[cfr] and storepairq r, s, -n[cfr], and storep r, -n[cfr] where
+// the Asm/test.asm frames use it (x86_64 and riscv64, whose pointers are 64-bit);
+// the same loads for restores.
+inline bool isSave(const FlatInstruction& instruction)
+{
+    if (instruction.opcode == Opcode::storeq || instruction.opcode == Opcode::storep)
+        return instruction.numOperands == 2 && isRegister(instruction.operand(0)) && isFrameAddress(instruction.operand(1));
+    if (instruction.opcode == Opcode::storepairq)
+        return instruction.numOperands == 3 && isRegister(instruction.operand(0)) && isRegister(instruction.operand(1)) && isFrameAddress(instruction.operand(2));
+    return false;
+}
+
+inline bool isRestore(const FlatInstruction& instruction)
+{
+    if (instruction.opcode == Opcode::loadq || instruction.opcode == Opcode::loadp)
+        return instruction.numOperands == 2 && isFrameAddress(instruction.operand(0)) && isRegister(instruction.operand(1));
+    if (instruction.opcode == Opcode::loadpairq)
+        return instruction.numOperands == 3 && isFrameAddress(instruction.operand(0)) && isRegister(instruction.operand(1)) && isRegister(instruction.operand(2));
+    return false;
+}
+
+// The registers a save or restore moves, with the frame offset of each.
+inline std::vector<std::pair<GPR, int64_t>> slots(const FlatInstruction& instruction)
+{
+    bool isLoad = isRestore(instruction);
+    const IROperand& address = isLoad ? instruction.operand(0) : instruction.last();
+    std::vector<std::pair<GPR, int64_t>> result;
+    unsigned first = isLoad ? 1 : 0;
+    unsigned count = instruction.numOperands - 1;
+    for (unsigned i = 0; i < count; ++i)
+        result.push_back({ instruction.operand(first + i).gpr, address.value + 8 * static_cast<int64_t>(i) });
+    return result;
+}
+
+inline bool writes(Target target, const FlatInstruction& instruction, GPR gpr)
+{
+    if (instruction.opcode == Opcode::call && !isCalleeSave(target, gpr))
+        return true;
+    for (unsigned i = 0; i < instruction.numOperands; ++i) {
+        const IROperand& operand = instruction.operand(i);
+        if (operand.kind == OperandKind::Register && (RegisterAllocation::access(instruction, i) & RegisterAllocation::Def) && sameRegister(target, operand.gpr, gpr))
+            return true;
+    }
+    return false;
+}
+
+inline bool mentions(Target target, const FlatInstruction& instruction, GPR gpr)
+{
+    for (unsigned i = 0; i < instruction.numOperands; ++i) {
+        const IROperand& operand = instruction.operand(i);
+        if ((operand.kind == OperandKind::Register || operand.kind == OperandKind::Address) && sameRegister(target, operand.gpr, gpr))
+            return true;
+    }
+    return false;
+}
+
+// Code the reservation and the saves can be moved across: no labels, no control
+// flow, no memory, and no stack pointer.
+inline bool isMovable(Target target, const FlatInstruction& instruction, const std::vector<GPR>& saved)
+{
+    switch (instruction.opcode) {
+    case Opcode::addp:
+    case Opcode::subp:
+    case Opcode::move:
+        break;
+    default:
+        return false;
+    }
+    for (unsigned i = 0; i < instruction.numOperands; ++i) {
+        if (instruction.operand(i).kind == OperandKind::Address)
+            return false;
+    }
+    if (mentions(target, instruction, GPR::sp) || mentions(target, instruction, GPR::cfr))
+        return false;
+    return std::none_of(saved.begin(), saved.end(), [&](GPR gpr) { return mentions(target, instruction, gpr); });
+}
+
+// Finds the frame whose reservation is at or after instructions[from], if there is one.
+inline std::optional<Frame> findFrame(const std::vector<FlatInstruction>& instructions, size_t from)
+{
+    for (size_t reserve = std::max<size_t>(from, 1); reserve < instructions.size(); ++reserve) {
+        const FlatInstruction& previous = instructions[reserve - 1];
+        if (!isStackAdjustment(instructions[reserve], Opcode::subp))
+            continue;
+        if (previous.opcode != Opcode::move || !isRegister(previous.operand(0), GPR::sp) || !isRegister(previous.operand(1), GPR::cfr))
+            continue;
+        int64_t size = instructions[reserve].operand(0).value;
+        size_t bodyBegin = reserve + 1;
+        while (bodyBegin < instructions.size() && isSave(instructions[bodyBegin]))
+            ++bodyBegin;
+        for (size_t release = bodyBegin; release < instructions.size(); ++release) {
+            const FlatInstruction& instruction = instructions[release];
+            if (instruction.opcode == Opcode::LabelDefinition && RegisterAllocation::isHandlerLabel(instruction))
+                break;
+            if (!isStackAdjustment(instruction, Opcode::addp))
+                continue;
+            if (instruction.operand(0).value != size)
+                break;
+            size_t bodyEnd = release;
+            while (bodyEnd > bodyBegin && isRestore(instructions[bodyEnd - 1]))
+                --bodyEnd;
+            return Frame { reserve, bodyBegin, bodyEnd, release, size };
+        }
+    }
+    return std::nullopt;
+}
+
+// Whether the restores of frame run on every way out of its body, and the body
+// does not depend on where sp is.
+inline bool isSelfContained(Target target, const std::vector<FlatInstruction>& instructions, const Frame& frame)
+{
+    std::vector<uint32_t> bodyLabels;
+    for (size_t i = frame.bodyBegin; i < frame.bodyEnd; ++i) {
+        if (instructions[i].opcode == Opcode::LabelDefinition)
+            bodyLabels.push_back(instructions[i].operand(0).symbol.id);
+    }
+    auto isBodyLabel = [&](const IROperand& operand) {
+        return std::find(bodyLabels.begin(), bodyLabels.end(), operand.symbol.id) != bodyLabels.end();
+    };
+
+    for (size_t i = 0; i < instructions.size(); ++i) {
+        const FlatInstruction& instruction = instructions[i];
+        bool inBody = i >= frame.bodyBegin && i < frame.bodyEnd;
+        if (instruction.opcode == Opcode::LabelDefinition)
+            continue;
+        if (!inBody) {
+            // Nothing outside may jump into the middle of the body.
+            for (unsigned j = 0; j < instruction.numOperands; ++j) {
+                if (instruction.operand(j).kind == OperandKind::LabelReference && isBodyLabel(instruction.operand(j)))
+                    return false;
+            }
+            continue;
+        }
+        switch (instruction.opcode) {
+        case Opcode::ret:
+        case Opcode::push:
+        case Opcode::pop:
+            return false;
+        case Opcode::jmp:
+        case Opcode::bpeq:
+            if (instruction.last().kind != OperandKind::LabelReference || !isBodyLabel(instruction.last()))
+                return false;
+            break;
+        default:
+            break;
+        }
+        for (unsigned j = 0; j < instruction.numOperands; ++j) {
+            const IROperand& operand = instruction.operand(j);
+            if (operand.kind == OperandKind::Register && (sameRegister(target, operand.gpr, GPR::sp) || sameRegister(target, operand.gpr, GPR::cfr)))
+                return false;
+            if (operand.kind == OperandKind::Address && sameRegister(target, operand.gpr, GPR::sp))
+                return false;
+        }
+    }
+    return true;
+}
+
+// Rewrites one frame of a handler into result. Returns whether it changed anything.
+inline bool wrap(Target target, const std::vector<FlatInstruction>& instructions, const Frame& frame, std::vector<FlatInstruction>& result)
+{
+    std::vector<std::pair<GPR, int64_t>> saves;
+    for (size_t i = frame.reserve + 1; i < frame.bodyBegin; ++i) {
+        for (auto slot : slots(instructions[i]))
+            saves.push_back(slot);
+    }
+    std::vector<std::pair<GPR, int64_t>> restores;
+    for (size_t i = frame.bodyEnd; i < frame.release; ++i) {
+        for (auto slot : slots(instructions[i]))
+            restores.push_back(slot);
+    }
+    std::sort(saves.begin(), saves.end());
+    std::sort(restores.begin(), restores.end());
+    if (saves != restores || !isSelfContained(target, instructions, frame))
+        return false;
+
+    auto isClobbered = [&](GPR gpr) {
+        for (size_t i = frame.bodyBegin; i < frame.bodyEnd; ++i) {
+            if (writes(target, instructions[i], gpr))
+                return true;
+        }
+        return false;
+    };
+    auto isAccessed = [&](int64_t offset) {
+        for (size_t i = frame.bodyBegin; i < frame.bodyEnd; ++i) {
+            for (unsigned j = 0; j < instructions[i].numOperands; ++j) {
+                const IROperand& operand = instructions[i].operand(j);
+                if (isFrameAddress(operand) && operand.value < offset + 8 && offset < operand.value + accessSize(instructions[i]))
+                    return true;
+            }
+        }
+        return false;
+    };
+    std::vector<GPR> kept;
+    int64_t size = 0;
+    for (auto [gpr, offset] : saves) {
+        if (isClobbered(gpr) || isAccessed(offset)) {
+            kept.push_back(gpr);
+            size = std::max(size, -offset);
+        }
+    }
+    for (size_t i = frame.bodyBegin; i < frame.bodyEnd; ++i) {
+        for (unsigned j = 0; j < instructions[i].numOperands; ++j) {
+            if (isFrameAddress(instructions[i].operand(j)))
+                size = std::max(size, -instructions[i].operand(j).value);
+        }
+    }
+    size = std::min(frame.size, (size + stackAlignment - 1) & ~(stackAlignment - 1));
+
+    // With nothing left to save, a reservation the body uses stays where it was.
+    size_t sinkTo = frame.bodyBegin;
+    size_t hoistTo = frame.bodyEnd;
+    if (!kept.empty()) {
+        while (sinkTo < frame.bodyEnd && isMovable(target, instructions[sinkTo], kept))
+            ++sinkTo;
+        while (hoistTo > sinkTo && isMovable(target, instructions[hoistTo - 1], kept))
+            --hoistTo;
+    }
+    if (kept.size() == saves.size() && size == frame.size && sinkTo == frame.bodyBegin && hoistTo == frame.bodyEnd)
+        return false;
+
+    // The saves and restores of the registers that are kept, pairs split where only one half is.
+    auto isKept = [&](GPR gpr) { return std::find(kept.begin(), kept.end(), gpr) != kept.end(); };
+    auto keptPart = [&](const FlatInstruction& instruction, std::vector<FlatInstruction>& out) {
+        bool isLoad = isRestore(instruction);
+        unsigned first = isLoad ? 1 : 0;
+        unsigned count = instruction.numOperands - 1;
+        const IROperand& address = isLoad ? instruction.operand(0) : instruction.last();
+        unsigned numKept = 0;
+        for (unsigned i = 0; i < count; ++i)
+            numKept += isKept(instruction.operand(first + i).gpr);
+        if (numKept == count) {
+            out.push_back(instruction);
+            return;
+        }
+        for (unsigned i = 0; i < count; ++i) {
+            const IROperand& value = instruction.operand(first + i);
+            if (!isKept(value.gpr))
+                continue;
+            IROperand slot = address;
+            slot.value += 8 * i;
+            if (isLoad)
+                out.push_back({ Opcode::loadq, 2, { slot, value } });
+            else
+                out.push_back({ Opcode::storeq, 2, { value, slot } });
+        }
+    };
+
+    std::vector<FlatInstruction> prologue;
+    if (size) {
+        prologue.push_back(instructions[frame.reserve]);
+        prologue.back().operands[0].value = size;
+    }
+    for (size_t i = frame.reserve + 1; i < frame.bodyBegin; ++i)
+        keptPart(instructions[i], prologue);
+
+    std::vector<FlatInstruction> epilogue;
+    for (size_t i = frame.bodyEnd; i < frame.release; ++i)
+        keptPart(instructions[i], epilogue);
+    if (size) {
+        epilogue.push_back(instructions[frame.release]);
+        epilogue.back().operands[0].value = size;
+    }
+
+    result.insert(result.end(), instructions.begin() + frame.bodyBegin, instructions.begin() + sinkTo);
+    result.insert(result.end(), prologue.begin(), prologue.end());
+    result.insert(result.end(), instructions.begin() + sinkTo, instructions.begin() + hoistTo);
+    result.insert(result.end(), epilogue.begin(), epilogue.end());
+    result.insert(result.end(), instructions.begin() + hoistTo, instructions.begin() + frame.bodyEnd);
+    return true;
+}
+
+} // namespace ShrinkWrapping
+
+// Shrink-wraps every frame of ir that it can. Returns how many instructions that
+// saved; the ones that only moved are not counted.
+inline size_t shrinkWrap(Target target, IRBuffer& ir)
+{
+    std::vector<FlatInstruction> instructions = ir.flatInstructions();
+    std::vector<FlatInstruction> result;
+    result.reserve(instructions.size());
+    bool changed = false;
+    for (size_t begin = 0; begin < instructions.size();) {
+        size_t end = begin + 1;
+        while (end < instructions.size() && !RegisterAllocation::isHandlerLabel(instructions[end]))
+            ++end;
+        std::vector<FlatInstruction> handler(instructions.begin() + begin, instructions.begin() + end);
+        size_t next = 0;
+        while (auto frame = ShrinkWrapping::findFrame(handler, next)) {
+            result.insert(result.end(), handler.begin() + next, handler.begin() + frame->reserve);
+            if (ShrinkWrapping::wrap(target, handler, *frame, result))
+                changed = true;
+            else
+                result.insert(result.end(), handler.begin() + frame->reserve, handler.begin() + frame->release + 1);
+            next = frame->release + 1;
+        }
+        result.insert(result.end(), handler.begin() + next, handler.end());
+        begin = end;
+    }
+    if (!changed)
+        return 0;
+    size_t saved = instructions.size() - result.size();
+    ir.setInstructions(result);
+    return saved;
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+// A name interned in the global SymbolTable. Registers, labels, opcode text and
+// IR operands all refer to names this way, so copying one is copying 32 bits and
+// comparing two is an integer compare.
+struct Symbol {
+    uint32_t id;
+
+    std::string_view string() const;
+
+    friend bool operator==(Symbol a, Symbol b) { return a.id == b.id; }
+    friend bool operator!=(Symbol a, Symbol b) { return a.id != b.id; }
+};
+
+class SymbolTable {
+public:
+    static SymbolTable& singleton()
+    {
+        static SymbolTable table;
+        return table;
+    }
+
+    Symbol intern(std::string_view string)
+    {
+        {
+            std::shared_lock lock(m_lock);
+            auto iter = m_ids.find(string);
+            if (iter != m_ids.end())
+                return { iter->second };
+        }
+        std::unique_lock lock(m_lock);
+        auto iter = m_ids.find(string);
+        if (iter != m_ids.end())
+            return { iter->second };
+        uint32_t id = m_strings.size();
+        m_strings.emplace_back(string);
+        m_ids.emplace(m_strings.back(), id);
+        return { id };
+    }
+
+    std::string_view string(Symbol symbol) const
+    {
+        std::shared_lock lock(m_lock);
+        return m_strings[symbol.id];
+    }
+
+    size_t size() const
+    {
+        std::shared_lock lock(m_lock);
+        return m_strings.size();
+    }
+
+private:
+    SymbolTable() = default;
+
+    // Bodies for several targets may be generated on different threads at once.
+    mutable std::shared_mutex m_lock;
+    // A deque never moves its elements, so the map can key on views of them.
+    std::deque<std::string> m_strings;
+    std::unordered_map<std::string_view, uint32_t> m_ids;
+};
+
+inline Symbol intern(std::string_view string)
+{
+    return SymbolTable::singleton().intern(string);
+}
+
+inline std::string_view Symbol::string() const
+{
+    return SymbolTable::singleton().string(*this);
+}
@@ -0,0 +1,59 @@
+// Instantiates the generated body for one target. Define OFFLINE_ASM_BODY_NAMESPACE
+// and exactly one OFFLINE_ASM_TARGET_<backend>, then include this file; it may be
+// included any number of times, once per target. See AllTargets.cpp.
+
+#if !defined(OFFLINE_ASM_BODY_NAMESPACE)
+#error "OFFLINE_ASM_BODY_NAMESPACE must be defined before including TargetBody.h"
+#endif
+
+#undef OFFLINE_ASM_ARM64
+#undef OFFLINE_ASM_ARM64E
+#undef OFFLINE_ASM_X86_64
+#undef OFFLINE_ASM_RISCV64
+#undef OFFLINE_ASM_ARMv7
+#undef OFFLINE_ASM_C_LOOP
+
+#if defined(OFFLINE_ASM_TARGET_ARM64)
+#define OFFLINE_ASM_ARM64 1
+#else
+#define OFFLINE_ASM_ARM64 0
+#endif
+
+#if defined(OFFLINE_ASM_TARGET_ARM64E)
+#define OFFLINE_ASM_ARM64E 1
+#else
+#define OFFLINE_ASM_ARM64E 0
+#endif
+
+#if defined(OFFLINE_ASM_TARGET_X86_64)
+#define OFFLINE_ASM_X86_64 1
+#else
+#define OFFLINE_ASM_X86_64 0
+#endif
+
+#if defined(OFFLINE_ASM_TARGET_RISCV64)
+#define OFFLINE_ASM_RISCV64 1
+#else
+#define OFFLINE_ASM_RISCV64 0
+#endif
+
+#if defined(OFFLINE_ASM_TARGET_ARMv7)
+#define OFFLINE_ASM_ARMv7 1
+#else
+#define OFFLINE_ASM_ARMv7 0
+#endif
+
+#define OFFLINE_ASM_C_LOOP 0
+
+namespace OFFLINE_ASM_BODY_NAMESPACE {
+// This is a file generated by OfflineASMRBToC/asm.rb. Its #if blocks are resolved
+// against the settings defined above, and it registers the resulting body().
+#include "../build/test.asm.cpp"
+}
+
+#undef OFFLINE_ASM_BODY_NAMESPACE
+#undef OFFLINE_ASM_TARGET_ARM64
+#undef OFFLINE_ASM_TARGET_ARM64E
+#undef OFFLINE_ASM_TARGET_X86_64
+#undef OFFLINE_ASM_TARGET_RISCV64
+#undef OFFLINE_ASM_TARGET_ARMv7
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+
+// Runs run(i) for every i in [0, numberOfTasks) on up to numberOfWorkers threads,
+// the calling thread being one of them. Tasks are dealt round-robin into one deque
+// per worker. A worker takes from the back of its own deque and, once that is
+// empty, steals from the front of the others, so a few large handlers do not leave
+// the remaining workers idle. Returns once every task has run.
+template<typename Function>
+void runWorkStealing(size_t numberOfTasks, unsigned numberOfWorkers, const Function& run)
+{
+    numberOfWorkers = std::max(1u, static_cast<unsigned>(std::min<size_t>(numberOfWorkers, numberOfTasks)));
+    if (numberOfWorkers == 1) {
+        for (size_t i = 0; i < numberOfTasks; ++i)
+            run(i);
+        return;
+    }
+
+    struct WorkQueue {
+        std::mutex lock;
+        std::deque<size_t> tasks;
+    };
+    std::vector<std::unique_ptr<WorkQueue>> queues;
+    for (unsigned i = 0; i < numberOfWorkers; ++i)
+        queues.push_back(std::make_unique<WorkQueue>());
+    for (size_t i = 0; i < numberOfTasks; ++i)
+        queues[i % numberOfWorkers]->tasks.push_back(i);
+
+    auto takeOwn = [&](unsigned worker) -> std::optional<size_t> {
+        WorkQueue& queue = *queues[worker];
+        std::lock_guard lock(queue.lock);
+        if (queue.tasks.empty())
+            return std::nullopt;
+        size_t task = queue.tasks.back();
+        queue.tasks.pop_back();
+        return task;
+    };
+
+    auto steal = [&](unsigned thief) -> std::optional<size_t> {
+        for (unsigned i = 1; i < numberOfWorkers; ++i) {
+            WorkQueue& queue = *queues[(thief + i) % numberOfWorkers];
+            std::lock_guard lock(queue.lock);
+            if (queue.tasks.empty())
+                continue;
+            size_t task = queue.tasks.front();
+            queue.tasks.pop_front();
+            return task;
+        }
+        return std::nullopt;
+    };
+
+    // Nothing is ever added once the workers start, so a worker that finds every
+    // deque empty is done.
+    auto work = [&](unsigned worker) {
+        while (true) {
+            auto task = takeOwn(worker);
+            if (!task)
+                task = steal(worker);
+            if (!task)
+                return;
+            run(*task);
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (unsigned i = 1; i < numberOfWorkers; ++i)
+        threads.emplace_back(work, i);
+    work(0);
+    for (auto& thread : threads)
+        thread.join();
+}
@@ -372,7 +372,8 @@ class Address
     end
     
     def arm64PairAddressOperand(kind)
-        raise "Invalid offset #{offset.value} at #{codeOriginString}" if offset.value < -512 or offset.value > 504
+        range = kind == :vector_with_interpretation ? (-1024..1008) : (-512..504)
+        raise "Invalid offset #{offset.value} at #{codeOriginString}" unless range.include? offset.value
         "[#{base.arm64Operand(:quad)}, \##{offset.value}]"
     end
 
@@ -444,8 +445,13 @@ end
 def isMalformedArm64LoadStorePairAddress(opcode, operand)
     malformed = false
     if operand.is_a? Address
-        malformed ||= (not (-512..504).include? operand.offset.value)
-        malformed ||= (not (operand.offset.value % 8).zero?)
+        if opcode =~ /v$/
+            malformed ||= (not (-1024..1008).include? operand.offset.value)
+            malformed ||= (not (operand.offset.value % 16).zero?)
+        else
+            malformed ||= (not (-512..504).include? operand.offset.value)
+            malformed ||= (not (operand.offset.value % 8).zero?)
+        end
     end
     malformed
 end
@@ -558,6 +564,142 @@ def arm64FixSpecialRegisterArithmeticMode(list)
     newList
 end
 
+#
+# Lowering of single-bit tests. A test against a mask with one bit set, or of the
+# sign bit, becomes one tbz or tbnz instead of an and (or a compare) and a branch:
+#
+# btpnz t0, 0x10, .foo
+#
+# becomes:
+#
+# testbitnz t0, 4, .foo
+#
+# tbz and tbnz only reach 32KB, so this is only done for local labels, which stay
+# within their handler. With asm.rb --profile they do not: crash paths move to
+# the cold blocks at the end of the interpreter, and branches to them out of line
+# (see Sequence#lowerList), so then this is not done at all.
+#
+
+def arm64SingleBitTestWidth(opcode)
+    case opcode
+    when /^(bt|b)i/
+        32
+    when /^(bt|b)p/
+        $currentSettings["ADDRESS64"] ? 64 : 32
+    when /^(bt|b)q/
+        64
+    end
+end
+
+def arm64LowerSingleBitTests(list)
+    return list if $splitColdCode
+    newList = []
+    list.each {
+        | node |
+        if node.is_a? Instruction and node.operands[-1].is_a? LocalLabelReference
+            operands = node.operands
+            width = arm64SingleBitTestWidth(node.opcode)
+            case node.opcode
+            when "btiz", "btinz", "btpz", "btpnz", "btqz", "btqnz"
+                if operands.size == 3
+                    mask, value = operands[0].immediate? ? [operands[0], operands[1]] : [operands[1], operands[0]]
+                    if mask.immediate? and value.register? and isPowerOfTwo(mask.value & ((1 << width) - 1))
+                        newOpcode = node.opcode =~ /nz$/ ? "testbitnz" : "testbitz"
+                        bit = (mask.value & ((1 << width) - 1)).bit_length - 1
+                        newList << Instruction.new(node.codeOrigin, newOpcode, [value, Immediate.new(node.codeOrigin, bit), operands[-1]], node.annotation)
+                        next
+                    end
+                end
+            when "btis", "btps", "btqs"
+                value = operands[-2]
+                if (operands.size == 2 or (operands[0].immediate? and operands[0].value == -1)) and value.register?
+                    newList << Instruction.new(node.codeOrigin, "testbitnz", [value, Immediate.new(node.codeOrigin, width - 1), operands[-1]], node.annotation)
+                    next
+                end
+            when "bilt", "bplt", "bqlt", "bigteq", "bpgteq", "bqgteq"
+                if operands[0].register? and operands[1].immediate? and operands[1].value == 0
+                    newOpcode = node.opcode =~ /lt$/ ? "testbitnz" : "testbitz"
+                    newList << Instruction.new(node.codeOrigin, newOpcode, [operands[0], Immediate.new(node.codeOrigin, width - 1), operands[-1]], node.annotation)
+                    next
+                end
+            end
+        end
+        newList << node
+    }
+    newList
+end
+
+#
+# Reuse of constants that are still in a register. Once registers are assigned, a
+# move of an immediate into a register that already holds it is dropped, and one
+# that another register already holds is turned into a mov when materializing it
+# would take more than one instruction. What a register holds is forgotten at
+# every label and call, whenever an instruction mentions it other than to read
+# it, and altogether at any instruction not known to write only its operands.
+#
+
+def arm64ConstantRegisterName(operand)
+    if operand.is_a? RegisterID or (operand.is_a? SpecialRegister and operand.name =~ /^x/)
+        operand.arm64Operand(:quad)
+    end
+end
+
+def arm64OnlyReadsOperands(node)
+    case node.opcode
+    when /^storecond/
+        false
+    when /^store/, "jmp", "push", "testbitz", "testbitnz"
+        true
+    when /^b(?!fi|add|sub|mul|or)/
+        node.operands[-1].is_a? LabelReference or node.operands[-1].is_a? LocalLabelReference
+    else
+        false
+    end
+end
+
+def arm64ReuseLiveConstants(list)
+    newList = []
+    constants = {}
+    list.each {
+        | node |
+        unless node.is_a? Instruction
+            constants.clear
+            newList << node
+            next
+        end
+
+        case node.opcode
+        when /^(add|sub|mul|and|or|xor|lshift|rshift|urshift|neg|not|load|sx|zx|lea|pop|globaladdr|move$)/
+            if node.opcode == "move" and (destination = arm64ConstantRegisterName(node.operands[1]))
+                source = node.operands[0]
+                if source.is_a? Immediate
+                    value = source.value & 0xffffffffffffffff
+                    next if constants[destination] == value
+                    holder = constants.key(value)
+                    constants[destination] = value
+                    if holder and arm64MoveImmediatePlan(value).size > 1
+                        newList << Instruction.new(node.codeOrigin, "move", [SpecialRegister.new(holder), node.operands[1]], node.annotation)
+                        next
+                    end
+                else
+                    value = constants[arm64ConstantRegisterName(source)]
+                    value ? constants[destination] = value : constants.delete(destination)
+                end
+            else
+                node.filter(Node).each {
+                    | operand |
+                    name = arm64ConstantRegisterName(operand)
+                    constants.delete(name) if name
+                }
+            end
+        else
+            constants.clear unless arm64OnlyReadsOperands(node)
+        end
+        newList << node
+    }
+    newList
+end
+
 class Sequence
     def getModifiedListARM64(result = @list)
         result = riscDropTags(result)
@@ -566,6 +708,7 @@ class Sequence
     def getModifiedListARM64Common(result = @list)
         result = riscLowerNot(result)
         result = riscLowerSimpleBranchOps(result)
+        result = arm64LowerSingleBitTests(result)
 
         result = $currentSettings["ADDRESS64"] ? riscLowerHardBranchOps64(result) : riscLowerHardBranchOps(result)
         result = riscLowerShiftOps(result)
@@ -595,6 +738,9 @@ class Sequence
             when "loadpairq", "storepairq", "loadpaird", "storepaird"
                 size = 16
                 isLoadStorePairOp = true
+            when "loadpairv", "storepairv"
+                size = 32
+                isLoadStorePairOp = true
             else
                 raise "Bad instruction #{node.opcode} for heap access at #{node.codeOriginString}: #{node.dump}"
             end
@@ -615,37 +761,7 @@ class Sequence
 
         result = riscLowerMisplacedImmediates(result, ["storeb", "storeh", "storei", "storep", "storeq"])
 
-        # The rules for which immediates are valid for and/or/xor instructions are fairly involved, see https://dinfuehr.github.io/blog/encoding-of-immediate-values-on-aarch64/
-        validLogicalImmediates = []
-        def rotate(value, n, size)
-            mask = (1 << size) - 1
-            shiftedValue = value << n
-            result = (shiftedValue & mask) | ((shiftedValue & ~mask) >> size)
-            return result
-        end
-        def replicate(value, size)
-            until size == 64 do
-                value = value | (value << size)
-                size *= 2
-            end
-            return value
-        end
-        size = 2
-        until size > 64 do
-            for numberOfOnes in 1..(size-1) do
-                for rotation in 0..(size-1) do
-                    immediate = 0;
-                    for i in 0..(numberOfOnes-1) do
-                        immediate = immediate*2 + 1
-                    end
-                    immediate = rotate(immediate, rotation, size)
-                    immediate = replicate(immediate, size)
-                    validLogicalImmediates << immediate
-                end
-            end
-            size *= 2
-        end
-        result = riscLowerMalformedImmediates(result, 0..4095, validLogicalImmediates)
+        result = riscLowerMalformedImmediates(result, 0..4095, arm64LogicalImmediates)
 
         result = riscLowerMisplacedAddresses(result)
         result = riscLowerMalformedAddresses(result) {
@@ -667,6 +783,7 @@ class Sequence
         result = arm64FixSpecialRegisterArithmeticMode(result)
         result = assignRegistersToTemporaries(result, :gpr, ARM64_EXTRA_GPRS)
         result = assignRegistersToTemporaries(result, :fpr, ARM64_EXTRA_FPRS)
+        result = arm64ReuseLiveConstants(result)
         return result
     end
 end
@@ -862,43 +979,85 @@ def emitARM64Compare(operands, kind, compareCode)
     $asm.puts "csinc #{operands[-1].arm64Operand(:word)}, wzr, wzr, #{compareCode}"
 end
 
-def emitARM64MoveImmediate(value, target)
-    numberOfFilledHalfWords = 0
-    numberOfZeroHalfWords = 0
-    [48, 32, 16, 0].each {
-        | shift |
-        currentValue = (value >> shift) & 0xffff
-        if currentValue == 0xffff
-            numberOfFilledHalfWords += 1
-        end
-        if currentValue == 0
-            numberOfZeroHalfWords += 1
+# Every value an and, orr or eor can take as a 64-bit immediate: a run of ones, rotated
+# within an element of 2 to 64 bits that is then replicated across the register. See
+# https://dinfuehr.github.io/blog/encoding-of-immediate-values-on-aarch64/
+def arm64LogicalImmediates
+    $arm64LogicalImmediates ||= begin
+        immediates = Set.new
+        size = 2
+        until size > 64 do
+            mask = (1 << size) - 1
+            for numberOfOnes in 1..(size-1) do
+                ones = (1 << numberOfOnes) - 1
+                for rotation in 0..(size-1) do
+                    immediate = ((ones << rotation) & mask) | ((ones << rotation) >> size)
+                    elementSize = size
+                    until elementSize == 64 do
+                        immediate = immediate | (immediate << elementSize)
+                        elementSize *= 2
+                    end
+                    immediates << immediate
+                end
+            end
+            size *= 2
         end
-    }
-    fillOtherHalfWordsWithOnes = (numberOfFilledHalfWords > numberOfZeroHalfWords)
+        immediates
+    end
+end
 
-    first = true
+# The shortest sequence that puts value in a register, as the instructions to emit
+# after the register operand. The candidates are a movz or movn followed by one movk
+# per remaining halfword, a single orr of a logical immediate (the 32-bit form, which
+# clears the upper half, included), and a logical immediate patched by one movk.
+def arm64MoveImmediatePlan(value)
+    value &= 0xffffffffffffffff
+    halfWord = lambda { | shift | (value >> shift) & 0xffff }
+    shifted = lambda { | immediate, shift | shift.zero? ? "\##{immediate}" : "\##{immediate}, lsl \##{shift}" }
+
+    # Which of movz and movn, and with which halfwords filled in by movk, exactly as
+    # this was always emitted; ties go to movz.
+    numberOfFilledHalfWords = [48, 32, 16, 0].count { | shift | halfWord.call(shift) == 0xffff }
+    numberOfZeroHalfWords = [48, 32, 16, 0].count { | shift | halfWord.call(shift) == 0 }
+    fill = numberOfFilledHalfWords > numberOfZeroHalfWords ? 0xffff : 0
+    plan = []
     [48, 32, 16, 0].each {
         | shift |
-        currentValue = (value >> shift) & 0xffff
-        next if currentValue == (fillOtherHalfWordsWithOnes ? 0xffff : 0) and (shift != 0 or !first)
-        if first
-            if fillOtherHalfWordsWithOnes
-                shift.zero? \
-                    ? ($asm.puts "movn #{target.arm64Operand(:quad)}, \##{(~currentValue) & 0xffff}")
-                    : ($asm.puts "movn #{target.arm64Operand(:quad)}, \##{(~currentValue) & 0xffff}, lsl \##{shift}")
-            else
-                shift.zero? \
-                    ? ($asm.puts "movz #{target.arm64Operand(:quad)}, \##{currentValue}")
-                    : ($asm.puts "movz #{target.arm64Operand(:quad)}, \##{currentValue}, lsl \##{shift}")
-            end
-            first = false
+        currentValue = halfWord.call(shift)
+        next if currentValue == fill and (shift != 0 or !plan.empty?)
+        if plan.empty?
+            plan << (fill == 0xffff ? [:quad, "movn", shifted.call((~currentValue) & 0xffff, shift)] : [:quad, "movz", shifted.call(currentValue, shift)])
         else
-            shift.zero? \
-                ? ($asm.puts "movk #{target.arm64Operand(:quad)}, \##{currentValue}")
-                : ($asm.puts "movk #{target.arm64Operand(:quad)}, \##{currentValue}, lsl \##{shift}")
+            plan << [:quad, "movk", shifted.call(currentValue, shift)]
         end
     }
+    return plan if plan.size == 1
+
+    if arm64LogicalImmediates.include? value
+        return [[:quad, "orr", "xzr, \##{"0x%x" % value}"]]
+    end
+    if value < (1 << 32) and arm64LogicalImmediates.include?(value | (value << 32))
+        return [[:word, "orr", "wzr, \##{"0x%x" % value}"]]
+    end
+    return plan if plan.size == 2
+
+    [0, 16, 32, 48].each {
+        | shift |
+        [0, 0xffff, halfWord.call((shift + 16) % 64), halfWord.call((shift + 32) % 64)].each {
+            | replacement |
+            patched = (value & ~(0xffff << shift)) | (replacement << shift)
+            next unless arm64LogicalImmediates.include? patched
+            return [[:quad, "orr", "xzr, \##{"0x%x" % patched}"], [:quad, "movk", shifted.call(halfWord.call(shift), shift)]]
+        }
+    }
+    plan
+end
+
+def emitARM64MoveImmediate(value, target)
+    arm64MoveImmediatePlan(value).each {
+        | kind, opcode, operands |
+        $asm.puts "#{opcode} #{target.arm64Operand(kind)}, #{operands}"
+    }
 end
 
 class Instruction
@@ -1165,6 +1324,10 @@ class Instruction
             emitARM64("sxth", operands, [:word, :quad])
         when "nop"
             $asm.puts "nop"
+        when "testbitz"
+            $asm.puts "tbz #{operands[0].arm64Operand(operands[1].value < 32 ? :word : :quad)}, \##{operands[1].value}, #{operands[2].asmLabel}"
+        when "testbitnz"
+            $asm.puts "tbnz #{operands[0].arm64Operand(operands[1].value < 32 ? :word : :quad)}, \##{operands[1].value}, #{operands[2].asmLabel}"
         when "bieq", "bbeq"
             if operands[0].immediate? and operands[0].value == 0
                 $asm.puts "cbz #{operands[1].arm64Operand(:word)}, #{operands[2].asmLabel}"
@@ -1680,6 +1843,10 @@ class Instruction
             $asm.puts "ldp #{operands[1].arm64Operand(:double)}, #{operands[2].arm64Operand(:double)}, #{operands[0].arm64PairAddressOperand(:double)}"
         when "storepaird"
             $asm.puts "stp #{operands[0].arm64Operand(:double)}, #{operands[1].arm64Operand(:double)}, #{operands[2].arm64PairAddressOperand(:double)}"
+        when "loadpairv"
+            $asm.puts "ldp #{operands[1].arm64Operand(:vector_with_interpretation)}, #{operands[2].arm64Operand(:vector_with_interpretation)}, #{operands[0].arm64PairAddressOperand(:vector_with_interpretation)}"
+        when "storepairv"
+            $asm.puts "stp #{operands[0].arm64Operand(:vector_with_interpretation)}, #{operands[1].arm64Operand(:vector_with_interpretation)}, #{operands[2].arm64PairAddressOperand(:vector_with_interpretation)}"
 
         ########
         # SIMD #
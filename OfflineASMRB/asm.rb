@@ -31,11 +31,15 @@ require "digest/sha1"
 require "offsets"
 require 'optparse'
 require "parser"
+require "report"
 require "self_hash"
 require "settings"
 require "shellwords"
+require "stringio"
 require "transform"
 
+HANDLER_WIDTHS = ["narrow", "wide16", "wide32"]
+
 class Assembler
     def initialize(outp)
         @outp = outp
@@ -58,18 +62,352 @@ class Assembler
 
         @newlineSpacerState = :none
         @lastlabel = ""
+
+        # [labelName, StringIO of everything from that label up to the next one,
+        # position of the handler's entry in it, whether the label is global,
+        # whether its code ends in a jump, return or crash]; the first entry holds
+        # what precedes the first label.
+        @labelChunks = [[nil, StringIO.new]]
+        @coldCode = StringIO.new
+
+        # [feature, {handler label => label of its copy lowered with that feature}]
+        # for every feature lowerFeatureVariant made a difference to.
+        @featureVariants = []
     end
 
     def enterAsm
         @outp.puts ""
-        putStr "OFFLINE_ASM_BEGIN"
+        # The C_LOOP's OFFLINE_ASM_BEGIN needs the list of labels, which
+        # layOutChunks puts right before it.
+        putStr "OFFLINE_ASM_BEGIN" unless $emitCLoopLabels
 
         @state = :asm
         SourceFile.outputDotFileList(@outp) if $enableDebugAnnotations
+
+        # Code is collected per label so that handlers can be laid out, and the
+        # dispatch tables built, once all of them have been seen.
+        @realOutp = @outp
+        @outp = @labelChunks[0][1]
+    end
+
+    # The handlers commonOp defines: every label L for which L_wide16 and
+    # L_wide32 exist too, in source order. A handler's index in this list is its
+    # opcode in the dispatch tables.
+    def handlerLabels
+        names = @labelChunks.map { | labelName, | labelName }.compact
+        names.select {
+            | labelName |
+            names.include?("#{labelName}_wide16") and names.include?("#{labelName}_wide32")
+        }
+    end
+
+    # Lowers the code that the block lowers a second time, with feature active, and
+    # keeps a copy of every handler width whose code came out different, as
+    # <label>_<feature> with its local labels renamed likewise. layOutChunks puts
+    # the copies after everything else and gives the feature dispatch tables of
+    # its own, which point at them. The copies jump to the same labels as the
+    # handlers they stand in for, so like with a profile, handlers must not fall
+    # through into the next label.
+    def lowerFeatureVariant(feature)
+        putsLastComment
+        saved = [@labelChunks, @coldCode, @outp, @numLocalLabels, @numGlobalLabels,
+                 @deferredOSDarwinActions, @deferredNextLabelActions, @newlineSpacerState]
+        @labelChunks = [[nil, StringIO.new]]
+        @coldCode = StringIO.new
+        @outp = @labelChunks[0][1]
+        @numLocalLabels = 0
+        @numGlobalLabels = 0
+        @deferredOSDarwinActions = []
+        @deferredNextLabelActions = []
+        @newlineSpacerState = :none
+        $activeCPUFeatures = [feature]
+        begin
+            yield
+            putsLastComment
+        ensure
+            $activeCPUFeatures = []
+            variantChunks = @labelChunks
+            @labelChunks, @coldCode, @outp, @numLocalLabels, @numGlobalLabels,
+                @deferredOSDarwinActions, @deferredNextLabelActions, @newlineSpacerState = saved
+        end
+
+        handlerWidthLabels = {}
+        handlerLabels.each {
+            | handler |
+            [handler, "#{handler}_wide16", "#{handler}_wide32"].each { | labelName | handlerWidthLabels[labelName] = true }
+        }
+        baselineCode = {}
+        @labelChunks.each { | labelName, chunk | baselineCode[labelName] = chunk.string }
+
+        variants = {}
+        variantChunks.each {
+            | labelName, chunk, entry, isGlobal |
+            next unless handlerWidthLabels[labelName] and chunk.string != baselineCode[labelName]
+            variantName = "#{labelName}_#{feature}"
+            header = chunk.string[0, entry].sub("(#{Assembler.cLabelReference(labelName)})", "(#{Assembler.cLabelReference(variantName)})")
+            body = chunk.string[entry..-1]
+            localLabels = body.scan(/OFFLINE_ASM_LOCAL_LABEL\((\w+)\)/).flatten
+            unless localLabels.empty?
+                body = body.gsub(/\b(OFFLINE_ASM_LOCAL_LABEL|LOCAL_LABEL_STRING)\((#{localLabels.join("|")})\)/) { "#{$1}(#{$2}_#{feature})" }
+            end
+            @labelChunks << [variantName, StringIO.new(header + body), header.size, isGlobal]
+            variants[labelName] = variantName
+        }
+        @featureVariants << [feature, variants] unless variants.empty?
+    end
+
+    # The code of a handler without its comments and blank lines, as pairs of the
+    # line and its index among the chunk's lines, with the local labels the code
+    # defines numbered in order so that two expansions of a macro compare equal.
+    def self.foldingLines(body)
+        lines = body.lines.each_with_index.map {
+            | line, index |
+            [line.sub(/(\A|\s)\/\/.*/m, "").strip, index]
+        }.reject { | line, | line.empty? }
+        localLabels = {}
+        lines.each {
+            | line, |
+            line.scan(/OFFLINE_ASM_LOCAL_LABEL\((\w+)\)/) { localLabels[$1] ||= "@#{localLabels.size}" }
+        }
+        return lines if localLabels.empty?
+        pattern = /\b(OFFLINE_ASM_LOCAL_LABEL|LOCAL_LABEL_STRING)\((#{localLabels.keys.join("|")})\)/
+        lines.map { | line, index | [line.gsub(pattern) { "#{$1}(#{localLabels[$2]})" }, index] }
+    end
+
+    # With --fold-handlers, finds the handler widths that need not be emitted as
+    # they are. A handler whose code is the same as an earlier one's becomes an
+    # alias of it, and one whose code ends with the same instructions as an earlier
+    # one's jumps to that code instead of repeating it, if that saves at least two
+    # instructions. Only handlers that end in a jump, return or crash are folded,
+    # so that they fall through into nothing, and none whose local labels are used
+    # from elsewhere. A handler only becomes an alias if the code before it does
+    # not fall through into it either, since its code is then left out. Returns the aliases, label to label, and the new code of
+    # the handlers that changed, label to code after the entry point.
+    def foldHandlers(handlerWidths)
+        aliases = {}
+        bodies = {}
+        return [aliases, bodies] unless $foldHandlers and LABEL_JUMPS[$activeBackend]
+
+        references = Hash.new(0)
+        (@labelChunks.map { | labelName, chunk | chunk.string } + [@coldCode.string]).each {
+            | code |
+            code.scan(/LOCAL_LABEL_STRING\((\w+)\)/) { references[$1] += 1 }
+        }
+        chunks = {}
+        @labelChunks.each { | labelName, chunk, entry | chunks[labelName] = [chunk, entry] }
+        candidates = []
+        identical = {}
+        tails = {}
+        @labelChunks.each_with_index {
+            | (labelName, chunk, entry, isGlobal, terminated), index |
+            next unless handlerWidths[labelName] and terminated and not isGlobal
+            # Opcode labels carry the opcode's ID in front of them; see EMBED_OPCODE_ID.
+            next if /\Allint_op_/.match(labelName)
+            body = chunk.string[entry..-1]
+            ownReferences = Hash.new(0)
+            body.scan(/LOCAL_LABEL_STRING\((\w+)\)/) { ownReferences[$1] += 1 }
+            next if body.scan(/OFFLINE_ASM_LOCAL_LABEL\((\w+)\)/).flatten.any? { | label | references[label] > ownReferences[label] }
+
+            lines = Assembler.foldingLines(body)
+            key = lines.map { | line, | line }.join("\n")
+            if identical[key] and index > 0 and @labelChunks[index - 1][4]
+                aliases[labelName] = identical[key]
+                next
+            end
+            identical[key] = labelName
+
+            best = nil
+            candidates.each {
+                | candidate, candidateLines |
+                length = 0
+                while length < lines.size and length < candidateLines.size
+                    line = lines[-1 - length][0]
+                    break unless line.start_with?("\"") and not line.include?("(@") and line == candidateLines[-1 - length][0]
+                    length += 1
+                end
+                best = [candidate, candidateLines, length] if length >= 3 and (not best or length > best[2])
+            }
+            unless best
+                candidates << [labelName, lines]
+                next
+            end
+
+            candidate, candidateLines, length = best
+            tailLine = candidateLines[-length][1]
+            (tails[candidate] ||= []) << tailLine
+            jump = "    \"#{LABEL_JUMPS[$activeBackend]} #{Assembler.localLabelReference("#{candidate}_tail_#{tailLine}")} \\n\"\n"
+            bodies[labelName] = body.lines[0, lines[-length][1]].join + jump
+        }
+        tails.each {
+            | labelName, tailLines |
+            chunk, entry = chunks[labelName]
+            rawLines = chunk.string[entry..-1].lines
+            tailLines.uniq.sort.reverse_each { | tailLine | rawLines.insert(tailLine, "  OFFLINE_ASM_LOCAL_LABEL(#{labelName}_tail_#{tailLine})\n") }
+            bodies[labelName] = rawLines.join
+        }
+        [aliases, bodies]
+    end
+
+    # Writes the collected code. By default it is written in source order. With a
+    # profile, the handlers follow everything else, most frequently entered first.
+    # With a fixed stride, every handler gets its own stride-sized slot and the
+    # slots of each width are laid out back to back, so handler n of a width starts
+    # at jsc_llint_<width>_handlers + (n << log2(stride)); the assembler rejects
+    # any handler that outgrows its slot. Handlers therefore must not fall through
+    # into the next label. Copies lowered for CPU features follow, and the cold
+    # blocks, if any, come after all of it. Handlers foldHandlers made aliases of
+    # others are left out, and the tables and symbol map skip them likewise.
+    # $handlerReport, if any, gets the code written for every label.
+    def layOutChunks
+        handlers = $emitDispatchTables ? handlerLabels : []
+        handlerWidths = {}
+        handlers.each {
+            | handler |
+            handlerWidths[handler] = "narrow"
+            handlerWidths["#{handler}_wide16"] = "wide16"
+            handlerWidths["#{handler}_wide32"] = "wide32"
+        }
+
+        # Counter n * 3 + w counts entries into width w of handler n.
+        counterIndices = {}
+        handlers.each_with_index {
+            | handler, index |
+            counterIndices[handler] = index * 3
+            counterIndices["#{handler}_wide16"] = index * 3 + 1
+            counterIndices["#{handler}_wide32"] = index * 3 + 2
+        }
+        # A feature's copy of a handler counts as that handler.
+        @featureVariants.each {
+            | feature, variants |
+            variants.each { | labelName, variantName | counterIndices[variantName] = counterIndices[labelName] }
+        }
+        # An alias is entered through the code of the handler it stands for, so it
+        # counts as that handler, and its own counter stays 0.
+        aliases, foldedBodies = foldHandlers(handlerWidths)
+        aliasesOf = {}
+        aliases.each { | labelName, target | (aliasesOf[target] ||= []) << labelName }
+        chunks = {}
+        @labelChunks.each { | labelName, chunk, entry, isGlobal | chunks[labelName] = [chunk, entry, isGlobal] }
+        writeChunk = lambda {
+            | labelName |
+            next if aliases[labelName]
+            chunk, entry, isGlobal = chunks[labelName]
+            if counterIndices[labelName]
+                @outp.write(chunk.string[0, entry])
+                putStr "OFFLINE_ASM_COUNT_OPCODE(#{counterIndices[labelName]})"
+                @outp.write(foldedBodies[labelName] || chunk.string[entry..-1])
+            elsif foldedBodies[labelName]
+                @outp.write(chunk.string[0, entry] + foldedBodies[labelName])
+            else
+                @outp.write(chunk.string)
+            end
+            if $handlerReport and labelName
+                $handlerReport.add(labelName, handlerWidths[labelName], foldedBodies[labelName] || chunk.string)
+            end
+            # Gives the label's symbol the size of its chunk, and marks where the
+            # chunk ends for the symbol map.
+            if labelName and $emitDispatchTables
+                putStr(isGlobal ? "OFFLINE_ASM_GLOBAL_LABEL_END(#{labelName})" : "OFFLINE_ASM_LABEL_END(#{labelName})")
+            end
+            (aliasesOf[labelName] || []).each { | aliasName | putStr "OFFLINE_ASM_ALIAS_LABEL(#{aliasName}, #{labelName})" }
+        }
+
+        @outp = @realOutp
+        if $emitCLoopLabels
+            # Every label the C loop can dispatch to, for its table of opcodes; see
+            # the C loop in LowLevelInterpreter.cpp.
+            @outp.puts "#define FOR_EACH_OFFLINE_ASM_CLOOP_LABEL(macro) \\"
+            @labelChunks.each {
+                | labelName, |
+                @outp.puts "    macro(#{Assembler.cLabelReference(labelName)}) \\" if labelName
+            }
+            @outp.puts ""
+            putStr "OFFLINE_ASM_BEGIN"
+        end
+        if handlers.empty? or not ($fixedHandlerStride or $handlerProfile)
+            @labelChunks.each { | labelName, | writeChunk.call(labelName) }
+        elsif $handlerProfile
+            @labelChunks.each {
+                | labelName, |
+                writeChunk.call(labelName) unless handlerWidths[labelName]
+            }
+            handlerChunks = @labelChunks.map { | labelName, | labelName }.select { | labelName | handlerWidths[labelName] }
+            handlerChunks.each_with_index.sort_by {
+                | labelName, index |
+                [-($handlerProfile[labelName] || 0), index]
+            }.each { | labelName, | writeChunk.call(labelName) }
+        else
+            @labelChunks.each {
+                | labelName, |
+                writeChunk.call(labelName) unless handlerWidths[labelName]
+            }
+            HANDLER_WIDTHS.each {
+                | width |
+                putStr "OFFLINE_ASM_ALIGN_TRAP(#{$fixedHandlerStride})"
+                putStr "OFFLINE_ASM_UNALIGNED_GLOBAL_LABEL(jsc_llint_#{width}_handlers)"
+                handlers.each {
+                    | handler |
+                    labelName = width == "narrow" ? handler : "#{handler}_#{width}"
+                    writeChunk.call(labelName)
+                    putStr "OFFLINE_ASM_ALIGN_TRAP(#{$fixedHandlerStride})"
+                    putStr "OFFLINE_ASM_FIXED_STRIDE_SLOT_END(#{labelName}, #{$fixedHandlerStride})"
+                }
+            }
+        end
+
+        unless @coldCode.string.empty?
+            putStr "OFFLINE_ASM_COLD_SECTION_BEGIN"
+            @outp.write(@coldCode.string)
+            putStr "OFFLINE_ASM_COLD_SECTION_END"
+        end
+
+        # Where each label's chunk starts and how long it is, for perf maps; see
+        # LLIntSymbolMap.h.
+        labeledChunks = @labelChunks.select { | labelName, | labelName and not aliases[labelName] }
+        unless labeledChunks.empty? or not $emitDispatchTables
+            putStr "OFFLINE_ASM_SYMBOL_MAP"
+            labeledChunks.each {
+                | labelName, chunk, entry, isGlobal |
+                putStr(isGlobal ? "OFFLINE_ASM_SYMBOL_MAP_GLOBAL_ENTRY(#{labelName})" : "OFFLINE_ASM_SYMBOL_MAP_ENTRY(#{labelName})")
+            }
+            putStr "OFFLINE_ASM_SYMBOL_MAP_NAMES"
+            labeledChunks.each { | labelName, | putStr "OFFLINE_ASM_SYMBOL_MAP_NAME(#{labelName})" }
+            putStr "OFFLINE_ASM_SYMBOL_MAP_SIZE(#{labeledChunks.size})"
+        end
+
+        return if handlers.empty?
+        # Each width's table for the baseline CPU is followed by one for every
+        # feature variant, in which the handlers that have a copy for the feature
+        # point at it instead; jsc_llint_dispatch_table_variants lists the feature
+        # bits of each of those (see LLInt::dispatchTables()).
+        HANDLER_WIDTHS.each {
+            | width |
+            putStr "OFFLINE_ASM_DISPATCH_TABLE(jsc_llint_dispatch_table_#{width})"
+            ([{}] + @featureVariants.map { | feature, variants | variants }).each {
+                | variants |
+                handlers.each {
+                    | handler |
+                    labelName = width == "narrow" ? handler : "#{handler}_#{width}"
+                    putStr "OFFLINE_ASM_DISPATCH_TABLE_ENTRY(#{variants[labelName] || aliases[labelName] || labelName})"
+                }
+            }
+        }
+        putStr "OFFLINE_ASM_DISPATCH_TABLE_SIZE(#{handlers.size})"
+        putStr "OFFLINE_ASM_DISPATCH_TABLE_VARIANTS"
+        @featureVariants.each {
+            | feature, |
+            putStr "OFFLINE_ASM_DISPATCH_TABLE_VARIANT(#{CPU_FEATURES[$activeBackend][feature]}, #{feature})"
+        }
+        putStr "OFFLINE_ASM_DISPATCH_TABLE_VARIANT_COUNT(#{@featureVariants.size})"
+        putStr "OFFLINE_ASM_OPCODE_STATS_NAMES"
+        handlers.each { | handler | putStr "OFFLINE_ASM_OPCODE_STATS_NAME(#{handler})" }
+        putStr "OFFLINE_ASM_OPCODE_STATS_COUNT(#{handlers.size * 3})"
+        putStr "OFFLINE_ASM_DISPATCH_TABLE_END"
     end
     
     def leaveAsm
         putsLastComment
+        layOutChunks
         if not @deferredOSDarwinActions.size.zero?
             putStr("#if OS(DARWIN)")
             (@deferredNextLabelActions + @deferredOSDarwinActions).each {
@@ -214,6 +552,8 @@ class Assembler
             action.call()
         }
         @deferredNextLabelActions = []
+        @labelChunks << [labelName, StringIO.new]
+        @outp = @labelChunks[-1][1]
         @numGlobalLabels += 1
         putsNewlineSpacerIfAppropriate(:global)
         @internalComment = $enableLabelCountComments ? "Global Label #{@numGlobalLabels}" : nil
@@ -241,15 +581,29 @@ class Assembler
             end
             @outp.puts(formatDump("OFFLINE_ASM_GLUE_LABEL(#{labelName})", lastComment))
         end
-        if $emitELFDebugDirectives
-            deferNextLabelAction {
-                putStr("    \".size #{labelName} , . - #{labelName} \\n\"")
-                putStr("    \".type #{labelName} , function \\n\"")
-            }
-        end
+        # Where the handler's entry point is, should it get an opcode counter.
+        @labelChunks[-1] << @outp.pos << isGlobal
         @newlineSpacerState = :none # After a global label, we can use another spacer.
     end
     
+    # What is emitted between these goes to the cold blocks, which layOutChunks
+    # puts after all the rest of the code.
+    def beginColdCode
+        @hotOutp = @outp
+        @outp = @coldCode
+    end
+
+    def endColdCode
+        @outp = @hotOutp
+    end
+
+    # Records whether the code of the current label so far ends in a jump, return
+    # or crash, which is what lets --fold-handlers move it or jump into its tail.
+    def noteLowered(node)
+        return if @outp.equal?(@coldCode) or not @labelChunks[-1][0]
+        @labelChunks[-1][4] = (node.is_a? Instruction and UNCONDITIONAL_TERMINATORS.include? node.opcode)
+    end
+
     def putsLocalLabel(labelName)
         raise unless @state == :asm
         @numLocalLabels += 1
@@ -299,109 +653,282 @@ class Assembler
     end
 end
 
-IncludeFile.processIncludeOptions()
+#
+# processAssemblyOptions(arguments)
+#
+# Takes asm.rb's options out of arguments into $options, and reads the handler
+# profile, if any, into $handlerProfile and the budgets, if any, into
+# $handlerBudgets. Exits on a bad option.
+#
 
-asmFile = ARGV.shift
-offsetsFile = ARGV.shift
-outputFlnm = ARGV.shift
-variants = ARGV.shift.split(/[,\s]+/)
+def processAssemblyOptions(arguments)
+    $options = {}
+    OptionParser.new do |opts|
+        opts.banner = "Usage: asm.rb asmFile offsetsFile outputFileName [--platform=<OS>] [--webkit-additions-path=<path>] [--binary-format=<format>] [--depfile=<depfile>] [--fixed-stride=<bytes>] [--profile=<file>] [--feature-variants=<feature>[,<feature>...]] [--fold-handlers] [--report=<file>] [--budget=<file>] [--machine-model=<model>[,<model>...]]"
+        # This option is currently only used to specify Windows for label lowering
+        opts.on("--platform=[Windows]", "Specify a specific platform for lowering.") do |platform|
+            $options[:platform] = platform
+        end
+        opts.on("--webkit-additions-path=PATH", "WebKitAdditions path.") do |path|
+            $options[:webkit_additions_path] = path
+        end
+        # Symbol sizes no longer depend on it: OFFLINE_ASM_LABEL_END sets them in every ELF object, as the C++ side knows the object format.
+        opts.on("--binary-format=FORMAT", "Specify the binary format used by the target system.") do |format|
+            $options[:binary_format] = format
+        end
+        opts.on("--depfile=DEPFILE", "Path to write Makefile-style discovered dependencies to.") do |path|
+            $options[:depfile] = path
+        end
+        opts.on("--fixed-stride=BYTES", Integer, "Give every opcode handler a slot of this many bytes, a power of two.") do |stride|
+            unless stride > 0 and (stride & (stride - 1)).zero?
+                $stderr.puts "offlineasm: --fixed-stride must be a power of two"
+                exit 1
+            end
+            $options[:fixed_stride] = stride
+        end
+        opts.on("--profile=FILE", "Opcode counts, as LLInt::OpcodeStats::dump() prints them, to lay out hot handlers by.") do |file|
+            $options[:profile] = file
+        end
+        opts.on("--feature-variants=FEATURES", Array, "Also lower the handlers for each of these CPU features, to be picked at startup.") do |features|
+            known = CPU_FEATURES.values.map(&:keys).flatten
+            unknown = features - known
+            unless unknown.empty?
+                $stderr.puts "offlineasm: unknown CPU feature #{unknown.join(", ")}; known are #{known.join(", ")}"
+                exit 1
+            end
+            $options[:feature_variants] = features.uniq
+        end
+        opts.on("--fold-handlers", "Emit handlers whose code is the same, or ends the same, only once. Opcode stats count an alias's entries under the handler it stands for.") do
+            $options[:fold_handlers] = true
+        end
+        opts.on("--report=FILE", "Write the size of every label's code to FILE, as JSON if it ends in .json and as CSV otherwise.") do |path|
+            $options[:report] = path
+        end
+        opts.on("--budget=FILE", "Fail if a label's code is larger than FILE allows; see report.rb.") do |path|
+            $options[:budget] = path
+        end
+        opts.on("--machine-model=MODELS", Array, "Add estimated cycles on these cores to the report; see throughput.rb.") do |models|
+            unknown = models - MACHINE_MODELS.keys
+            unless unknown.empty?
+                $stderr.puts "offlineasm: unknown machine model #{unknown.join(", ")}; known are #{MACHINE_MODELS.keys.join(", ")}"
+                exit 1
+            end
+            $options[:machine_models] = models.uniq
+        end
+    end.parse!(arguments)
 
-$options = {}
-OptionParser.new do |opts|
-    opts.banner = "Usage: asm.rb asmFile offsetsFile outputFileName [--platform=<OS>] [--webkit-additions-path=<path>] [--binary-format=<format>] [--depfile=<depfile>]"
-    # This option is currently only used to specify Windows for label lowering
-    opts.on("--platform=[Windows]", "Specify a specific platform for lowering.") do |platform|
-        $options[:platform] = platform
+    if $options[:fold_handlers] and $options[:fixed_stride]
+        $stderr.puts "offlineasm: --fold-handlers cannot be combined with --fixed-stride, which gives every handler a slot of its own"
+        exit 1
     end
-    opts.on("--webkit-additions-path=PATH", "WebKitAdditions path.") do |path|
-        $options[:webkit_additions_path] = path
+
+    if $options[:feature_variants] and ($options[:fixed_stride] or $options[:profile])
+        $stderr.puts "offlineasm: --feature-variants cannot be combined with --fixed-stride or --profile, which lay out every handler once"
+        exit 1
     end
-    opts.on("--binary-format=FORMAT", "Specify the binary format used by the target system.") do |format|
-        $options[:binary_format] = format
+
+    # handler label => number of times it was entered.
+    $handlerProfile = nil
+    if $options[:profile]
+        if $options[:fixed_stride]
+            $stderr.puts "offlineasm: --profile cannot be combined with --fixed-stride, which keeps handlers in opcode order"
+            exit 1
+        end
+        $handlerProfile = {}
+        IO::read($options[:profile]).each_line {
+            | line |
+            next unless line =~ /\A\s*(\d+)\s+(\S+)\s*\z/
+            $handlerProfile[$2] = ($handlerProfile[$2] || 0) + $1.to_i
+        }
     end
-    opts.on("--depfile=DEPFILE", "Path to write Makefile-style discovered dependencies to.") do |path|
-        $options[:depfile] = path
+
+    if $options[:machine_models] and not ($options[:report] or $options[:budget])
+        $stderr.puts "offlineasm: --machine-model needs --report or --budget to put its estimates in"
+        exit 1
     end
-end.parse!
 
-begin
-    configurationList = offsetsAndConfigurationIndexForVariants(offsetsFile, variants)
-rescue MissingMagicValuesException
-    $stderr.puts "offlineasm: No magic values found in #{offsetsFile}. Skipping assembly file generation."
-    exit 1
+    $handlerBudgets = nil
+    if $options[:budget]
+        begin
+            $handlerBudgets = HandlerReport.readBudgets($options[:budget])
+        rescue => e
+            $stderr.puts "offlineasm: #{e.message}"
+            exit 1
+        end
+        modelBudget = $handlerBudgets.find { | pattern, limits, | limits.any? { | metric, | HandlerReport::MODEL_METRICS.include?(metric) } }
+        if modelBudget and not $options[:machine_models]
+            $stderr.puts "offlineasm: #{modelBudget[2]}: #{modelBudget[0]} has a limit on an estimate, which needs --machine-model"
+            exit 1
+        end
+    end
 end
 
-# We want this in all ELF systems we support, except for C_LOOP (we'll disable it later on if we are building cloop)
-$emitELFDebugDirectives = $options.has_key?(:binary_format) && $options[:binary_format] == "ELF"
+#
+# ParsedAssembly
+#
+# What assemble() needs of asmFile before it lowers anything: the AST, the files
+# it was parsed from, its settings combinations, its parseHash, and the label
+# names parsing took (see LocalLabel.uniqueNames). asm.rb parses afresh every
+# time; server.rb keeps these around and parses again only when a source changes.
+#
 
-inputHash =
-    "// offlineasm input hash: " + parseHash(asmFile, $options) +
-    " " + Digest::SHA1.hexdigest(configurationList.map{|v| (v[0] + [v[1]]).join(' ')}.join(' ')) +
-    " " + selfHash +
-    " " + Digest::SHA1.hexdigest($options.has_key?(:platform) ? $options[:platform] : "")
+ParsedAssembly = Struct.new(:ast, :sources, :settingsCombinations, :hash, :labels)
 
-if FileTest.exist?(outputFlnm) and (not $options[:depfile] or FileTest.exist?($options[:depfile]))
-    lastLine = nil
-    File.open(outputFlnm, "r") {
-        | file |
-        file.each_line {
-            | line |
-            line = line.chomp
-            unless line.empty?
-                lastLine = line
-            end
+def parseAssembly(asmFile, options)
+    sources = Set.new
+    ast = parse(asmFile, options, sources)
+    ParsedAssembly.new(ast, sources, computeSettingsCombinations(ast), parseHash(asmFile, options), LocalLabel.uniqueNames)
+end
+
+#
+# assemble(asmFile, configurationList, outputFlnm, parsed = nil) -> whether it wrote outputFlnm
+#
+# Lowers asmFile for every configuration in configurationList (see
+# offsetsAndConfigurationIndexForVariants) into outputFlnm, with $options and
+# $handlerProfile as processAssemblyOptions left them. Leaves outputFlnm alone if
+# it was made from the same inputs already. parsed, if given, is asmFile as
+# parseAssembly returned it for these options. With --report or --budget, also
+# writes the report and checks every label against $handlerBudgets; a label
+# over its budget deletes outputFlnm again and exits.
+#
+
+def assemble(asmFile, configurationList, outputFlnm, parsed = nil)
+    inputHash =
+        "// offlineasm input hash: " + (parsed ? parsed.hash : parseHash(asmFile, $options)) +
+        " " + Digest::SHA1.hexdigest(configurationList.map{|v| (v[0] + [v[1]]).join(' ')}.join(' ')) +
+        " " + selfHash +
+        " " + Digest::SHA1.hexdigest($options.has_key?(:platform) ? $options[:platform] : "") +
+        ($options[:fixed_stride] ? " fixed-stride=#{$options[:fixed_stride]}" : "") +
+        ($options[:profile] ? " profile=" + Digest::SHA1.file($options[:profile]).hexdigest : "") +
+        ($options[:feature_variants] ? " feature-variants=#{$options[:feature_variants].join(",")}" : "") +
+        ($options[:fold_handlers] ? " fold-handlers" : "") +
+        ($options[:report] ? " report=#{$options[:report]}" : "") +
+        ($options[:budget] ? " budget=" + Digest::SHA1.file($options[:budget]).hexdigest : "") +
+        ($options[:machine_models] ? " machine-models=#{$options[:machine_models].join(",")}" : "")
+
+    if FileTest.exist?(outputFlnm) and (not $options[:depfile] or FileTest.exist?($options[:depfile])) and
+            (not $options[:report] or FileTest.exist?($options[:report]))
+        lastLine = nil
+        File.open(outputFlnm, "r") {
+            | file |
+            file.each_line {
+                | line |
+                line = line.chomp
+                unless line.empty?
+                    lastLine = line
+                end
+            }
         }
-    }
-    if lastLine and lastLine == inputHash
-        # Nothing changed.
-        exit 0
+        if lastLine and lastLine == inputHash
+            # Nothing changed.
+            return false
+        end
     end
-end
 
-File.open(outputFlnm, "w") {
-    | outp |
-    $output = outp
+    $handlerReport = ($options[:report] or $options[:budget]) ? HandlerReport.new(($options[:machine_models] || []).map { | name | MACHINE_MODELS[name] }) : nil
+    File.open(outputFlnm, "w") {
+        | outp |
+        $output = outp
 
-    $asm = Assembler.new($output)
+        $asm = Assembler.new($output)
 
-    sources = Set.new
-    ast = parse(asmFile, $options, sources)
-    settingsCombinations = computeSettingsCombinations(ast)
-    
-    if $options[:depfile]
-        depfile = File.open($options[:depfile], "w")
-        depfile.print(Shellwords.escape(outputFlnm), ": ")
-        depfile.puts(Shellwords.join(sources.sort))
-    end
-
-    configurationList.each {
-        | configuration |
-        offsetsList = configuration[0]
-        configIndex = configuration[1]
-        forSettings(settingsCombinations[configIndex], ast) {
-            | concreteSettings, lowLevelAST, backend |
-
-            # There could be multiple backends we are generating for, but the C_LOOP is
-            # always by itself so this check to turn off $enableDebugAnnotations won't
-            # affect the generation for any other backend.
-            if backend == "C_LOOP"
-                $enableDebugAnnotations = false
-                $preferredCommentStartColumn = 60
-                $emitELFDebugDirectives = false
-            end
+        if parsed
+            LocalLabel.restoreUniqueNames(parsed.labels)
+        else
+            parsed = parseAssembly(asmFile, $options)
+        end
+        ast = parsed.ast
+        settingsCombinations = parsed.settingsCombinations
+        
+        if $options[:depfile]
+            File.open($options[:depfile], "w") {
+                | depfile |
+                depfile.print(Shellwords.escape(outputFlnm), ": ")
+                depfile.puts(Shellwords.join(parsed.sources.sort))
+            }
+        end
+
+        configurationList.each {
+            | configuration |
+            # buildOffsetsMap takes the values out of the list it gets.
+            offsetsList = configuration[0].dup
+            configIndex = configuration[1]
+            forSettings(settingsCombinations[configIndex], ast) {
+                | concreteSettings, lowLevelAST, backend |
+
+                # There could be multiple backends we are generating for, but the C_LOOP is
+                # always by itself so this check to turn off $enableDebugAnnotations won't
+                # affect the generation for any other backend.
+                # The C_LOOP emits C++, which has neither handler addresses nor slots.
+                $emitDispatchTables = backend != "C_LOOP"
+                $emitCLoopLabels = backend == "C_LOOP"
+                $fixedHandlerStride = backend == "C_LOOP" ? nil : $options[:fixed_stride]
+                $splitColdCode = $handlerProfile && backend != "C_LOOP"
+                $foldHandlers = $options[:fold_handlers] && backend != "C_LOOP"
+                $handlerReport.beginConfiguration(backend, configIndex) if $handlerReport
+                if backend == "C_LOOP"
+                    $enableDebugAnnotations = false
+                    $preferredCommentStartColumn = 60
+                end
 
-            lowLevelAST = lowLevelAST.demacroify({})
-            lowLevelAST = lowLevelAST.resolve(buildOffsetsMap(lowLevelAST, offsetsList))
-            lowLevelAST.validate
-            emitCodeInConfiguration(concreteSettings, lowLevelAST, backend) {
-                $currentSettings = concreteSettings
-                $asm.inAsm {
-                    lowLevelAST.lower(backend)
+                lowLevelAST = lowLevelAST.demacroify({})
+                lowLevelAST = lowLevelAST.resolve(buildOffsetsMap(lowLevelAST, offsetsList))
+                lowLevelAST.validate
+                emitCodeInConfiguration(concreteSettings, lowLevelAST, backend) {
+                    $currentSettings = concreteSettings
+                    if $fixedHandlerStride
+                        $output.puts "#define OFFLINE_ASM_FIXED_STRIDE_SHIFT #{$fixedHandlerStride.bit_length - 1}"
+                    end
+                    features = $emitDispatchTables ? ($options[:feature_variants] || []) & (CPU_FEATURES[backend] || {}).keys : []
+                    $asm.inAsm {
+                        uniqueNames = LocalLabel.uniqueNames
+                        lowLevelAST.lower(backend)
+                        features.each {
+                            | feature |
+                            LocalLabel.restoreUniqueNames(uniqueNames)
+                            $asm.lowerFeatureVariant(feature) {
+                                lowLevelAST.lower(backend)
+                            }
+                        }
+                    }
                 }
             }
         }
+
+        $output.fsync
+        $output.puts inputHash
     }
 
-    $output.fsync
-    $output.puts inputHash
-}
+    if $handlerReport
+        $handlerReport.write($options[:report]) if $options[:report]
+        errors, warnings = $handlerReport.overBudget($handlerBudgets || [])
+        warnings.each { | warning | $stderr.puts "offlineasm: warning: #{warning}" }
+        unless errors.empty?
+            errors.each { | error | $stderr.puts "offlineasm: #{error}" }
+            # So that the next build fails too, rather than finding the output up to date.
+            File.delete(outputFlnm)
+            exit 1
+        end
+    end
+    true
+end
+
+if __FILE__ == $0
+    IncludeFile.processIncludeOptions()
+
+    asmFile = ARGV.shift
+    offsetsFile = ARGV.shift
+    outputFlnm = ARGV.shift
+    variants = ARGV.shift.split(/[,\s]+/)
+
+    processAssemblyOptions(ARGV)
+
+    begin
+        configurationList = offsetsAndConfigurationIndexForVariants(offsetsFile, variants)
+    rescue MissingMagicValuesException
+        $stderr.puts "offlineasm: No magic values found in #{offsetsFile}. Skipping assembly file generation."
+        exit 1
+    end
+
+    assemble(asmFile, configurationList, outputFlnm)
+end
@@ -1265,7 +1265,18 @@ class LocalLabel < NoChildren
         end
         forName(codeOrigin, newName)
     end
-    
+
+    # The names unique() has handed out so far. Lowering the same code again after
+    # restoreUniqueNames() of what this returned before comes up with the same names.
+    def self.uniqueNames
+        [$labelMapping.dup, @@uniqueNameCounter]
+    end
+
+    def self.restoreUniqueNames(state)
+        mapping, @@uniqueNameCounter = state
+        $labelMapping = mapping.dup
+    end
+
     def cleanName
         if name =~ /^\./
             "_" + name[1..-1]
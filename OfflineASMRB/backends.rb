@@ -69,6 +69,32 @@ BACKENDS.each {
     $allBackends[backend] = true
 }
 
+# The optional CPU features a backend can lower some instructions with, each with
+# its bit in LLInt::CPUFeatures (see Cpp/LLIntDispatch.h). Code is lowered for the
+# baseline CPU; asm.rb --feature-variants lowers the handlers once more for each
+# feature, and the interpreter picks which copies to dispatch to when it starts.
+#
+# X86_64 "bmi": tzcnt (BMI1) and lzcnt (LZCNT), which every CPU with BMI1 has too.
+CPU_FEATURES = {
+    "X86_64" => { "bmi" => 1 << 0 },
+}
+
+# What the code being lowered may assume beyond its backend's baseline.
+$activeCPUFeatures = []
+
+def cpuFeatureActive?(feature)
+    $activeCPUFeatures.include?(feature)
+end
+
+# How each backend jumps to a label, for the jumps asm.rb --fold-handlers adds
+# into the code another handler ends with. Elsewhere handlers are not folded.
+LABEL_JUMPS = {
+    "X86_64" => "jmp",
+    "ARMv7" => "b",
+    "ARM64" => "b",
+    "ARM64E" => "b",
+}
+
 def canonicalizeBackendNames(backendNames)
     newBackendNames = []
     backendNames.each {
@@ -178,23 +204,118 @@ class Skip
     end
 end
 
+UNCONDITIONAL_TERMINATORS = ["jmp", "ret", "break"]
+
+# The conditional branches that branch on the opposite condition of each other,
+# so that a branch over a crash path can be turned into one to it.
+INVERTED_BRANCHES = {}
+["i", "b", "p", "q"].each {
+    | type |
+    { "eq" => "neq", "a" => "beq", "aeq" => "b", "gt" => "lteq", "gteq" => "lt" }.each {
+        | condition, inverse |
+        INVERTED_BRANCHES["b#{type}#{condition}"] = "b#{type}#{inverse}"
+        INVERTED_BRANCHES["b#{type}#{inverse}"] = "b#{type}#{condition}"
+    }
+    INVERTED_BRANCHES["bt#{type}z"] = "bt#{type}nz"
+    INVERTED_BRANCHES["bt#{type}nz"] = "bt#{type}z"
+}
+{ "eq" => "nequn", "neq" => "equn", "gt" => "ltequn", "gteq" => "ltun", "lt" => "gtequn", "lteq" => "gtun" }.each {
+    | condition, inverse |
+    INVERTED_BRANCHES["bd#{condition}"] = "bd#{inverse}"
+    INVERTED_BRANCHES["bd#{inverse}"] = "bd#{condition}"
+}
+INVERTED_BRANCHES["testbitz"] = "testbitnz"
+INVERTED_BRANCHES["testbitnz"] = "testbitz"
+
 class Sequence
     def lower(name)
         $activeBackend = name
         if respond_to? "getModifiedList#{name}"
             newList = send("getModifiedList#{name}")
-            newList.each {
-                | node |
-                node.lower(name)
-            }
+            lowerList(newList, name)
         elsif respond_to? "lower#{name}"
             send("lower#{name}")
         else
-            @list.each {
-                | node |
-                node.lower(name)
-            }
+            lowerList(@list, name)
         end
     end
+
+    def lowerList(list, name)
+        previous = nil
+        coldEnd = nil
+        list.each_with_index {
+            | node, index |
+            if $splitColdCode and not coldEnd and (coldEnd = coldBranchEnd(list, index))
+                # The branch is inverted to go to the crash path, which moves out
+                # of line, and the code after it falls through to where it went.
+                coldLabel = LocalLabel.unique(node.codeOrigin, "cold")
+                branch = Instruction.new(node.codeOrigin, INVERTED_BRANCHES[node.opcode], node.operands[0..-2] + [LocalLabelReference.new(node.codeOrigin, coldLabel)], node.annotation)
+                branch.lower(name)
+                $asm.noteLowered(branch)
+                $asm.beginColdCode
+                coldLabel.lower(name)
+                previous = node
+                next
+            end
+            if $splitColdCode and not coldEnd and (coldEnd = coldBlockEnd(list, index, previous))
+                $asm.beginColdCode
+            end
+            node.lower(name)
+            $asm.noteLowered(node) unless node.is_a? Skip
+            if coldEnd == index
+                $asm.endColdCode
+                coldEnd = nil
+            end
+            previous = node unless node.is_a? Skip
+        }
+    end
+
+    # If list[index] is a local label that nothing falls into and whose code
+    # reaches a break without branching or returning (the crash and assertion
+    # paths), returns the index of the block's last node.
+    def coldBlockEnd(list, index, previous)
+        return nil unless list[index].is_a? LocalLabel
+        return nil unless previous.is_a? Instruction and UNCONDITIONAL_TERMINATORS.include? previous.opcode
+        crashingBlockEnd(list, index + 1)
+    end
+
+    # If list[index] is a conditional branch over such a block to the local label
+    # right after it, as in
+    #
+    #     bpeq t0, t1, .ok
+    #     break
+    # .ok:
+    #
+    # returns the index of the block's last node.
+    def coldBranchEnd(list, index)
+        node = list[index]
+        return nil unless node.is_a? Instruction and INVERTED_BRANCHES[node.opcode] and node.operands[-1].is_a? LocalLabelReference
+        last = crashingBlockEnd(list, index + 1)
+        return nil unless last and list[last + 1].is_a? LocalLabel and list[last + 1].equal?(node.operands[-1].label)
+        last
+    end
+
+    # The index of the last node of the code from list[first] on up to the next
+    # label, if that code reaches a break without branching or returning.
+    def crashingBlockEnd(list, first)
+        crashes = false
+        last = nil
+        (first...list.size).each {
+            | candidate |
+            node = list[candidate]
+            break if node.is_a? Label or node.is_a? LocalLabel
+            return nil unless node.is_a? Instruction or node.is_a? Skip
+            last = candidate
+            next if crashes or node.is_a? Skip
+            if node.opcode == "break"
+                crashes = true
+            elsif UNCONDITIONAL_TERMINATORS.include? node.opcode
+                return nil
+            elsif node.opcode != "call" and node.operands.any? { | operand | operand.is_a? LabelReference or operand.is_a? LocalLabelReference }
+                return nil
+            end
+        }
+        crashes ? last : nil
+    end
 end
 
@@ -0,0 +1,163 @@
+$: << File.dirname(__FILE__)
+
+require "config"
+require "fileutils"
+require 'optparse'
+require "parser"
+require "self_hash"
+require "server_protocol"
+require "shellwords"
+require "stage_cache"
+
+#
+# Usage: build.rb [-I<dir>...] asmFile backend [--cpp] [--cache=<dir>] [--cxx=<compiler>]
+#                 [--binary-format=<format>] [--webkit-additions-path=<path>] [--fixed-stride=<bytes>]
+#                 [--profile=<file>] [--feature-variants=<feature>[,<feature>...]] [--fold-handlers]
+#                 [--report=<file>] [--budget=<file>] [--machine-model=<model>[,<model>...]]
+#
+# Runs the stages of the README's standard build (or, with --cpp, its Cpp
+# build) into build/, skipping every stage whose outputs are already in the
+# cache. Each stage is keyed on exactly what it reads, so changing only
+# Cpp/test.cc rebuilds only build/test. The cache lives outside build/ and so
+# survives rm -rf build/*.
+#
+# If OFFLINEASM_SERVER names the socket of a running server.rb, the asm.rb
+# stage is sent to it instead of starting Ruby again.
+#
+
+includeOptions = ARGV.take_while { | argument | argument =~ /^-I/ }
+IncludeFile.processIncludeOptions()
+
+asmFile = ARGV.shift
+backend = ARGV.shift
+variant = backend.downcase
+
+$options = {}
+cacheDirectory = ENV['OFFLINEASM_CACHE_DIR'] || File.join(Dir.home, ".cache", "offlineasm")
+compiler = ENV['CXX'] || "clang++"
+useCpp = false
+OptionParser.new do |opts|
+    opts.banner = "Usage: build.rb asmFile backend [--cpp] [--cache=<dir>] [--cxx=<compiler>] [--binary-format=<format>] [--webkit-additions-path=<path>] [--fixed-stride=<bytes>] [--profile=<file>] [--feature-variants=<features>] [--fold-handlers] [--report=<file>] [--budget=<file>] [--machine-model=<models>]"
+    opts.on("--cpp", "Generate LLIntAssembly.h through OfflineASMRBToC and OfflineASM.") do
+        useCpp = true
+    end
+    opts.on("--cache=DIRECTORY", "Directory of the stage cache.") do |directory|
+        cacheDirectory = directory
+    end
+    opts.on("--cxx=COMPILER", "C++ compiler to build the extractors and tests with.") do |name|
+        compiler = name
+    end
+    opts.on("--binary-format=FORMAT", "The binary format of the output.") do |format|
+        $options[:binary_format] = format
+    end
+    opts.on("--webkit-additions-path=PATH", "WebKitAdditions path.") do |path|
+        $options[:webkit_additions_path] = path
+    end
+    opts.on("--fixed-stride=BYTES", "Passed on to asm.rb.") do |stride|
+        $options[:fixed_stride] = stride
+    end
+    opts.on("--profile=FILE", "Passed on to asm.rb.") do |file|
+        $options[:profile] = file
+    end
+    opts.on("--feature-variants=FEATURES", "Passed on to asm.rb.") do |features|
+        $options[:feature_variants] = features
+    end
+    opts.on("--fold-handlers", "Passed on to asm.rb.") do
+        $options[:fold_handlers] = true
+    end
+    opts.on("--report=FILE", "Passed on to asm.rb.") do |file|
+        $options[:report] = file
+    end
+    opts.on("--budget=FILE", "Passed on to asm.rb.") do |file|
+        $options[:budget] = file
+    end
+    opts.on("--machine-model=MODELS", "Passed on to asm.rb.") do |models|
+        $options[:machine_models] = models
+    end
+end.parse!
+
+$cache = StageCache.new(cacheDirectory)
+
+# Runs command, unless the stage is cached. With a block, the block runs the
+# stage instead and returns whether it succeeded.
+def runStage(name, keyParts, outputs, command)
+    key = StageCache.key(name, keyParts)
+    if $cache.restore(key, outputs)
+        $stderr.puts "offlineasm: #{name} is up to date"
+        return
+    end
+    $stderr.puts "offlineasm: #{name}: #{Shellwords.join(command)}"
+    unless block_given? ? yield : system(*command)
+        $stderr.puts "offlineasm: #{name} failed"
+        exit 1
+    end
+    $cache.store(key, outputs)
+end
+
+def compileStage(name, compiler, sources, output, flags = [])
+    inputs = sources.map { | source | includeClosure(source) }.flatten.uniq
+    runStage(name, [compiler, flags.join(" "), inputs.join(" "), fileListHash(inputs)], [output],
+             [compiler] + flags + sources + ["-o", output])
+end
+
+ruby = RbConfig.ruby
+scripts = File.dirname(__FILE__)
+root = Pathname.new(scripts).parent
+cppScripts = (root + "OfflineASMRBToC").to_s
+cppDirectory = (root + "Cpp").to_s
+# The Cpp sources include their generated headers from ../build.
+buildDirectory = (root + "build").to_s
+FileUtils.mkdir_p(buildDirectory)
+inputHash = parseHash(asmFile, $options)
+passOptions = []
+passOptions << "--webkit-additions-path=#{$options[:webkit_additions_path]}" if $options[:webkit_additions_path]
+
+desiredSettings = File.join(buildDirectory, "LLIntDesiredSettings.h")
+runStage("LLIntDesiredSettings.h", [inputHash, selfHash, backend] + passOptions, [desiredSettings],
+         [ruby, File.join(scripts, "generate_settings_extractor.rb")] + includeOptions + [asmFile, desiredSettings, backend] + passOptions)
+
+settingsExtractor = File.join(buildDirectory, "LLIntSettingsExtractor")
+compileStage("LLIntSettingsExtractor", compiler, [File.join(cppDirectory, "LLIntSettingsExtractor.cpp")], "#{settingsExtractor}_#{variant}")
+
+desiredOffsets = File.join(buildDirectory, "LLIntDesiredOffsets.h")
+runStage("LLIntDesiredOffsets.h", [inputHash, selfHash, fileHash("#{settingsExtractor}_#{variant}"), backend, variant] + passOptions, [desiredOffsets],
+         [ruby, File.join(scripts, "generate_offset_extractor.rb")] + includeOptions + [asmFile, settingsExtractor, desiredOffsets, backend, variant] + passOptions)
+
+offsetsExtractor = File.join(buildDirectory, "LLIntOffsetsExtractor")
+compileStage("LLIntOffsetsExtractor", compiler, [File.join(cppDirectory, "LLIntOffsetsExtractor.cpp")], "#{offsetsExtractor}_#{variant}")
+
+assembly = File.join(buildDirectory, "LLIntAssembly.h")
+if useCpp
+    generatedBody = File.join(buildDirectory, "test.asm.cpp")
+    runStage("test.asm.cpp", [inputHash, dirHash(cppScripts, /\.rb$/), backend], [generatedBody],
+             [ruby, File.join(cppScripts, "asm.rb"), asmFile, generatedBody, backend])
+
+    offlineASM = File.join(buildDirectory, "OfflineASM")
+    compileStage("OfflineASM", compiler, [(root + "OfflineASMC" + "OfflineASM.cpp").to_s, generatedBody], offlineASM, ["-std=c++20"])
+
+    runStage("LLIntAssembly.h", [fileHash(offlineASM)], [assembly], [offlineASM, assembly])
+else
+    assemblyOptions = passOptions.dup
+    assemblyOptions << "--binary-format=#{$options[:binary_format]}" if $options[:binary_format]
+    assemblyOptions << "--fixed-stride=#{$options[:fixed_stride]}" if $options[:fixed_stride]
+    assemblyOptions << "--profile=#{$options[:profile]}" if $options[:profile]
+    assemblyOptions << "--feature-variants=#{$options[:feature_variants]}" if $options[:feature_variants]
+    assemblyOptions << "--fold-handlers" if $options[:fold_handlers]
+    assemblyOptions << "--report=#{$options[:report]}" if $options[:report]
+    assemblyOptions << "--budget=#{$options[:budget]}" if $options[:budget]
+    assemblyOptions << "--machine-model=#{$options[:machine_models]}" if $options[:machine_models]
+    profileHash = $options[:profile] ? fileHash($options[:profile]) : ""
+    budgetHash = $options[:budget] ? fileHash($options[:budget]) : ""
+    assemblyArguments = includeOptions + [asmFile, offsetsExtractor, assembly, variant] + assemblyOptions
+    server = ENV['OFFLINEASM_SERVER']
+    sendToServer = server && lambda {
+        reply = serverRequest(server, { "command" => "assemble", "directory" => Dir.pwd, "arguments" => assemblyArguments })
+        $stderr.print reply["log"] if reply["log"]
+        $stderr.puts "offlineasm server: #{reply["message"]}" unless reply["status"] == "ok"
+        reply["status"] == "ok"
+    }
+    runStage("LLIntAssembly.h", [inputHash, selfHash, fileHash("#{offsetsExtractor}_#{variant}"), profileHash, budgetHash, backend, variant] + assemblyOptions, [assembly] + [$options[:report]].compact,
+             [ruby, File.join(scripts, "asm.rb")] + assemblyArguments, &sendToServer)
+end
+
+compileStage("test", compiler, [File.join(cppDirectory, "test.cc"), File.join(cppDirectory, "LowLevelInterpreter.cpp")], File.join(buildDirectory, "test"))
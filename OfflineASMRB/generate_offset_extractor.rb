@@ -69,13 +69,6 @@ rescue MissingMagicValuesException
     exit 1
 end
 
-def emitMagicNumber
-    OFFSET_MAGIC_NUMBERS.each {
-        | number |
-        $output.puts "unsigned(#{number}),"
-    }
-end
-
 configurationHash = Digest::SHA1.hexdigest(configurationList.join(' '))
 inputHash = "// OffsetExtractor input hash: #{parseHash(inputFlnm, $options)} #{configurationHash} #{selfHash} #{validBackends.join(' ')}"
 
@@ -121,27 +114,27 @@ File.open(tempFlnm, "w") {
                     | const, index |
                     outp.puts "constexpr int64_t constValue#{index} = static_cast<int64_t>(#{const.value});"
                 }
-                outp.puts "static const int64_t offsetExtractorTable[] = {"
-                OFFSET_HEADER_MAGIC_NUMBERS.each {
+                # See OFFSET_TABLE_MAGIC_NUMBERS for the layout.
+                outp.puts "static const int64_t offsetExtractorTable[] OFFLINE_ASM_OFFSETS_SECTION = {"
+                OFFSET_TABLE_MAGIC_NUMBERS.each {
                     | number |
-                    outp.puts "unsigned(#{number}),"
+                    outp.puts "#{number},"
                 }
+                outp.puts "#{OFFSET_TABLE_VERSION},"
+                outp.puts "1,"
+                outp.puts "#{1 + offsetsList.size + sizesList.size + constsList.size},"
 
-                emitMagicNumber
                 outp.puts "#{configIndex},"
                 offsetsList.each {
                     | offset |
-                    emitMagicNumber
                     outp.puts "OFFLINE_ASM_OFFSETOF(#{offset.struct}, #{offset.field}),"
                 }
                 sizesList.each {
                     | sizeof |
-                    emitMagicNumber
                     outp.puts "sizeof(#{sizeof.struct}),"
                 }
                 constsList.each_with_index {
                     | const, index |
-                    emitMagicNumber
                     outp.puts "constValue#{index},"
                 }
                 outp.puts "};"
@@ -74,7 +74,9 @@ end
 
 sources = Set.new
 originalAST = parse(inputFlnm, $options, sources)
-prunedAST = Sequence.new(originalAST.codeOrigin, originalAST.filter(Setting))
+# The combinations come from the whole AST, since which settings matter depends
+# on the conditions they appear in; the table itself resolves nothing.
+emptyAST = Sequence.new(originalAST.codeOrigin, [])
 
 if $options[:depfile]
     depfile = File.open($options[:depfile], "w")
@@ -87,11 +89,11 @@ File.open(tempFlnm, "w") {
     $output = outp
     outp.puts inputHash
 
-    settingsCombinations = computeSettingsCombinations(prunedAST)
+    settingsCombinations = computeSettingsCombinations(originalAST)
     length = settingsCombinations.size * (1 + OFFSET_HEADER_MAGIC_NUMBERS.size)
 
     outp.puts "static const int64_t settingsExtractorTable[#{length}] = {"
-    emitCodeInAllConfigurations(prunedAST) {
+    emitCodeInAllConfigurations(emptyAST, settingsCombinations) {
         | settings, ast, backend, index |
         OFFSET_HEADER_MAGIC_NUMBERS.each {
             | number |
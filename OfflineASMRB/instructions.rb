@@ -412,6 +412,8 @@ ARM64_INSTRUCTIONS =
     [
      "bfiq", # Bit field insert <source reg> <last bit written> <width immediate> <dest reg>
      "pcrtoaddr",   # Address from PC relative offset - adr instruction
+     "testbitz",    # Branch if bit <immediate> of <reg> is clear - tbz instruction
+     "testbitnz",   # Branch if bit <immediate> of <reg> is set - tbnz instruction
      "globaladdr",
      "notq",
      "loadqinc",
@@ -459,6 +461,8 @@ ARM64_INSTRUCTIONS =
      "storepairi",
      "loadpaird",
      "storepaird",
+     "loadpairv",
+     "storepairv",
     ]
 
 ARM64_SIMD_INSTRUCTIONS =
@@ -25,7 +25,15 @@ require "config"
 require "ast"
 
 OFFSET_HEADER_MAGIC_NUMBERS = [ 0x2e43fd66, 0x4379bfba ]
-OFFSET_MAGIC_NUMBERS = [ 0x5c577ac7, 0x0ff5e755 ]
+
+# The offsets extractor's table: these two magic numbers, then the version, the
+# number of configurations and the stride, then one record of stride values per
+# configuration, its index followed by its offsets, sizes and consts.
+OFFSET_TABLE_MAGIC_NUMBERS = [ 0x6b4a9e0d, 0x3d71c2a5 ]
+OFFSET_TABLE_VERSION = 1
+OFFSET_TABLE_HEADER_SIZE = OFFSET_TABLE_MAGIC_NUMBERS.size + 3
+# The section LLIntOffsetsExtractor.cpp puts it in, on ELF and in Mach-O's __DATA.
+OFFSET_TABLE_SECTION_NAMES = [ "llint_offsets", "__llint_offsets" ]
 
 #
 # MissingMagicValuesException
@@ -138,38 +146,124 @@ def sliceByteArrays(byteArray, pattern)
     result
 end
 
+#
+# findSection(file, names) -> [fileOffset, size, endianness] or nil
+#
+# Reads just enough of an ELF or 64-bit Mach-O file's headers to locate the
+# first section called one of names.
+#
+
+def findSection(file, names)
+    File.open(file, "rb") {
+        | inp |
+        ident = inp.pread(16, 0)
+        return nil unless ident and ident.size == 16
+
+        if ident.start_with?("\x7fELF".b)
+            is64 = ident.getbyte(4) == 2
+            endianness = ident.getbyte(5) == 2 ? :big : :little
+            e = endianness == :little ? "<" : ">"
+            if is64
+                header = inp.pread(64, 0)
+                sectionHeadersOffset = header[40, 8].unpack1("Q#{e}")
+                entrySize, count, namesIndex = header[58, 6].unpack("S#{e}3")
+                layout = "L#{e}2Q#{e}4"
+            else
+                header = inp.pread(52, 0)
+                sectionHeadersOffset = header[32, 4].unpack1("L#{e}")
+                entrySize, count, namesIndex = header[46, 6].unpack("S#{e}3")
+                layout = "L#{e}6"
+            end
+            return nil if count.zero? or namesIndex >= count
+            table = inp.pread(entrySize * count, sectionHeadersOffset)
+            sections = count.times.map {
+                | index |
+                # name, type, flags, address, offset, size
+                table[index * entrySize, entrySize].unpack(layout)
+            }
+            sectionNames = inp.pread(sections[namesIndex][5], sections[namesIndex][4])
+            sections.each {
+                | name, type, flags, address, offset, size |
+                next if type == 8 # SHT_NOBITS
+                return [offset, size, endianness] if names.include?(sectionNames[name...sectionNames.index("\0", name)])
+            }
+        elsif ident.start_with?("\xcf\xfa\xed\xfe".b)
+            numberOfCommands, commandsSize = inp.pread(8, 16).unpack("L<2")
+            commands = inp.pread(commandsSize, 32)
+            position = 0
+            numberOfCommands.times {
+                command, commandSize = commands[position, 8].unpack("L<2")
+                if command == 0x19 # LC_SEGMENT_64
+                    numberOfSections = commands[position + 64, 4].unpack1("L<")
+                    numberOfSections.times {
+                        | index |
+                        section = commands[position + 72 + index * 80, 80]
+                        name = section[0, 16].delete("\0")
+                        size, offset = section[40, 12].unpack("Q<L<")
+                        return [offset, size, :little] if names.include?(name)
+                    }
+                end
+                position += commandSize
+            }
+        end
+    }
+    nil
+end
+
+#
+# readOffsetTable(bytes, position, endianness, result) -> position after the table
+#
+# Adds the configurations of the table at position to result, a map from
+# configuration index to offsets. Returns nil if there is no table there.
+#
+
+def readOffsetTable(bytes, position, endianness, result)
+    format = endianness == :little ? "q<" : "q>"
+    header = bytes[position, OFFSET_TABLE_HEADER_SIZE * 8]
+    return nil unless header and header.size == OFFSET_TABLE_HEADER_SIZE * 8
+    *magic, version, count, stride = header.unpack("#{format}*")
+    return nil unless magic == OFFSET_TABLE_MAGIC_NUMBERS
+    raise "offsets table version #{version} is not #{OFFSET_TABLE_VERSION}" unless version == OFFSET_TABLE_VERSION
+    position += header.size
+    values = bytes[position, count * stride * 8].unpack("#{format}*")
+    values.each_slice(stride) {
+        | record |
+        result[record[0]] = record[1..-1]
+    }
+    position + count * stride * 8
+end
+
 #
 # offsetsAndConfigurationIndex(file) ->
 #     [[offsets, index], ...]
 #
 # Parses the offsets from a file and returns a list of offsets and the
-# index of the configuration that is valid in this build target.
+# index of the configuration that is valid in this build target. The table is
+# read out of its section; only if the file has no such section is it searched
+# for the table's magic numbers.
 #
 
 def offsetsAndConfigurationIndex(file)
-    fileBytes = fileBytes(file)
     result = {}
 
-    [:little, :big].each {
-        | endianness |
-        headerMagicBytes = prepareMagic(endianness, OFFSET_HEADER_MAGIC_NUMBERS)
-        magicBytes = prepareMagic(endianness, OFFSET_MAGIC_NUMBERS)
-
-        bigArray = sliceByteArrays(fileBytes, headerMagicBytes)
-        unless bigArray.size <= 1
-            bigArray[1..-1].each {
-                | configArray |
-                array = sliceByteArrays(configArray, magicBytes)
-                index = readInt(endianness, array[1])
-                offsets = []
-                array[2..-1].each {
-                    | data |
-                    offsets << readInt(endianness, data)
-                }
-                result[index] = offsets
-            }
+    offset, size, endianness = findSection(file, OFFSET_TABLE_SECTION_NAMES)
+    if offset
+        bytes = File.open(file, "rb") { | inp | inp.pread(size, offset) }
+        position = 0
+        # The section holds a table per configuration the extractor was built with.
+        while position = readOffsetTable(bytes, position, endianness, result)
         end
-    }
+    else
+        bytes = File.binread(file)
+        [:little, :big].each {
+            | endianness |
+            magic = OFFSET_TABLE_MAGIC_NUMBERS.pack(endianness == :little ? "q<*" : "q>*")
+            position = 0
+            while position = bytes.index(magic, position)
+                position = readOffsetTable(bytes, position, endianness, result) || position + 1
+            end
+        }
+    end
 
     raise MissingMagicValuesException unless result.length >= 1
 
@@ -99,15 +99,19 @@ class IncludeFile
         @fileName = File.join(directory, moduleName + ".asm")
     end
 
-    def self.processIncludeOptions()
-        while ARGV[0][/^-I/]
-            path = ARGV.shift[2..-1]
-            if not path
-                path = ARGV.shift
+    def self.processIncludeOptions(arguments = ARGV)
+        while arguments[0] and arguments[0][/^-I/]
+            path = arguments.shift[2..-1]
+            if not path or path.empty?
+                path = arguments.shift
             end
             @@includeDirs << (path + "/")
         end
     end
+
+    def self.resetIncludeDirs()
+        @@includeDirs = []
+    end
 end
 
 class Token
@@ -0,0 +1,215 @@
+require "json"
+require "throughput"
+
+#
+# HandlerReport
+#
+# With asm.rb --report or --budget, what the code of every label came to after
+# lowering, one row per label and configuration:
+#
+#     instructions  machine instructions.
+#     bytes         their size. Exact on ARM64, where every instruction is 4
+#                   bytes; an upper bound on ARMv7 and RISCV64, whose assemblers
+#                   may pick 2-byte encodings; an estimate on X86_64 (see
+#                   x86InstructionBytes), which assumes every jump to a label
+#                   needs a 32-bit displacement.
+#     spills        stores of a register to the stack or the call frame (push,
+#                   and stores based on sp or cfr), callee-saves included.
+#     constants     constants put into a register by instructions of their own.
+#
+# With --machine-model, every label has a row for each model of its backend, with
+# the model's estimates (see throughput.rb). Handler widths have their width in the width column. Handlers that
+# --fold-handlers made aliases of others have no code and no row, and cold
+# blocks (--profile) count against no label.
+#
+
+class HandlerReport
+    COLUMNS = ["backend", "configuration", "label", "width", "instructions", "bytes", "spills", "constants"]
+    MODEL_COLUMNS = ["model", "critical_path", "cycles", "load_chain", "chain"]
+    METRICS = ["instructions", "bytes", "spills", "constants"]
+    # Budgets on these need a --machine-model.
+    MODEL_METRICS = ["critical_path", "cycles", "load_chain"]
+
+    # [spill, constant] patterns for the instructions of each backend.
+    PATTERNS = {
+        "X86_64" => [/\Apush|\Amov\w* %\w+, [-\w]*\(%(rsp|rbp)\b/, /\Amov(abs)?[lq]? \$[^,]+, %/],
+        "ARMv7" => [/\A(push|vpush)|\A(str|vstr|stm)\w* .*\[(sp|r7)\b/, /\A(movw|ldr\S* \w+, =)/],
+        "ARM64" => [/\A(str|stur|stp)\w* .*\[(sp|x29)\b/, /\A(movz|movn) |\Aorr [xw]\d+, [xw]zr, #/],
+        "RISCV64" => [/\A(sd|sw|sh|sb|fsd|fsw) .*\((sp|fp)\)/, /\A(li|lui) /],
+    }
+    PATTERNS["ARM64E"] = PATTERNS["ARM64"]
+
+    def initialize(models = [])
+        @models = models
+        @rows = []
+    end
+
+    def beginConfiguration(backend, configuration)
+        @backend = backend
+        @configuration = configuration
+    end
+
+    # The instructions in code as offlineasm emits them, each with the source
+    # line it came from: every line that is a string, with the labels and macros
+    # in it left as "label", and without the string's quotes and newline.
+    # Directives and label definitions are not instructions.
+    def self.instructions(code)
+        location = ""
+        code.lines.map {
+            | line |
+            location = $1 if line =~ /\/\/\s*(\S+:\d+)/
+            line = line.sub(/(\A|\s)\/\/.*/m, "").strip
+            next unless line.start_with?("\"")
+            [line.gsub(/"\s*[A-Z_]+\([^)]*\)\s*"/, "label").delete("\"").sub(/\\n\z/, "").strip, location]
+        }.compact.reject { | instruction, | instruction.empty? or instruction.start_with?(".") or instruction.end_with?(":") }
+    end
+
+    def add(label, width, code)
+        patterns = PATTERNS[@backend]
+        return unless patterns
+        located = HandlerReport.instructions(code)
+        instructions = located.map { | instruction, | instruction }
+        bytes = @backend == "X86_64" ? instructions.sum { | instruction | HandlerReport.x86InstructionBytes(instruction) } : 4 * instructions.size
+        row = {
+            "backend" => @backend,
+            "configuration" => @configuration,
+            "label" => label,
+            "width" => width || "",
+            "instructions" => instructions.size,
+            "bytes" => bytes,
+            "spills" => instructions.count { | instruction | instruction =~ patterns[0] },
+            "constants" => instructions.count { | instruction | instruction =~ patterns[1] },
+        }
+        models = @models.select { | model | model.backends.include?(@backend) }
+        if models.empty?
+            @rows << row
+        else
+            models.each { | model | @rows << row.merge({ "model" => model.name }).merge(model.estimate(@backend, located)) }
+        end
+    end
+
+    def self.immediateValue(text)
+        Integer(text) rescue nil
+    end
+
+    # The size of an X86_64 instruction in AT&T syntax, from its opcode, ModRM,
+    # REX and other prefixes, SIB, displacement and immediate.
+    def self.x86InstructionBytes(instruction)
+        mnemonic, operands = instruction.split(/\s+/, 2)
+        operands = operands.to_s
+        return 1 if ["ret", "cqto", "cltq", "cltd", "leave", "nop", "int3"].include? mnemonic or instruction == "int $3"
+        return 2 if ["ud2", "int", "pause"].include? mnemonic
+        if mnemonic =~ /\A(push|pop)/ and operands.start_with?("%")
+            return operands =~ /\A%r\d/ ? 2 : 1
+        end
+        if mnemonic =~ /\A(jmp|call|j[a-z]+)\z/
+            return 2 + (operands =~ /%r\d/ ? 1 : 0) if operands.start_with?("*")
+            return mnemonic == "jmp" || mnemonic == "call" ? 5 : 6
+        end
+
+        return 10 if mnemonic =~ /\Amovabs/
+
+        bytes = 2
+        # REX, for 64-bit operands and for r8 to r15 anywhere.
+        bytes += 1 if mnemonic =~ /q\z/ or operands =~ /%r\d/ or operands.gsub(/\([^)]*\)/, "") =~ /%r[a-z]{2}\b/
+        bytes += 1 if mnemonic =~ /\A[a-z]+w\z/ and mnemonic !~ /\Amovs?[zs]?w\z/
+        bytes += 1 if mnemonic =~ /\A(movz|movs[bw]|set|cmov|bsf|bsr|bt|xadd|cmpxchg)/ or (mnemonic =~ /\Aimul/ and operands.count(",") == 1)
+        bytes += 2 if operands.include?("%xmm") or mnemonic =~ /\A(tzcnt|lzcnt|popcnt)/
+
+        if operands =~ /([-\w]*)\((%\w+)?(?:,(%\w+))?(?:,\d)?\)/
+            displacement, base, index = $1, $2, $3
+            value = displacement.empty? ? 0 : immediateValue(displacement)
+            if value.nil?
+                bytes += 4
+            elsif value != 0 or base =~ /\A%(rbp|r13)\z/
+                bytes += (-128..127).include?(value) ? 1 : 4
+            end
+            bytes += 1 if index or base =~ /\A%(rsp|r12)\z/
+            bytes += 4 if base.nil?
+        end
+
+        if operands =~ /\$([^,\s]+)/
+            value = immediateValue($1)
+            if mnemonic =~ /\A(sal|sar|shl|shr|rol|ror)/
+                bytes += value == 1 ? 0 : 1
+            elsif mnemonic =~ /\A[a-z]+b\z/
+                bytes += 1
+            elsif mnemonic =~ /\Amovl?\z/ and operands =~ /, %\w+\z/
+                # The register is in the opcode: no ModRM.
+                bytes += 3
+            elsif mnemonic =~ /\A(mov|test)/ or value.nil? or not (-128..127).include?(value)
+                # Without ModRM when the other operand is the accumulator.
+                bytes += operands =~ /, %[re]?ax\z/ && mnemonic !~ /\Amov/ ? 3 : 4
+            else
+                bytes += 1
+            end
+        end
+        bytes
+    end
+
+    def write(fileName)
+        columns = COLUMNS + (@models.empty? ? [] : MODEL_COLUMNS)
+        File.open(fileName, "w") {
+            | outp |
+            if fileName.end_with?(".json")
+                outp.puts JSON.pretty_generate(@rows)
+            else
+                outp.puts columns.join(",")
+                @rows.each { | row | outp.puts columns.map { | column | row[column] }.join(",") }
+            end
+        }
+    end
+
+    # A budget file has one budget per line, a label (or a File.fnmatch pattern
+    # of labels) and limits for any of the metrics:
+    #
+    #     llint_op_add bytes=512 instructions=100
+    #     llint_op_*_wide32 spills=4
+    #     llint_op_get_by_id cycles=40 load_chain=3
+    #
+    # Limits on critical_path, cycles and load_chain need a --machine-model.
+    #
+    # Returns [pattern, [[metric, limit]...], where] for every budget, or raises
+    # on a line that is not one.
+    def self.readBudgets(fileName)
+        budgets = []
+        IO::read(fileName).each_line.with_index(1) {
+            | line, lineNumber |
+            fields = line.sub(/#.*/, "").split
+            next if fields.empty?
+            where = "#{fileName}:#{lineNumber}"
+            pattern = fields.shift
+            limits = fields.map {
+                | field |
+                metric, limit = field.split("=", 2)
+                raise "#{where}: bad limit #{field.inspect}; limits look like bytes=512, for any of #{(METRICS + MODEL_METRICS).join(", ")}" unless (METRICS + MODEL_METRICS).include?(metric) and limit =~ /\A\d+\z/
+                [metric, limit.to_i]
+            }
+            raise "#{where}: #{pattern} has no limits" if limits.empty?
+            budgets << [pattern, limits, where]
+        }
+        budgets
+    end
+
+    # An error message for every row over a limit of a budget that matches its
+    # label, and a warning for every budget that matches no label at all.
+    def overBudget(budgets)
+        errors = []
+        warnings = []
+        budgets.each {
+            | pattern, limits, where |
+            rows = @rows.select { | row | File.fnmatch(pattern, row["label"]) }
+            warnings << "#{where}: #{pattern} matches no label" if rows.empty?
+            rows.each {
+                | row |
+                limits.each {
+                    | metric, limit |
+                    # Rows of backends no model was given for have no estimate.
+                    next unless row[metric] and row[metric] > limit
+                    errors << "#{row["label"]} (#{row["backend"]}) has #{row[metric]} #{metric}, over its budget of #{limit} at #{where}"
+                }
+            }
+        }
+        [errors, warnings]
+    end
+end
@@ -0,0 +1,221 @@
+$: << File.dirname(__FILE__)
+
+require "optparse"
+require "server_protocol"
+require "stringio"
+
+#
+# Usage: server.rb --socket=<path> [--poll=<seconds>]
+#        server.rb --socket=<path> --send (assemble <asm.rb arguments>... | status | shutdown)
+#
+# Serves asm.rb from one long-running process, so that generating
+# LLIntAssembly.h no longer starts Ruby and parses the .asm files every time;
+# see server_protocol.rb for the requests. The parsed sources (with their
+# settings combinations) and the offsets read from each extractor stay in
+# memory. Every --poll seconds the server looks at the files they came from:
+# a source that changed is parsed again, offsets that changed are read again,
+# and then only the outputs made from what changed are generated again.
+# Outputs whose contents would come out the same are left alone, as asm.rb
+# leaves them.
+#
+# With --send, sends one request to the server and prints its log; build.rb
+# sends its asm.rb stage to the server whenever OFFLINEASM_SERVER names its
+# socket.
+#
+
+class AssemblyServer
+    def initialize(pollInterval)
+        @pollInterval = pollInterval
+        @lock = Mutex.new
+        # [directory, asmFile, include directories, WebKitAdditions path] => [ParsedAssembly, signatures]
+        @parsed = {}
+        # [directory, offsetsFile, variants] => [configurationList, signatures]
+        @offsets = {}
+        # [directory, outputFlnm] => [arguments, signatures of what it was made from]
+        @targets = {}
+        # asm.rb sets these for the C_LOOP, and they must not carry over to the next request.
+        @defaultGlobals = [$enableDebugAnnotations, $preferredCommentStartColumn]
+        @stopping = false
+    end
+
+    # What changing a file changes: its size and modification time, or nil if
+    # it is gone. Files are kept by absolute path, as the server's working
+    # directory is not that of the requests.
+    def self.signatures(files)
+        files.map {
+            | file |
+            file = File.expand_path(file)
+            stat = File.stat(file) rescue nil
+            [file, stat && [stat.mtime.to_f, stat.size]]
+        }
+    end
+
+    def self.changed?(signatures)
+        signatures != AssemblyServer.signatures(signatures.map { | file, | file })
+    end
+
+    def serve(socketPath)
+        File.delete(socketPath) if File.socket?(socketPath)
+        server = UNIXServer.new(socketPath)
+        $stderr.puts "offlineasm server: listening on #{socketPath}"
+        watcher = Thread.new {
+            until @stopping
+                sleep @pollInterval
+                @lock.synchronize { refresh }
+            end
+        }
+        until @stopping
+            client = server.accept
+            begin
+                request = readServerMessage(client)
+                writeServerMessage(client, @lock.synchronize { handle(request) })
+            rescue => e
+                writeServerMessage(client, { "status" => "error", "message" => e.message }) rescue nil
+            ensure
+                client.close
+            end
+        end
+        watcher.kill
+        server.close
+        File.delete(socketPath)
+    end
+
+    def handle(request)
+        case request["command"]
+        when "assemble"
+            run(File.expand_path(request["directory"] || Dir.pwd), request["arguments"] || [])
+        when "status"
+            {
+                "status" => "ok",
+                "sources" => @parsed.map { | key, (parsed, signatures) | { "directory" => key[0], "asmFile" => key[1], "files" => signatures.size } },
+                "targets" => @targets.keys.map { | directory, outputFlnm | File.expand_path(outputFlnm, directory) },
+            }
+        when "shutdown"
+            @stopping = true
+            { "status" => "ok" }
+        else
+            { "status" => "error", "message" => "unknown command #{request["command"].inspect}" }
+        end
+    end
+
+    # Does the assemble request directory, arguments, taking the sources and the
+    # offsets from memory where they have not changed.
+    def run(directory, arguments)
+        log = StringIO.new
+        savedStderr = $stderr
+        $stderr = log
+        target = nil
+        Dir.chdir(directory) {
+            begin
+                remaining = arguments.dup
+                IncludeFile.resetIncludeDirs
+                includeDirs = remaining.take_while { | argument | argument =~ /^-I/ }
+                IncludeFile.processIncludeOptions(remaining)
+                raise "expected asmFile offsetsFile outputFileName variants" if remaining.size < 4
+                asmFile, offsetsFile, outputFlnm, variants = remaining.shift(4)
+                target = [directory, outputFlnm]
+                variants = variants.split(/[,\s]+/)
+                processAssemblyOptions(remaining)
+                $enableDebugAnnotations, $preferredCommentStartColumn = @defaultGlobals
+                $activeCPUFeatures = []
+                $uniqueMacroVarID = 0
+
+                parsedKey = [directory, asmFile, includeDirs, $options[:webkit_additions_path]]
+                parsed, sourceSignatures = @parsed[parsedKey]
+                if not parsed or AssemblyServer.changed?(sourceSignatures)
+                    LocalLabel.restoreUniqueNames([{}, 0])
+                    parsed = parseAssembly(asmFile, $options)
+                    sourceSignatures = AssemblyServer.signatures(parsed.sources.to_a)
+                    @parsed[parsedKey] = [parsed, sourceSignatures]
+                end
+
+                offsetsKey = [directory, offsetsFile, variants]
+                configurationList, offsetsSignatures = @offsets[offsetsKey]
+                if not configurationList or AssemblyServer.changed?(offsetsSignatures)
+                    offsetsFiles = variants.map { | variant | variant == "normal" ? offsetsFile : "#{offsetsFile}_#{variant}" }
+                    offsetsSignatures = AssemblyServer.signatures(offsetsFiles)
+                    begin
+                        configurationList = offsetsAndConfigurationIndexForVariants(offsetsFile, variants)
+                    rescue MissingMagicValuesException
+                        $stderr.puts "offlineasm: No magic values found in #{offsetsFile}. Skipping assembly file generation."
+                        exit 1
+                    end
+                    @offsets[offsetsKey] = [configurationList, offsetsSignatures]
+                end
+
+                written = assemble(asmFile, configurationList, outputFlnm, parsed)
+                inputs = sourceSignatures + offsetsSignatures
+                inputs += AssemblyServer.signatures([$options[:profile]]) if $options[:profile]
+                inputs += AssemblyServer.signatures([$options[:budget]]) if $options[:budget]
+                @targets[target] = [arguments, inputs]
+                { "status" => "ok", "written" => written, "log" => log.string }
+            rescue SystemExit, StandardError => e
+                # Keep watching what the output was made from before, so that fixing
+                # the error brings it up to date again.
+                if target and @targets[target]
+                    @targets[target] = [arguments, AssemblyServer.signatures(@targets[target][1].map { | file, | file })]
+                end
+                message = e.is_a?(SystemExit) ? "asm.rb exited with #{e.status}" : e.message
+                { "status" => "error", "message" => message, "log" => log.string }
+            ensure
+                $stderr = savedStderr
+            end
+        }
+    end
+
+    # Generates again the outputs made from a file that changed since.
+    def refresh
+        @targets.to_a.each {
+            | (directory, outputFlnm), (arguments, inputs) |
+            next unless AssemblyServer.changed?(inputs)
+            reply = run(directory, arguments)
+            $stderr.print reply["log"]
+            if reply["status"] == "ok"
+                $stderr.puts "offlineasm server: #{reply["written"] ? "regenerated" : "unchanged:"} #{outputFlnm}"
+            else
+                $stderr.puts "offlineasm server: #{outputFlnm}: #{reply["message"]}"
+            end
+        }
+    end
+end
+
+if __FILE__ == $0
+    socketPath = nil
+    pollInterval = 0.5
+    send = false
+    OptionParser.new do |opts|
+        opts.banner = "Usage: server.rb --socket=<path> [--poll=<seconds>] [--send (assemble <arguments>... | status | shutdown)]"
+        opts.on("--socket=PATH", "The Unix domain socket to listen on, or send to.") do |path|
+            socketPath = path
+        end
+        opts.on("--poll=SECONDS", Float, "How often to look for changed sources and offsets.") do |seconds|
+            pollInterval = seconds
+        end
+        opts.on("--send", "Send the request that follows to the server and print its log.") do
+            send = true
+        end
+    end.order!
+
+    unless socketPath
+        $stderr.puts "offlineasm: server.rb needs --socket"
+        exit 1
+    end
+
+    unless send
+        # Only the server needs asm.rb; a client starts as quickly as Ruby does.
+        require "asm"
+        AssemblyServer.new(pollInterval).serve(socketPath)
+        exit 0
+    end
+
+    command = ARGV.shift
+    request = { "command" => command }
+    request.merge!("directory" => Dir.pwd, "arguments" => ARGV) if command == "assemble"
+    reply = serverRequest(socketPath, request)
+    $stderr.print reply["log"] if reply["log"]
+    if reply["status"] != "ok"
+        $stderr.puts "offlineasm server: #{reply["message"]}"
+        exit 1
+    end
+    puts JSON.pretty_generate(reply) if command == "status"
+end
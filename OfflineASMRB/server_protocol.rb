@@ -0,0 +1,45 @@
+require "json"
+require "socket"
+
+#
+# The protocol of server.rb: over a Unix domain socket, the client writes one
+# request as a line of JSON and reads one reply the same way.
+#
+#     {"command": "assemble", "directory": <dir>, "arguments": [<asm.rb arguments>...]}
+#         Does what ruby asm.rb <arguments> run in <dir> would. The reply has
+#         "written", whether the output had to be written, and "log", whatever
+#         asm.rb would have printed. The server remembers the request and does it
+#         again whenever one of the files it read changes.
+#     {"command": "status"}
+#         Lists what the server keeps: "sources", the parsed .asm files, and
+#         "targets", the outputs it keeps up to date.
+#     {"command": "shutdown"}
+#         Replies, then stops the server.
+#
+# Every reply has "status", "ok" or "error"; an error has "message" too.
+#
+
+def writeServerMessage(socket, message)
+    socket.write(JSON.generate(message) + "\n")
+    socket.flush
+end
+
+def readServerMessage(socket)
+    line = socket.gets
+    raise "offlineasm server: connection closed" unless line
+    JSON.parse(line)
+end
+
+#
+# serverRequest(socketPath, request) -> reply
+#
+# Sends request to the server listening on socketPath and waits for its reply.
+#
+
+def serverRequest(socketPath, request)
+    UNIXSocket.open(socketPath) {
+        | socket |
+        writeServerMessage(socket, request)
+        readServerMessage(socket)
+    }
+end
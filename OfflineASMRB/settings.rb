@@ -35,23 +35,73 @@ require "transform"
 # contains key value pairs where keys are settings names (strings) and
 # the values are booleans (true for enabled, false for disabled).
 #
+# Only settings that resolving the AST would actually consult, given the
+# backend and the values already chosen, get a value. A setting tested only
+# under "if X86_64" therefore does not double the ARM64 combinations, and the
+# C++ test for a combination leaves out the settings it does not depend on.
+#
+
+# Settings that backends read from $currentSettings while lowering, and that
+# therefore tell their combinations apart even where the AST does not test them.
+LOWERING_SETTINGS = {
+    "ARM64" => ["ADDRESS64"],
+    "ARM64E" => ["ADDRESS64"],
+}
+
+class UnresolvedSettingException < Exception
+    attr_reader :name
+
+    def initialize(name)
+        super "setting #{name} has no value yet"
+        @name = name
+    end
+end
+
+# The parts of an AST that resolveSettings looks settings up in, nested as
+# resolveSettings visits them: [[condition, thenTree, elseTree], ...].
+def settingsDecisionTree(node)
+    case node
+    when IfThenElse
+        [[node.predicate, settingsDecisionTree(node.thenCase), settingsDecisionTree(node.elseCase)]]
+    when Setting, And, Or, Not
+        [[node, [], []]]
+    else
+        node.children.map { | child | settingsDecisionTree(child) }.flatten(1)
+    end
+end
+
+def walkSettingsDecisionTree(tree, settings)
+    tree.each {
+        | condition, thenTree, elseTree |
+        walkSettingsDecisionTree(condition.resolveSettings(settings).value ? thenTree : elseTree, settings)
+    }
+end
 
 def computeSettingsCombinations(ast)
     settingsCombinations = []
     
-    def settingsCombinator(settingsCombinations, mapSoFar, remaining)
-        if remaining.empty?
+    def settingsCombinator(settingsCombinations, tree, mapSoFar, forced)
+        name = forced.find { | setting | not mapSoFar.has_key? setting }
+        unless name
+            begin
+                walkSettingsDecisionTree(tree, mapSoFar)
+            rescue UnresolvedSettingException => e
+                name = e.name
+            end
+        end
+        unless name
+            mapSoFar.default_proc = nil
             settingsCombinations << mapSoFar
             return
         end
         
         newMap = mapSoFar.dup
-        newMap[remaining[0]] = true
-        settingsCombinator(settingsCombinations, newMap, remaining[1..-1])
+        newMap[name] = true
+        settingsCombinator(settingsCombinations, tree, newMap, forced)
         
         newMap = mapSoFar.dup
-        newMap[remaining[0]] = false
-        settingsCombinator(settingsCombinations, newMap, remaining[1..-1])
+        newMap[name] = false
+        settingsCombinator(settingsCombinations, tree, newMap, forced)
     end
     
     nonBackendSettings = ast.filter(Setting).uniq.collect{ |v| v.name }
@@ -59,8 +109,9 @@ def computeSettingsCombinations(ast)
         | setting |
         isBackend? setting
     }
+    tree = settingsDecisionTree(ast)
     
-    allBackendsFalse = {}
+    allBackendsFalse = Hash.new { | map, name | raise UnresolvedSettingException.new(name) }
     BACKENDS.each {
         | backend |
         allBackendsFalse[backend] = false
@@ -74,7 +125,7 @@ def computeSettingsCombinations(ast)
         | backend |
         map = allBackendsFalse.clone
         map[backend] = true
-        settingsCombinator(settingsCombinations, map, nonBackendSettings)
+        settingsCombinator(settingsCombinations, tree, map, (LOWERING_SETTINGS[backend] || []) & nonBackendSettings)
     }
     
     settingsCombinations
@@ -127,7 +178,7 @@ def forEachValidSettingsCombination(ast, *optionalSettingsCombinations)
     if optionalSettingsCombinations.empty?
         settingsCombinations = computeSettingsCombinations(ast)
     else
-        settingsCombinations = optionalSettingsCombiations[0]
+        settingsCombinations = optionalSettingsCombinations[0]
     end
     
     settingsCombinations.each_with_index {
@@ -208,12 +259,15 @@ end
 # emitCodeInAllConfigurations(ast) {
 #     | concreteSettings, ast, backend, index | ... }
 #
+# emitCodeInAllConfigurations(ast, settingsCombinations) {
+#     | concreteSettings, ast, backend, index | ... }
+#
 # Emits guard codes for all valid configurations, and calls the block
 # for those configurations that are valid and not erroneous.
 #
 
-def emitCodeInAllConfigurations(ast)
-    forEachValidSettingsCombination(ast) {
+def emitCodeInAllConfigurations(ast, *optionalSettingsCombinations)
+    forEachValidSettingsCombination(ast, *optionalSettingsCombinations) {
         | concreteSettings, lowLevelAST, backend, index |
         $output.puts cppSettingsTest(concreteSettings)
         yield concreteSettings, lowLevelAST, backend, index
@@ -0,0 +1,86 @@
+require "digest/sha1"
+require "fileutils"
+require "pathname"
+
+#
+# StageCache
+#
+# A content-addressed store for the outputs of build stages. A stage's key is
+# the SHA1 of everything its outputs depend on: input hashes, the assembler's
+# selfHash, the backend and options. Outputs are stored under that key, so a
+# stage whose key is unchanged can be skipped by copying them back, even into a
+# build directory that was wiped in between.
+#
+
+class StageCache
+    attr_reader :directory
+
+    def initialize(directory)
+        @directory = Pathname.new(directory)
+    end
+
+    def self.key(stageName, parts)
+        Digest::SHA1.hexdigest(([stageName] + parts).join("\0"))
+    end
+
+    def entry(key)
+        @directory + key[0, 2] + key
+    end
+
+    # Copies the outputs cached under key into place. Returns false, touching
+    # nothing, unless every output is in the cache. Outputs that already have the
+    # cached contents are left alone so their timestamps do not change.
+    def restore(key, outputs)
+        cached = outputs.map { | output | entry(key) + File.basename(output) }
+        return false unless cached.all? { | file | file.file? }
+        outputs.zip(cached).each {
+            | output, file |
+            next if File.file?(output) and FileUtils.compare_file(output, file)
+            FileUtils.mkdir_p(File.dirname(output))
+            FileUtils.cp(file, output, :preserve => true)
+        }
+        true
+    end
+
+    # Stages the entry in a temporary directory and renames it into place, so a
+    # concurrent or interrupted build never sees half of one.
+    def store(key, outputs)
+        FileUtils.mkdir_p(entry(key).dirname)
+        temp = entry(key).dirname + "#{key}.#{Process.pid}.part"
+        FileUtils.rm_rf(temp)
+        FileUtils.mkdir_p(temp)
+        outputs.each {
+            | output |
+            FileUtils.cp(output, temp + File.basename(output), :preserve => true)
+        }
+        FileUtils.rm_rf(entry(key))
+        File.rename(temp, entry(key))
+    end
+end
+
+#
+# fileHash(fileName) -> SHA1 hexdigest
+#
+
+def fileHash(fileName)
+    Digest::SHA1.file(fileName).hexdigest
+end
+
+#
+# includeClosure(fileName) -> [fileName, ...]
+#
+# Returns the file and everything it transitively pulls in with a quoted
+# #include, resolved relative to the including file. Angle-bracket includes and
+# files that do not exist are ignored; they belong to the toolchain.
+#
+
+def includeClosure(fileName, result = [])
+    fileName = Pathname.new(fileName).cleanpath.to_s
+    return result if result.include?(fileName) or not File.file?(fileName)
+    result << fileName
+    IO::read(fileName).scan(/^\s*#\s*include\s+"([^"]+)"/) {
+        | match |
+        includeClosure(File.join(File.dirname(fileName), match[0]), result)
+    }
+    result
+end
@@ -0,0 +1,348 @@
+#
+# MachineModel
+#
+# With asm.rb --machine-model, a static estimate of how long each label's code
+# takes, from what its instructions depend on rather than from running it. The
+# code is taken in layout order as if no branch were taken, every instruction
+# issuing as soon as its operands are ready:
+#
+#     critical_path  cycles along the longest chain of dependent instructions,
+#                    with a load taking the model's load-to-use latency. A load
+#                    from where the code stored before waits for that store.
+#                    A call waits for everything before it and holds up
+#                    everything after.
+#     cycles         the estimated cycles per pass through the code: the larger
+#                    of critical_path and the cycles the model needs just to issue
+#                    the instructions, the loads and the stores.
+#     load_chain     the loads on the critical path whose value the next
+#                    instruction on it waits for, such as a reload of callee-saves
+#                    that the return then needs.
+#     chain          the critical path itself, as the source line and mnemonic of
+#                    each of its instructions.
+#
+# The models are approximations from the published pipeline descriptions of
+# each core, good for comparing two versions of a handler, not for predicting
+# its cycle count.
+#
+
+MachineModel = Struct.new(:name, :backends, :issueWidth, :loadPorts, :storePorts, :latencies)
+
+MACHINE_MODELS = [
+    MachineModel.new("cortex-a76", ["ARM64", "ARM64E"], 4, 2, 1,
+                     { :move => 1, :alu => 1, :mul => 3, :div => 12, :load => 4, :branch => 1, :fp => 3, :fpdiv => 10 }),
+    MachineModel.new("apple-m1", ["ARM64", "ARM64E"], 8, 3, 2,
+                     { :move => 1, :alu => 1, :mul => 3, :div => 9, :load => 4, :branch => 1, :fp => 3, :fpdiv => 10 }),
+    MachineModel.new("skylake", ["X86_64"], 4, 2, 1,
+                     { :move => 1, :alu => 1, :mul => 3, :div => 40, :load => 5, :branch => 1, :fp => 4, :fpdiv => 14 }),
+    MachineModel.new("zen3", ["X86_64"], 6, 3, 2,
+                     { :move => 1, :alu => 1, :mul => 3, :div => 20, :load => 4, :branch => 1, :fp => 3, :fpdiv => 13 }),
+    MachineModel.new("cortex-a15", ["ARMv7"], 3, 1, 1,
+                     { :move => 1, :alu => 1, :mul => 4, :div => 12, :load => 4, :branch => 1, :fp => 5, :fpdiv => 18 }),
+    MachineModel.new("sifive-u74", ["RISCV64"], 2, 1, 1,
+                     { :move => 1, :alu => 1, :mul => 3, :div => 20, :load => 3, :branch => 1, :fp => 5, :fpdiv => 20 }),
+].map { | model | [model.name, model] }.to_h
+
+#
+# DecodedInstruction
+#
+# What the estimate needs of one instruction: kind, which of the latencies it
+# takes (or :call), the registers it reads and writes ("flags" being the
+# condition flags), the memory it loads from and stores to, as the operand's
+# text and the registers in it, and the registers it writes back an address to.
+#
+
+DecodedInstruction = Struct.new(:kind, :uses, :defs, :load, :store, :writeback)
+
+class MachineModel
+    # Splits operands at the commas outside brackets, braces and parentheses.
+    def self.splitOperands(operands)
+        result = [""]
+        depth = 0
+        operands.to_s.each_char {
+            | char |
+            depth += 1 if "[{(".include?(char)
+            depth -= 1 if "]})".include?(char)
+            if char == "," and depth.zero?
+                result << ""
+            else
+                result[-1] += char
+            end
+        }
+        result.map(&:strip).reject(&:empty?)
+    end
+
+    def self.arm64Register(token)
+        case token
+        when /\A[xw](\d+)\z/ then "r#{$1}"
+        when /\Aw?sp\z/ then "sp"
+        when /\A[bhsdqv](\d+)(\.\w+)?\z/ then "v#{$1}"
+        end
+    end
+
+    def self.armv7Register(token)
+        case token
+        when /\Ar(\d+)\z/ then "r#{$1}"
+        when "ip" then "r12"
+        when "sp" then "r13"
+        when "lr" then "r14"
+        when /\Ad(\d+)\z/ then "d#{$1}"
+        when /\As(\d+)\z/ then "d#{$1.to_i / 2}"
+        when /\Aq(\d+)\z/ then "d#{$1.to_i * 2}"
+        when "APSR_nzcv" then "flags"
+        when "fpscr" then "fpscr"
+        end
+    end
+
+    RISCV64_ABI_REGISTERS = { "ra" => "x1", "sp" => "x2", "fp" => "x8", "s0" => "x8" }
+
+    def self.riscv64Register(token)
+        case token
+        when "zero", "x0" then nil
+        when /\A[xf]\d+\z/ then token
+        when /\A(ra|sp|fp|s0)\z/ then RISCV64_ABI_REGISTERS[token]
+        when /\A([ast]|f[ast])\d+\z/ then token
+        end
+    end
+
+    def self.x86Register(name)
+        case name
+        when /\A[re]?(ax|bx|cx|dx|si|di|bp|sp)\z/ then $1
+        when /\A([abcd])[lh]\z/ then "#{$1}x"
+        when /\A(si|di|bp|sp)l\z/ then $1
+        when /\A(r\d+)[dwb]?\z/ then $1
+        when /\A[xy]mm(\d+)\z/ then "xmm#{$1}"
+        end
+    end
+
+    def self.registers(backend, operand)
+        if backend == "X86_64"
+            operand.scan(/%(\w+)/).map { | name, | x86Register(name) }.compact
+        else
+            method = { "ARMv7" => :armv7Register, "RISCV64" => :riscv64Register }[backend] || :arm64Register
+            operand.scan(/[\w.]+/).map { | token | send(method, token) }.compact
+        end
+    end
+
+    # The kind of an instruction that neither loads, stores nor branches.
+    def self.computeKind(backend, mnemonic)
+        case backend
+        when "X86_64"
+            return :fpdiv if mnemonic =~ /\A(div|sqrt)[sp][sd]\z/
+            return :fp if mnemonic =~ /\A((add|sub|mul|min|max|round)[sp][sd]|cvt\w+|u?comis[sd])\z/
+            return :div if mnemonic =~ /\Ai?div/
+            return :mul if mnemonic =~ /\Ai?mul/
+            return :move if mnemonic =~ /\A(mov|lea)/
+        when "ARMv7"
+            return :fpdiv if mnemonic =~ /\Av(div|sqrt)/
+            return :move if mnemonic =~ /\A(vmov|vmrs|mov|mvn)/
+            return :fp if mnemonic =~ /\Av/
+            return :div if mnemonic =~ /\A[su]div/
+            return :mul if mnemonic =~ /\A(mul|mla|mls|[su]mull|[su]mlal|smmul)/
+        when "RISCV64"
+            return :fpdiv if mnemonic =~ /\Af(div|sqrt)/
+            return :move if mnemonic =~ /\A(mv|li|lui|auipc|fmv)/
+            return :fp if mnemonic =~ /\Af/
+            return :div if mnemonic =~ /\A(div|rem)/
+            return :mul if mnemonic =~ /\Amul/
+        else
+            return :fpdiv if mnemonic =~ /\Af(div|sqrt)/
+            return :move if mnemonic =~ /\A(mov|fmov)/
+            return :fp if mnemonic =~ /\A(f|[su]cvtf)/
+            return :div if mnemonic =~ /\A[su]div/
+            return :mul if mnemonic =~ /\A(mul|madd|msub|mneg|[su]mull|[su]mulh|[su]maddl|[su]msubl)/
+        end
+        :alu
+    end
+
+    # ARM64, ARMv7 and RISCV64 put the destination first.
+    def self.decodeDestinationFirst(backend, mnemonic, operands)
+        registersOf = lambda { | list | list.map { | operand | registers(backend, operand) }.flatten }
+        memoryIndex = operands.index { | operand | operand =~ /\A\[|\(/ }
+        memory = memoryIndex && [operands[memoryIndex], registers(backend, operands[memoryIndex])]
+        # Pre-indexed ([base, #n]!) or post-indexed ([base], #n) addressing
+        # writes the address back to the base.
+        writeback = (memoryIndex and (operands[memoryIndex].end_with?("!") or memoryIndex < operands.size - 1)) ? memory[1].take(1) : []
+        conditional = /\A(b\.\w+|b(eq|ne|cs|cc|hs|lo|mi|pl|vs|vc|hi|ls|ge|lt|gt|le))\z/
+
+        case backend
+        when "ARM64", "ARM64E"
+            call = /\A(bl|blr)\z/
+            branch = /\A(b|br|ret|cbn?z|tbn?z|brk|udf|hlt)\z/
+            store = /\Ast/
+            load = /\Ald/
+            compare = /\A(cmp|cmn|tst|ccmp|ccmn|fcmpe?|fccmpe?)\z/
+            setsFlags = /\A(adds|subs|ands|bics|adcs|sbcs|negs)\z/
+            usesFlags = /\A(csel|csinc|csinv|csneg|cset|csetm|cinc|cinv|cneg|adcs?|sbcs?|fcsel|ccmp|ccmn|fccmpe?)\z/
+            readsDestination = /\A(movk|bfi|bfxil|bfm|ins|fmla|fmls)\z/
+            link = ["r30"]
+        when "ARMv7"
+            call = /\A(bl|blx)\z/
+            branch = /\A(b|bx|bkpt|udf)\z/
+            store = /\A(str|vstr|vst1|stm|push|vpush)/
+            load = /\A(ldr|vldr|vld1|ldm|pop|vpop)/
+            compare = /\A(cmp|cmn|tst|teq|vcmpe?(\.f\d+)?)\z/
+            setsFlags = /\A(add|sub|rsb|adc|sbc|and|orr|eor|bic|mov|mvn|mul|lsl|lsr|asr|ror)s\z/
+            usesFlags = /\A(adcs?|sbcs?|rscs?)\z/
+            readsDestination = /\A(movt|bfi|bfc|vmla|vmls)/
+            link = ["r14"]
+        else
+            call = /\A(call|jal|jalr)\z/
+            branch = /\A(j|jr|ret|tail|ebreak|unimp|b(eq|ne|lt|ge|ltu|geu|gt|le|gtu|leu)|b(eq|ne|le|ge|lt|gt)z)\z/
+            store = /\A(s[bhwd]|fs[wd]|sc\.[wd])\z/
+            load = /\A(l[bhwd]u?|fl[wd]|lr\.[wd]|amo.*)\z/
+            compare = nil
+            setsFlags = usesFlags = readsDestination = nil
+            link = ["x1"]
+        end
+
+        case mnemonic
+        when call
+            DecodedInstruction.new(:call, registersOf.call(operands), [], nil, nil, [])
+        when conditional
+            uses = backend == "RISCV64" ? registersOf.call(operands) : ["flags"]
+            DecodedInstruction.new(:branch, uses, [], nil, nil, [])
+        when branch
+            uses = registersOf.call(operands)
+            uses = link if mnemonic == "ret" and uses.empty?
+            DecodedInstruction.new(:branch, uses, [], nil, nil, [])
+        when /\A(v?push|v?pop)\z/
+            registers = registersOf.call(operands)
+            if mnemonic =~ /push/
+                DecodedInstruction.new(:move, registers + ["r13"], [], nil, ["push", []], ["r13"])
+            else
+                DecodedInstruction.new(:move, ["r13"], registers, ["pop", []], nil, ["r13"])
+            end
+        when store
+            uses = registersOf.call(operands)
+            memory ||= [operands[-1].to_s, uses.take(1)]
+            DecodedInstruction.new(:move, uses, [], nil, memory, writeback)
+        when load
+            data = memoryIndex ? operands[0...memoryIndex] : operands.take(1)
+            memory ||= [operands[1..-1].join(","), []]
+            DecodedInstruction.new(:move, memory[1], registersOf.call(data), memory, nil, writeback)
+        when compare
+            uses = registersOf.call(operands)
+            uses << "flags" if usesFlags and mnemonic =~ usesFlags
+            DecodedInstruction.new(computeKind(backend, mnemonic), uses, [mnemonic =~ /\Av/ ? "fpscr" : "flags"], nil, nil, [])
+        else
+            destinations = mnemonic =~ /\A[su]m(ull|lal)\z/ ? 2 : 1
+            defs = registersOf.call(operands.take(destinations))
+            uses = registersOf.call(operands.drop(destinations))
+            uses += defs if readsDestination and mnemonic =~ readsDestination
+            uses << "flags" if usesFlags and mnemonic =~ usesFlags
+            defs += ["flags"] if setsFlags and mnemonic =~ setsFlags
+            DecodedInstruction.new(computeKind(backend, mnemonic), uses, defs, nil, nil, [])
+        end
+    end
+
+    # X86_64, in AT&T syntax, puts the destination last.
+    def self.decodeX86(mnemonic, operands)
+        memoryOperand = operands.find { | operand | operand.include?("(") }
+        memory = memoryOperand && [memoryOperand, registers("X86_64", memoryOperand)]
+        registersOf = lambda { | list | list.map { | operand | registers("X86_64", operand) }.flatten }
+        destination = operands[-1]
+        sources = operands[0...-1]
+        destinationIsMemory = (destination and destination.include?("("))
+
+        case mnemonic
+        when "call"
+            return DecodedInstruction.new(:call, registersOf.call(operands), [], nil, nil, [])
+        when "jmp", "ret", "ud2", "int", "int3", "hlt"
+            return DecodedInstruction.new(:branch, registersOf.call(operands) + (mnemonic == "ret" ? ["sp"] : []), [], nil, nil, [])
+        when /\Aj/
+            return DecodedInstruction.new(:branch, ["flags"], [], nil, nil, [])
+        when /\Apush/
+            return DecodedInstruction.new(:move, registersOf.call(operands) + ["sp"], [], nil, ["push", []], ["sp"])
+        when /\Apop/
+            return DecodedInstruction.new(:move, ["sp"], registersOf.call(operands), ["pop", []], nil, ["sp"])
+        when "cqto", "cltd"
+            return DecodedInstruction.new(:alu, ["ax"], ["dx"], nil, nil, [])
+        when "cltq"
+            return DecodedInstruction.new(:alu, ["ax"], ["ax"], nil, nil, [])
+        when /\Ai?div[bwlq]?\z/, /\Amul[bwlq]?\z/
+            return DecodedInstruction.new(computeKind("X86_64", mnemonic), ["ax", "dx"] + registersOf.call(operands), ["ax", "dx", "flags"], memory, nil, [])
+        when /\A(cmp|test|bt|u?comis)/
+            kind = computeKind("X86_64", mnemonic)
+            return DecodedInstruction.new(kind, registersOf.call(operands), ["flags"], memory, nil, [])
+        when /\Alea/
+            return DecodedInstruction.new(:alu, memory ? memory[1] : [], registersOf.call([destination]), nil, nil, [])
+        end
+
+        kind = computeKind("X86_64", mnemonic)
+        # A move, conversion or set writes its destination without reading it.
+        writesOnly = mnemonic =~ /\A(mov|cvt|set|pmov|lzcnt|tzcnt|popcnt|bsf|bsr)/
+        uses = registersOf.call(sources)
+        uses += ["flags"] if mnemonic =~ /\A(set|cmov|adc|sbb)/
+        if destinationIsMemory
+            return DecodedInstruction.new(kind, (uses + memory[1]).uniq, writesOnly ? [] : ["flags"], writesOnly ? nil : memory, memory, [])
+        end
+        defs = registersOf.call([destination])
+        # xor %eax, %eax and the like depend on nothing.
+        zeroing = mnemonic =~ /\A(xor|sub|pxor|xorp[sd])/ and sources == [destination]
+        uses += defs unless writesOnly or zeroing
+        uses = [] if zeroing
+        uses += memory[1] if memory
+        defs += ["flags"] unless writesOnly or kind == :fp or mnemonic =~ /\Amov/
+        DecodedInstruction.new(kind, uses.uniq, defs, memory, nil, [])
+    end
+
+    def self.decode(backend, instruction)
+        mnemonic, operands = instruction.split(/\s+/, 2)
+        operands = splitOperands(operands)
+        backend == "X86_64" ? decodeX86(mnemonic, operands) : decodeDestinationFirst(backend, mnemonic, operands)
+    end
+
+    def latency(decoded)
+        return latencies[:branch] if decoded.kind == :call
+        return latencies[:load] + (decoded.kind == :move ? 0 : latencies[decoded.kind]) if decoded.load
+        latencies[decoded.kind]
+    end
+
+    # The estimate for instructions, [text, source location] pairs as
+    # HandlerReport.instructions returns them, on backend.
+    def estimate(backend, instructions)
+        # register => [cycle its value is ready, index of the instruction that made it]
+        ready = Hash.new([0, nil])
+        # How many times each register was written, to tell addresses apart.
+        versions = Hash.new(0)
+        # memory operand => [cycle the store to it is done, index of the store]
+        stored = {}
+        barrier = [0, nil]
+        nodes = []
+        loads = stores = 0
+        instructions.each_with_index {
+            | (text, location), index |
+            decoded = MachineModel.decode(backend, text)
+            memoryKey = lambda { | memory | memory && [memory[0]] + memory[1].map { | register | versions[register] } }
+            inputs = decoded.uses.map { | register | ready[register] } + [barrier]
+            if decoded.kind == :call and not nodes.empty?
+                inputs << [nodes.map { | node | node[:finish] }.max, nodes.each_index.max_by { | node | nodes[node][:finish] }]
+            end
+            inputs << stored[memoryKey.call(decoded.load)] if decoded.load and stored[memoryKey.call(decoded.load)]
+            start, predecessor = inputs.max_by { | cycle, | cycle }
+            finish = start + latency(decoded)
+            loadChain = predecessor ? nodes[predecessor][:loadChain] + (nodes[predecessor][:load] ? 1 : 0) : 0
+            nodes << { :finish => finish, :predecessor => predecessor, :loadChain => loadChain, :load => !!decoded.load,
+                       :step => "#{location} #{text.split(/\s+/, 2)[0]}".strip }
+            loads += 1 if decoded.load
+            stores += 1 if decoded.store
+            stored[memoryKey.call(decoded.store)] = [finish, index] if decoded.store
+            decoded.writeback.each { | register | ready[register] = [start + latencies[:alu], index] }
+            decoded.defs.each { | register | ready[register] = [finish, index] }
+            (decoded.defs + decoded.writeback).each { | register | versions[register] += 1 }
+            barrier = [finish, index] if decoded.kind == :call
+        }
+        return { "critical_path" => 0, "cycles" => 0, "load_chain" => 0, "chain" => "" } if nodes.empty?
+
+        last = nodes.each_index.max_by { | index | [nodes[index][:finish], index] }
+        chain = []
+        index = last
+        while index
+            chain.unshift(nodes[index][:step])
+            index = nodes[index][:predecessor]
+        end
+        criticalPath = nodes[last][:finish]
+        issue = [(nodes.size.to_f / issueWidth).ceil, (loads.to_f / loadPorts).ceil, (stores.to_f / storePorts).ceil].max
+        { "critical_path" => criticalPath, "cycles" => [criticalPath, issue].max, "load_chain" => nodes[last][:loadChain], "chain" => chain.join(" > ") }
+    end
+end
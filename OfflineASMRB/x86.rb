@@ -879,6 +879,11 @@ class Instruction
     end
 
     def countLeadingZeros(kind)
+        if cpuFeatureActive?("bmi")
+            $asm.puts "lzcnt#{x86Suffix(kind)} #{x86Operands(kind, kind)}"
+            return
+        end
+
         target = operands[1]
         srcIsNonZero = LocalLabel.unique(codeOrigin, "srcIsNonZero")
         skipNonZeroCase = LocalLabel.unique(codeOrigin, "skipNonZeroCase")
@@ -901,6 +906,11 @@ class Instruction
     end
 
     def countTrailingZeros(kind)
+        if cpuFeatureActive?("bmi")
+            $asm.puts "tzcnt#{x86Suffix(kind)} #{x86Operands(kind, kind)}"
+            return
+        end
+
         target = operands[1]
         srcIsNonZero = LocalLabel.unique(codeOrigin, "srcIsNonZero")
         zeroValue = Immediate.new(codeOrigin, x86Bytes(kind) * 8)
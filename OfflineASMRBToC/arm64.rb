@@ -372,7 +372,8 @@ class Address
     end
     
     def arm64PairAddressOperand(kind)
-        raise "Invalid offset #{offset.value} at #{codeOriginString}" if offset.value < -512 or offset.value > 504
+        range = kind == :vector_with_interpretation ? (-1024..1008) : (-512..504)
+        raise "Invalid offset #{offset.value} at #{codeOriginString}" unless range.include? offset.value
         "[#{base.arm64Operand(:quad)}, \##{offset.value}]"
     end
 
@@ -444,8 +445,13 @@ end
 def isMalformedArm64LoadStorePairAddress(opcode, operand)
     malformed = false
     if operand.is_a? Address
-        malformed ||= (not (-512..504).include? operand.offset.value)
-        malformed ||= (not (operand.offset.value % 8).zero?)
+        if opcode =~ /v$/
+            malformed ||= (not (-1024..1008).include? operand.offset.value)
+            malformed ||= (not (operand.offset.value % 16).zero?)
+        else
+            malformed ||= (not (-512..504).include? operand.offset.value)
+            malformed ||= (not (operand.offset.value % 8).zero?)
+        end
     end
     malformed
 end
@@ -595,6 +601,9 @@ class Sequence
             when "loadpairq", "storepairq", "loadpaird", "storepaird"
                 size = 16
                 isLoadStorePairOp = true
+            when "loadpairv", "storepairv"
+                size = 32
+                isLoadStorePairOp = true
             else
                 raise "Bad instruction #{node.opcode} for heap access at #{node.codeOriginString}: #{node.dump}"
             end
@@ -1680,6 +1689,10 @@ class Instruction
             $asm.puts "ldp #{operands[1].arm64Operand(:double)}, #{operands[2].arm64Operand(:double)}, #{operands[0].arm64PairAddressOperand(:double)}"
         when "storepaird"
             $asm.puts "stp #{operands[0].arm64Operand(:double)}, #{operands[1].arm64Operand(:double)}, #{operands[2].arm64PairAddressOperand(:double)}"
+        when "loadpairv"
+            $asm.puts "ldp #{operands[1].arm64Operand(:vector_with_interpretation)}, #{operands[2].arm64Operand(:vector_with_interpretation)}, #{operands[0].arm64PairAddressOperand(:vector_with_interpretation)}"
+        when "storepairv"
+            $asm.puts "stp #{operands[0].arm64Operand(:vector_with_interpretation)}, #{operands[1].arm64Operand(:vector_with_interpretation)}, #{operands[2].arm64PairAddressOperand(:vector_with_interpretation)}"
 
         ########
         # SIMD #
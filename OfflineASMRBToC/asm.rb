@@ -53,7 +53,7 @@ File.open(outputFlnm, "w") {
     sources = Set.new
     ast = parse(asmFile, $options, sources)
     
-    ast = ast.cpp $options
+    ast = ast.cppTopLevel $options
     # require 'pry'; binding.pry
 
     $output.puts(%{
@@ -61,8 +61,10 @@ File.open(outputFlnm, "w") {
       Code body() {
         CodeCollectionScope _;
         #{ast}
+        joinParallelGeneration();
         return _.code();
       }
+      OFFLINE_ASM_REGISTER_BODY(body)
       })
     $output.fsync
 }
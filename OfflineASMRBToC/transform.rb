@@ -23,6 +23,22 @@
 
 require "config"
 require "ast"
+require "set"
+
+# The names a variable passed to a macro can be bound to in the generated C++:
+# constants, named macros, and the parameters of the macros it is passed in. Any
+# other name is a label, which offlineasm passes to a macro by name (as in
+# op(ipint_entry, ...)), so it is passed as a string.
+$cppNames = [Set.new]
+
+# A label name as a C++ expression. Names with %variable% in them are spliced
+# together from the strings the macro was called with, as in _%label%_wide16.
+def cppLabelName(name)
+  pieces = name.split(/%([a-zA-Z0-9_]+)%/, -1)
+  return %{"#{name}"} if pieces.size == 1
+  pieces = pieces.each_with_index.map { | piece, index | index.odd? ? piece : %{"#{piece}"} }
+  %{std::string(#{pieces[0]}) + #{pieces[1..].join(" + ")}}
+end
 
 class AbsoluteAddress
   def cpp(settings)
@@ -32,7 +48,7 @@ end
 
 class AddImmediates
   def cpp(settings)
-    %{#{@left.cpp(settings)} + #{@right.cpp(settings)}}
+    %{(#{@left.cpp(settings)} + #{@right.cpp(settings)})}
   end
 end
 
@@ -44,13 +60,13 @@ end
 
 class And
   def cpp(settings)
-    %{#{@left.cpp(settings)} && #{@right.cpp(settings)}}
+    %{(#{@left.cpp(settings)} && #{@right.cpp(settings)})}
   end
 end
 
 class AndImmediates
   def cpp(settings)
-    %{#{@left.cpp(settings)} & #{@right.cpp(settings)}}
+    %{(#{@left.cpp(settings)} & #{@right.cpp(settings)})}
   end
 end
 
@@ -62,12 +78,13 @@ end
 
 class BitnotImmediate
   def cpp(settings)
-    %{~#{@child.cpp(settings)}}
+    %{(~#{@child.cpp(settings)})}
   end
 end
 
 class ConstDecl
   def cpp(settings)
+    $cppNames[-1] << @variable.name
     %{const auto #{@variable.cpp(settings)} = #{@value.cpp(settings)}}
   end
 end
@@ -90,6 +107,12 @@ class FPRegisterID
   end
 end
 
+class VecRegisterID
+  def cpp(settings)
+    %{#{@name}}
+  end
+end
+
 class False
   def cpp(settings)
     %{false}
@@ -142,7 +165,7 @@ end
 
 class Label
   def cpp(settings)
-    %{auto #{name.gsub(/[^a-zA-Z0-9_]/, '_')} = label("#{name}")#{@definedInFile ? '->inFile()' : ''}#{@global ? '->global()' : ''}#{@aligned ? ".aligned(#{@alignTo})" : ''}#{@extern ? '->extern_()' : ''}}
+    %{auto #{name.gsub(/[^a-zA-Z0-9_]/, '_')} = ::label(#{cppLabelName(name)})#{@definedInFile ? '->inFile()' : ''}#{@global ? '->global()' : ''}#{@aligned ? ".aligned(#{@alignTo})" : ''}#{@extern ? '->extern_()' : ''}}
   end
 end
 
@@ -154,7 +177,7 @@ end
 
 class LocalLabel
   def cpp(settings)
-    %{label("#{name}")}
+    %{::label(#{cppLabelName(name)})}
   end
 end
 
@@ -166,33 +189,53 @@ end
 
 class Macro
   def cpp(settings)
-    (@name.nil? ? "" : %{auto #{@name} = }) +
-    %{[&](#{@variables.map { |var| %{auto #{var.cpp(settings)}} }.join(', ')}) -> Code {
+    variables = @variables.map { |var| var.cpp(settings) }
+    $cppNames[-1] << @name if @name
+    $cppNames.push(Set.new(@variables.map { |var| var.name }))
+    body = @body.cpp(settings)
+    $cppNames.pop
+    expansion = %{[&](#{variables.map { |var| %{auto #{var}} }.join(', ')}) -> Code {
           CodeCollectionScope __;
           {
-            #{@body.cpp(settings)}
+            #{body}
           }
           return __.code();
       }
     }
+    return expansion if @name.nil?
+
+    # Named macros are called from many places, often with the same arguments;
+    # see MacroMemo. Anonymous ones are only ever expanded by the macro they are passed to.
+    %{auto #{@name} = [&, __memo = MacroMemo()](#{variables.map { |var| %{auto #{var}} }.join(', ')}) -> Code {
+          return __memo.expand(#{expansion}#{variables.map { |var| %{, #{var}} }.join});
+      }
+    }
   end
 end
 
 class MacroCall
   def cpp(settings)
-    %{#{annotation} #{@name}(#{@operands.map { |var| var.cpp(settings) }.join(', ')})}
+    operands = @operands.map {
+      | operand |
+      if operand.is_a? Variable and not $cppNames.any? { |names| names.include? operand.name }
+        %{"#{operand.name}"}
+      else
+        operand.cpp(settings)
+      end
+    }
+    %{#{annotation} #{@name}(#{operands.join(', ')})}
   end
 end
 
 class MulImmediates
   def cpp(settings)
-    %{#{left.cpp(settings)} * #{right.cpp(settings)}}
+    %{(#{left.cpp(settings)} * #{right.cpp(settings)})}
   end
 end
 
 class NegImmediate
   def cpp(settings)
-    %{-#{@child.cpp(settings)}}
+    %{(-#{@child.cpp(settings)})}
   end
 end
 
@@ -210,19 +253,19 @@ end
 
 class Not
   def cpp(settings)
-    %{!#{operand.cpp(settings)}}
+    %{(!#{operand.cpp(settings)})}
   end
 end
 
 class Or
   def cpp(settings)
-    %{#{left.cpp(settings)} || #{right.cpp(settings)}}
+    %{(#{left.cpp(settings)} || #{right.cpp(settings)})}
   end
 end
 
 class OrImmediates
   def cpp(settings)
-    %{#{left.cpp(settings)} | #{right.cpp(settings)}}
+    %{(#{left.cpp(settings)} | #{right.cpp(settings)})}
   end
 end
 
@@ -246,11 +289,26 @@ class Sequence
       }
       newList.join(";\n") + ";"
   end
+
+  # The top level of a body, where each op() expansion is independent of the
+  # others and can be generated on its own worker; see generateInParallel().
+  def cppTopLevel(settings)
+      @list.map {
+          | item |
+          if item.is_a? Sequence
+              item.cppTopLevel(settings)
+          elsif item.is_a? MacroCall
+              %{generateInParallel([&] { #{item.cpp(settings)}; });}
+          else
+              item.cpp(settings) + ";"
+          end
+      }.join("\n")
+  end
 end
 
 class Setting
   def cpp(settings)
-    %{#{name}}
+    %{OFFLINE_ASM_#{name}}
   end
 end
 
@@ -286,7 +344,7 @@ end
 
 class SubImmediates
   def cpp(settings)
-    %{#{@left.cpp(settings)} - #{@right.cpp(settings)}}
+    %{(#{@left.cpp(settings)} - #{@right.cpp(settings)})}
   end
 end
 
@@ -316,7 +374,7 @@ end
 
 class XorImmediates
   def cpp(settings)
-    %{#{@left.cpp(settings)} ^ #{@right.cpp(settings)}}
+    %{(#{@left.cpp(settings)} ^ #{@right.cpp(settings)})}
   end
 end
 
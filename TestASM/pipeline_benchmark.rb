@@ -0,0 +1,197 @@
+# ruby TestASM/pipeline_benchmark.rb [--sizes=100,1000] [--repetitions=1] [--cxx=clang++]
+#                                    [--json=<results.json>] [--compare=<baseline.json>] [--threshold=10]
+#
+# Times every stage of the offlineasm pipeline on Asm/test.asm and on synthetic
+# inputs made of test.asm plus that many extra op(...) definitions, and reports
+# wall time (the best of --repetitions runs), peak RSS and output size per stage.
+# The last rows of each input compare the Ruby backend (asm.rb) against the C++
+# path (OfflineASMRBToC/asm.rb, building OfflineASM, running it). Building
+# OfflineASM dominates the C++ path: every op() is a lambda of its own, so with
+# 1000 of them the build takes minutes and gigabytes, hence the default sizes.
+#
+# --json writes the results; --compare reads such a file and exits 1 if any
+# stage got slower than it by more than --threshold percent, or failed where it
+# had succeeded. Stages write into build/, because the Cpp sources include their
+# generated headers from there; whatever the stages print goes to
+# build/pipeline_benchmark.log.
+
+require "fiddle"
+require "fileutils"
+require "json"
+require "optparse"
+require "rbconfig"
+
+root = File.expand_path("..", File.dirname(__FILE__))
+sizes = [100, 1000]
+repetitions = 1
+compiler = ENV['CXX'] || "clang++"
+jsonFile = nil
+baselineFile = nil
+threshold = 10.0
+OptionParser.new do |opts|
+    opts.banner = "Usage: pipeline_benchmark.rb [--sizes=<n>,...] [--repetitions=<n>] [--cxx=<compiler>] [--json=<file>] [--compare=<file>] [--threshold=<percent>]"
+    opts.on("--sizes=SIZES", "Numbers of synthetic op() definitions.") { |list| sizes = list.split(",").map(&:to_i) }
+    opts.on("--repetitions=N", Integer, "Runs per stage; the fastest is reported.") { |n| repetitions = n }
+    opts.on("--cxx=COMPILER", "C++ compiler for the extractors and OfflineASM.") { |name| compiler = name }
+    opts.on("--json=FILE", "Write the results as JSON.") { |file| jsonFile = file }
+    opts.on("--compare=FILE", "Fail on regressions against earlier --json results.") { |file| baselineFile = file }
+    opts.on("--threshold=PERCENT", Float, "Allowed slowdown for --compare.") { |percent| threshold = percent }
+end.parse!
+
+buildDirectory = File.join(root, "build")
+FileUtils.mkdir_p(buildDirectory)
+
+#
+# Peak RSS of one child process. ru_maxrss of RUSAGE_CHILDREN covers every
+# child ever waited for, so each stage is run from a fork of its own whose only
+# child is the stage. struct rusage starts with two timevals.
+#
+
+RUSAGE_CHILDREN = -1
+$getrusage = Fiddle::Function.new(Fiddle::Handle::DEFAULT["getrusage"], [Fiddle::TYPE_INT, Fiddle::TYPE_VOIDP], Fiddle::TYPE_INT)
+MAXRSS_OFFSET = 2 * 2 * Fiddle::SIZEOF_LONG
+# Linux reports kilobytes, Darwin bytes.
+MAXRSS_UNIT = RbConfig::CONFIG["host_os"] =~ /darwin/ ? 1 : 1024
+
+def runMeasured(command, log)
+    reader, writer = IO.pipe
+    pid = fork {
+        reader.close
+        start = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+        success = system(*command, :out => File::NULL, :err => [log, "a"])
+        wall = Process.clock_gettime(Process::CLOCK_MONOTONIC) - start
+        usage = Fiddle::Pointer.malloc(256)
+        $getrusage.call(RUSAGE_CHILDREN, usage)
+        rss = usage[MAXRSS_OFFSET, Fiddle::SIZEOF_LONG].unpack1("l!") * MAXRSS_UNIT
+        writer.write([success ? 1 : 0, wall, rss].pack("qdq"))
+        writer.close
+        exit!(0)
+    }
+    writer.close
+    success, wall, rss = reader.read.unpack("qdq")
+    reader.close
+    Process.wait(pid)
+    [success == 1, wall, rss]
+end
+
+def measure(name, command, output, repetitions, log)
+    best = nil
+    repetitions.times {
+        # The scripts skip their work when the output's input hash still matches.
+        FileUtils.rm_f(output)
+        success, wall, rss = runMeasured(command, log)
+        unless success
+            $stderr.puts "pipeline_benchmark: #{name} failed, see #{log}: #{command.join(' ')}"
+            return { "stage" => name, "failed" => true }
+        end
+        best = { "stage" => name, "wall" => wall, "rss" => rss } if not best or wall < best["wall"]
+    }
+    best["size"] = File.size?(output) || 0
+    best
+end
+
+def writeSyntheticInput(root, fileName, count)
+    File.open(fileName, "w") {
+        | outp |
+        outp.puts IO::read(File.join(root, "Asm", "test.asm"))
+        count.times {
+            | i |
+            outp.puts <<~END
+                op(synthetic_op_#{i}, macro()
+                if (ARM64 or ARM64E or X86_64 or ARMv7)
+                    preserveCallerPCAndCFR()
+                    saveIPIntRegisters()
+                    addp #{i}, wa0
+                    restoreIPIntRegisters()
+                    restoreCallerPCAndCFR()
+                    ret
+                else
+                    break
+                end
+                end)
+            END
+        }
+    }
+end
+
+ruby = RbConfig.ruby
+rb = File.join(root, "OfflineASMRB")
+rbToC = File.join(root, "OfflineASMRBToC")
+cpp = File.join(root, "Cpp")
+include = "-I#{cpp}/"
+b = lambda { | name | File.join(buildDirectory, name) }
+log = b.call("pipeline_benchmark.log")
+FileUtils.rm_f(log)
+
+inputs = [["test.asm", File.join(root, "Asm", "test.asm")]]
+sizes.each {
+    | size |
+    fileName = b.call("synthetic_#{size}.asm")
+    writeSyntheticInput(root, fileName, size)
+    inputs << ["synthetic_#{size}", fileName]
+}
+
+results = {}
+inputs.each {
+    | inputName, asmFile |
+    stages = [
+        ["generate_settings_extractor.rb", [ruby, File.join(rb, "generate_settings_extractor.rb"), include, asmFile, b.call("LLIntDesiredSettings.h"), "arm64"], b.call("LLIntDesiredSettings.h")],
+        ["LLIntSettingsExtractor", [compiler, File.join(cpp, "LLIntSettingsExtractor.cpp"), "-o", b.call("LLIntSettingsExtractor_arm64")], b.call("LLIntSettingsExtractor_arm64")],
+        ["generate_offset_extractor.rb", [ruby, File.join(rb, "generate_offset_extractor.rb"), include, asmFile, b.call("LLIntSettingsExtractor"), b.call("LLIntDesiredOffsets.h"), "arm64", "arm64"], b.call("LLIntDesiredOffsets.h")],
+        ["LLIntOffsetsExtractor", [compiler, File.join(cpp, "LLIntOffsetsExtractor.cpp"), "-o", b.call("LLIntOffsetsExtractor_arm64")], b.call("LLIntOffsetsExtractor_arm64")],
+        ["asm.rb", [ruby, File.join(rb, "asm.rb"), include, asmFile, b.call("LLIntOffsetsExtractor"), b.call("LLIntAssembly.h"), "arm64", "--binary-format=ELF"], b.call("LLIntAssembly.h")],
+        ["OfflineASMRBToC/asm.rb", [ruby, File.join(rbToC, "asm.rb"), asmFile, b.call("test.asm.cpp"), "arm64"], b.call("test.asm.cpp")],
+        ["OfflineASM build", [compiler, "-O2", "-std=c++20", File.join(root, "OfflineASMC", "OfflineASM.cpp"), b.call("test.asm.cpp"), "-o", b.call("OfflineASM"), "-lpthread"], b.call("OfflineASM")],
+        ["OfflineASM", [b.call("OfflineASM"), b.call("LLIntAssembly.cpp.h")], b.call("LLIntAssembly.cpp.h")],
+    ]
+    stageResults = stages.map {
+        | name, command, output |
+        measure(name, command, output, repetitions, log)
+    }
+    rubyPath = stageResults.find { | result | result["stage"] == "asm.rb" }
+    cppStages = stageResults.select { | result | ["OfflineASMRBToC/asm.rb", "OfflineASM build", "OfflineASM"].include?(result["stage"]) }
+    stageResults << rubyPath.merge("stage" => "Ruby path (asm.rb)")
+    if cppStages.any? { | result | result["failed"] }
+        stageResults << { "stage" => "C++ path (total)", "failed" => true }
+    else
+        stageResults << { "stage" => "C++ path (total)", "wall" => cppStages.sum { | result | result["wall"] },
+                          "rss" => cppStages.map { | result | result["rss"] }.max, "size" => cppStages.last["size"] }
+    end
+    results[inputName] = stageResults
+}
+
+printf("%-16s %-30s %12s %12s %12s\n", "input", "stage", "wall (ms)", "peak RSS (MB)", "output (KB)")
+results.each {
+    | inputName, stageResults |
+    stageResults.each {
+        | result |
+        if result["failed"]
+            printf("%-16s %-30s %12s\n", inputName, result["stage"], "failed")
+        else
+            printf("%-16s %-30s %12.1f %12.1f %12.1f\n", inputName, result["stage"], result["wall"] * 1000, result["rss"] / 1048576.0, result["size"] / 1024.0)
+        end
+    }
+}
+
+File.write(jsonFile, JSON.pretty_generate(results)) if jsonFile
+
+if baselineFile
+    baseline = JSON.parse(IO::read(baselineFile))
+    regressions = []
+    results.each {
+        | inputName, stageResults |
+        stageResults.each {
+            | result |
+            before = (baseline[inputName] || []).find { | old | old["stage"] == result["stage"] }
+            next if not before or before["failed"]
+            if result["failed"]
+                regressions << "#{inputName} #{result["stage"]}: failed"
+                next
+            end
+            slowdown = (result["wall"] / before["wall"] - 1) * 100
+            regressions << "#{inputName} #{result["stage"]}: #{format('%.1f', slowdown)}% slower" if slowdown > threshold
+        }
+    }
+    regressions.each { | regression | $stderr.puts "pipeline_benchmark: regression: #{regression}" }
+    exit 1 unless regressions.empty?
+end